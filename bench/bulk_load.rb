@@ -0,0 +1,43 @@
+# Loading rows with .load against one insert statement per row.
+#
+# The same random-order rows are loaded both ways into fresh databases;
+# the table reports wall time and the size of the resulting file.
+#
+#   ROWS=1000000 ruby bench/bulk_load.rb
+
+require "benchmark"
+
+DB = "bench.db"
+ROWS_FILE = "bench_rows.txt"
+ROWS = Integer(ENV.fetch("ROWS", "200000"))
+
+def fresh
+  [DB, "#{DB}.wal"].each { |f| File.delete(f) if File.exist?(f) }
+end
+
+keys = (1..ROWS).to_a.shuffle(random: Random.new(1))
+File.write(ROWS_FILE,
+           keys.map { |i| "#{i} user#{i} person#{i}@example.com\n" }.join)
+
+printf("%-8s %10s %12s\n", "method", "seconds", "file_bytes")
+
+fresh
+insert = Benchmark.realtime do
+  IO.popen("./db #{DB} > /dev/null", "w") do |pipe|
+    keys.each { |i| pipe.puts "insert #{i} user#{i} person#{i}@example.com" }
+    pipe.puts ".exit"
+  end
+end
+printf("%-8s %10.3f %12d\n", "insert", insert, File.size(DB))
+
+fresh
+load = Benchmark.realtime do
+  IO.popen("./db #{DB} > /dev/null", "w") do |pipe|
+    pipe.puts ".load #{ROWS_FILE}"
+    pipe.puts ".exit"
+  end
+end
+printf("%-8s %10.3f %12d\n", "load", load, File.size(DB))
+
+fresh
+File.delete(ROWS_FILE)
@@ -0,0 +1,263 @@
+/*
+ * Point lookups per second from 1, 2, 4, ... reader threads sharing one
+ * table, first alone and then alongside a writer inserting rows as fast
+ * as it can.
+ *
+ * The table holds the even ids up to 2 * rows and the pool is large
+ * enough for all of it, so the readers measure latching and the buffer
+ * pool rather than the disk. Lookups read their row as a point select
+ * does, without latches unless that fails; with "-c" as the fourth
+ * argument they go through a cursor instead. Every lookup checks that
+ * it found its row.
+ * The writer inserts odd ids one transaction at a time with syncing
+ * off; afterwards every row it inserted is looked up as well.
+ *
+ *   make bench/concurrent_reads &&
+ *       ./bench/concurrent_reads [rows] [lookups_per_thread] [max_threads]
+ *                                [-c]
+ */
+
+#define main db_main
+#include "../db.c"
+#undef main
+
+#include <time.h>
+
+#define BENCH_DB    "bench.db"
+#define BENCH_WAL   "bench.db.wal"
+
+typedef struct
+{
+    Table     *table;
+    uint32_t   rows;
+    uint32_t   lookups;
+    uint64_t   seed;
+    pthread_t  thread;
+} Reader;
+
+bool use_cursor = false;
+
+typedef struct
+{
+    Table     *table;
+    bool       stop;
+    uint32_t   inserted;
+    pthread_t  thread;
+} Writer;
+
+double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void
+fill_row(Row *row, uint32_t id)
+{
+    row->id = id;
+    snprintf(row->username, sizeof(row->username), "user%u", id);
+    snprintf(row->email, sizeof(row->email), "person%u@example.com", id);
+}
+
+/*
+ * Look the id up and check the row found.
+ */
+void
+check_lookup(Table *table, uint32_t id)
+{
+    Cursor *cursor = table_find(table, id);
+    Row     row;
+
+    if (cursor->cell_num >= *leaf_node_num_cells(cursor->node) ||
+        *leaf_node_key(cursor->node, cursor->cell_num) != id) {
+        printf("Lookup of %u missed its row\n", id);
+        exit(EXIT_FAILURE);
+    }
+    cursor_read_row(cursor, &row);
+    cursor_free(cursor);
+    if (row.id != id) {
+        printf("Lookup of %u found row %u\n", id, row.id);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Look the id up as a point select does.
+ */
+void
+point_lookup(Table *table, uint32_t id)
+{
+    Row row;
+
+    switch (use_cursor ? PEEK_FAILED : table_peek_row(table, id, &row)) {
+    case PEEK_FOUND:
+        if (row.id != id) {
+            printf("Lookup of %u found row %u\n", id, row.id);
+            exit(EXIT_FAILURE);
+        }
+        break;
+    case PEEK_NOT_FOUND:
+        printf("Lookup of %u missed its row\n", id);
+        exit(EXIT_FAILURE);
+    case PEEK_FAILED:
+        check_lookup(table, id);
+        break;
+    }
+}
+
+void *
+reader_run(void *arg)
+{
+    Reader   *reader = arg;
+    uint64_t  state = reader->seed;
+    uint32_t  i;
+
+    for (i = 0; i < reader->lookups; i++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        point_lookup(reader->table,
+                     2 * (uint32_t) (state % reader->rows) + 2);
+    }
+    return NULL;
+}
+
+void *
+writer_run(void *arg)
+{
+    Writer   *writer = arg;
+    Row       row;
+
+    while (!__atomic_load_n(&writer->stop, __ATOMIC_RELAXED)) {
+        fill_row(&row, 2 * writer->inserted + 1);
+        pthread_mutex_lock(&writer->table->pager->write_lock);
+        if (table_insert(writer->table, &row) != EXECUTE_SUCCESS) {
+            printf("Insert of %u failed\n", row.id);
+            exit(EXIT_FAILURE);
+        }
+        pager_commit(writer->table->pager);
+        pthread_mutex_unlock(&writer->table->pager->write_lock);
+        writer->inserted++;
+    }
+    return NULL;
+}
+
+/*
+ * Lookups per second from the given number of readers, with a writer if
+ * one is passed.
+ */
+double
+bench_readers(Table *table, uint32_t rows, uint32_t lookups,
+              uint32_t num_threads, Writer *writer)
+{
+    Reader   *readers = calloc(num_threads, sizeof(Reader));
+    double    start;
+    double    elapsed;
+    uint32_t  i;
+
+    if (writer != NULL) {
+        writer->stop = false;
+        pthread_create(&writer->thread, NULL, writer_run, writer);
+    }
+
+    start = now();
+    for (i = 0; i < num_threads; i++) {
+        readers[i].table = table;
+        readers[i].rows = rows;
+        readers[i].lookups = lookups;
+        readers[i].seed = 88172645463325252ULL + 7919 * (i + 1);
+        pthread_create(&readers[i].thread, NULL, reader_run, &readers[i]);
+    }
+    for (i = 0; i < num_threads; i++) {
+        pthread_join(readers[i].thread, NULL);
+    }
+    elapsed = now() - start;
+
+    if (writer != NULL) {
+        __atomic_store_n(&writer->stop, true, __ATOMIC_RELAXED);
+        pthread_join(writer->thread, NULL);
+    }
+
+    free(readers);
+    return (double) num_threads * lookups / elapsed;
+}
+
+int
+main(int argc, char *argv[])
+{
+    uint32_t   rows = argc > 1 ? strtoul(argv[1], NULL, 10) : 200000;
+    uint32_t   lookups = argc > 2 ? strtoul(argv[2], NULL, 10) : 500000;
+    uint32_t   max_threads = argc > 3 ? strtoul(argv[3], NULL, 10) :
+                                        sysconf(_SC_NPROCESSORS_ONLN);
+    DbOptions  options;
+    Database  *db;
+    Table     *table;
+    Row       *load;
+    Writer     writer;
+    double     alone;
+    double     base = 0;
+    double     rate;
+    uint32_t   threads;
+    uint32_t   i;
+
+    use_cursor = argc > 4 && strcmp(argv[4], "-c") == 0;
+    unlink(BENCH_DB);
+    unlink(BENCH_WAL);
+    options.pool_frames = rows / 20 + 1024;
+    options.read_only = false;
+    options.io_backend = IO_BACKEND_SYNC;
+    options.sync_mode = SYNC_OFF;
+    options.page_size = DEFAULT_PAGE_SIZE;
+    options.search_kernel = KEY_SEARCH_AUTO;
+    options.scan_threads = 1;
+    db = db_open(BENCH_DB, &options);
+    table = db_table(db, DEFAULT_TABLE_NAME);
+
+    load = malloc(sizeof(Row) * rows);
+    for (i = 0; i < rows; i++) {
+        fill_row(&load[i], 2 * i + 2);
+    }
+    table_bulk_load(table, load, rows, BULK_LOAD_FILL_PERCENT);
+    pager_commit(table->pager);
+    free(load);
+
+    /* Warm the pool, so no run pays for reading the table in. */
+    for (i = 0; i < rows; i++) {
+        check_lookup(table, 2 * i + 2);
+    }
+
+    printf("%u rows, %u lookups per thread, millions of lookups per "
+           "second\n", rows, lookups);
+    printf("%7s %10s %8s %12s %12s\n", "threads", "readers", "scaling",
+           "with_writer", "inserts/s");
+
+    writer.table = table;
+    writer.inserted = 0;
+    for (threads = 1; threads <= max_threads; threads *= 2) {
+        uint32_t  before = writer.inserted;
+        double    start;
+
+        alone = bench_readers(table, rows, lookups, threads, NULL);
+        if (threads == 1) {
+            base = alone;
+        }
+        start = now();
+        rate = bench_readers(table, rows, lookups, threads, &writer);
+        printf("%7u %10.2f %7.2fx %12.2f %12.0f\n", threads, alone / 1e6,
+               alone / base, rate / 1e6,
+               (writer.inserted - before) / (now() - start));
+    }
+
+    for (i = 0; i < writer.inserted; i++) {
+        check_lookup(table, 2 * i + 1);
+        point_lookup(table, 2 * i + 1);
+    }
+
+    db_close(db);
+    unlink(BENCH_DB);
+    unlink(BENCH_WAL);
+    return 0;
+}
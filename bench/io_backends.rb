@@ -0,0 +1,95 @@
+# Compare the pread/pwrite and io_uring pager backends.
+#
+# A table of random keys is built once, then each backend runs a cold
+# full scan through a small buffer pool (batched leaf reads) and a
+# checkpoint of many scattered pages (batched writes). The syscall
+# counts come from .stats; times are wall clock around each command.
+#
+#   make bench               # ROWS=200000 by default
+#   ROWS=1000000 make bench
+
+require "benchmark"
+
+DB = "bench.db"
+ROWS = Integer(ENV.fetch("ROWS", "200000"))
+
+# Drive one ./db process, one command at a time.
+class Session
+  def initialize(options)
+    @pipe = IO.popen("./db #{options} #{DB}", "r+")
+    @pipe.sync = true
+    read_prompts(1)
+  end
+
+  # Send one or more commands and return their output once every one
+  # of them has printed its trailing prompt.
+  def run(*commands)
+    @pipe.puts commands
+    read_prompts(commands.size)
+  end
+
+  def stats
+    run(".stats").scan(/^(\w+): (\d+)$/).to_h { |k, v| [k, v.to_i] }
+  end
+
+  def close
+    @pipe.puts ".exit"
+    @pipe.close
+  end
+
+  private
+
+  def read_prompts(count)
+    output = +""
+    seen = 0
+    until seen >= count && output.end_with?("db > ")
+      chunk = @pipe.readpartial(65536)
+      # Include the previous tail so a prompt split across reads counts.
+      seen += (output[-4, 4].to_s + chunk).scan("db > ").size
+      output << chunk
+    end
+    output
+  end
+end
+
+def insert_script(keys)
+  keys.map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+end
+
+File.delete(DB) if File.exist?(DB)
+keys = (1..ROWS).map { |i| i * 2 }.shuffle(random: Random.new(1))
+IO.popen("./db #{DB} > /dev/null", "w") do |pipe|
+  pipe.puts insert_script(keys)
+  pipe.puts ".exit"
+end
+base = File.binread(DB)
+
+# Odd keys land between existing rows, dirtying leaves all over the file.
+# Few enough commits that the log does not reach its own checkpoint.
+extra = (1..800).map { |i| (i * ROWS / 800) * 2 + 1 }
+extra.shuffle!(random: Random.new(2))
+
+printf("%-8s %10s %14s %10s %15s\n",
+       "backend", "scan_s", "read_syscalls", "flush_s", "write_syscalls")
+
+%w[sync uring].each do |backend|
+  File.binwrite(DB, base)
+
+  session = Session.new("-p 256 -i #{backend}")
+  scan = Benchmark.realtime { session.run("select") }
+  read_syscalls = session.stats["read_syscalls"]
+  session.close
+
+  # .flush checkpoints the log, copying every page in it to the file.
+  session = Session.new("-p 65536 -i #{backend}")
+  insert_script(extra).each_slice(1000) { |slice| session.run(*slice) }
+  before = session.stats["write_syscalls"]
+  flush = Benchmark.realtime { session.run(".flush") }
+  write_syscalls = session.stats["write_syscalls"] - before
+  session.close
+
+  printf("%-8s %10.3f %14d %10.3f %15d\n",
+         backend, scan, read_syscalls, flush, write_syscalls)
+end
+
+File.delete(DB)
@@ -0,0 +1,160 @@
+/*
+ * Lookups per second of key_search() over node-sized key arrays, with
+ * each search kernel the CPU supports.
+ *
+ * The arrays are as large as a leaf or internal node of the page size
+ * holds, with internal keys cut to suffixes of 4, 3, 2 and 1 bytes.
+ * They stay hot in cache, so the numbers are of the search alone.
+ * Every kernel is first checked against a plain count of the keys. A
+ * pure binary search, for comparison, is the scalar kernel's with
+ * SCALAR_SEARCH_WINDOW set to 0.
+ *
+ *   make bench/key_search && ./bench/key_search [page_size] [lookups]
+ */
+
+#define main db_main
+#include "../db.c"
+#undef main
+
+#include <time.h>
+
+typedef struct
+{
+    const char      *name;
+    KeySearchKernel  kernel;
+    bool             supported;
+} KernelCase;
+
+uint64_t bench_state = 88172645463325252ULL;
+
+uint32_t
+bench_random(void)
+{
+    bench_state ^= bench_state << 13;
+    bench_state ^= bench_state >> 7;
+    bench_state ^= bench_state << 17;
+    return (uint32_t) bench_state;
+}
+
+int
+compare_keys(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a;
+    uint32_t y = *(const uint32_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * count distinct sorted keys below limit, written width bytes each.
+ */
+void
+fill_keys(uint8_t *keys, uint32_t width, uint32_t count, uint64_t limit)
+{
+    uint32_t *values = malloc(count * sizeof(uint32_t));
+    uint32_t  step = limit / count;
+    uint32_t  i;
+
+    for (i = 0; i < count; i++) {
+        values[i] = i * step + bench_random() % step;
+    }
+    qsort(values, count, sizeof(uint32_t), compare_keys);
+    for (i = 0; i < count; i++) {
+        write_key_bytes(keys + i * width, values[i], width);
+    }
+    free(values);
+}
+
+double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void
+bench_node(const char *node, uint32_t width, uint32_t count,
+           uint32_t lookups, KernelCase *kernels, uint32_t num_kernels)
+{
+    uint64_t  limit = width == 4 ? (1ULL << 32) : 1ULL << (8 * width);
+    uint8_t  *keys = malloc(count * width + 32);
+    uint32_t *probes = malloc(lookups * sizeof(uint32_t));
+    uint32_t  i, k;
+
+    if (count > limit) {
+        count = limit;
+    }
+    fill_keys(keys, width, count, limit);
+    for (i = 0; i < lookups; i++) {
+        probes[i] = bench_random() % limit;
+    }
+
+    printf("%-10s %5u %6u", node, width, count);
+    for (k = 0; k < num_kernels; k++) {
+        volatile uint32_t  sink = 0;
+        double             start;
+
+        if (!kernels[k].supported) {
+            printf(" %10s", "-");
+            continue;
+        }
+        key_search_init(kernels[k].kernel);
+        for (i = 0; i < 1000; i++) {
+            if (key_search(keys, width, count, probes[i]) !=
+                key_count_below_scalar(keys, width, count, probes[i])) {
+                printf("\n%s kernel disagrees\n", kernels[k].name);
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        start = now();
+        for (i = 0; i < lookups; i++) {
+            sink += key_search(keys, width, count, probes[i]);
+        }
+        printf(" %10.1f", lookups / (now() - start) / 1e6);
+    }
+    printf("\n");
+
+    free(probes);
+    free(keys);
+}
+
+int
+main(int argc, char *argv[])
+{
+    KernelCase kernels[] = {
+        { "scalar", KEY_SEARCH_SCALAR, true },
+        { "sse4", KEY_SEARCH_SSE4, false },
+        { "avx2", KEY_SEARCH_AVX2, false },
+    };
+    uint32_t   num_kernels = sizeof(kernels) / sizeof(kernels[0]);
+    uint32_t   page_size = argc > 1 ? strtoul(argv[1], NULL, 10) :
+                                      DEFAULT_PAGE_SIZE;
+    uint32_t   lookups = argc > 2 ? strtoul(argv[2], NULL, 10) : 5000000;
+    uint32_t   width, k;
+
+    set_page_size(page_size);
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    kernels[1].supported = __builtin_cpu_supports("sse4.1");
+    kernels[2].supported = __builtin_cpu_supports("avx2");
+#endif
+
+    printf("page size %u, millions of lookups per second\n", page_size);
+    printf("%-10s %5s %6s", "node", "width", "keys");
+    for (k = 0; k < num_kernels; k++) {
+        printf(" %10s", kernels[k].name);
+    }
+    printf("\n");
+
+    bench_node("leaf", LEAF_NODE_KEY_SIZE, LEAF_NODE_MAX_CELLS, lookups,
+               kernels, num_kernels);
+    for (width = 4; width >= 1; width--) {
+        bench_node("internal", width, internal_node_capacity(4 - width),
+                   lookups, kernels, num_kernels);
+    }
+
+    return 0;
+}
@@ -0,0 +1,157 @@
+/*
+ * Rows per second of a full scan split over 1, 2, 4, ... threads, on a
+ * warm pool.
+ *
+ * Each thread counts the rows of its range and sums their ids, and the
+ * totals are checked against the table. With fewer root children than
+ * threads there are fewer ranges; the table shows how many were used.
+ *
+ *   make bench/parallel_scan &&
+ *       ./bench/parallel_scan [rows] [scans] [max_threads]
+ */
+
+#define main db_main
+#include "../db.c"
+#undef main
+
+#include <time.h>
+
+#define BENCH_DB    "bench.db"
+#define BENCH_WAL   "bench.db.wal"
+#define MAX_PARTS   256
+
+/* A cache line each, so the threads do not share their counters. */
+typedef struct
+{
+    uint64_t  rows;
+    uint64_t  id_sum;
+} __attribute__((aligned(CACHE_LINE_SIZE))) Counter;
+
+double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void
+visit_count_row(void *arg, Row *row)
+{
+    Counter *counter = arg;
+
+    counter->rows++;
+    counter->id_sum += row->id;
+}
+
+/*
+ * Scan the whole table with up to max_parts threads. Returns the number
+ * of ranges used.
+ */
+uint32_t
+scan(Table *table, uint32_t max_parts, uint64_t *rows, uint64_t *id_sum)
+{
+    ScanPart  parts[MAX_PARTS];
+    Counter   counters[MAX_PARTS];
+    uint32_t  last_keys[MAX_PARTS];
+    uint32_t  num_parts;
+    uint32_t  i;
+
+    num_parts = table_scan_split(table, 0, UINT32_MAX, max_parts, last_keys);
+    for (i = 0; i < num_parts; i++) {
+        parts[i].table = table;
+        parts[i].first_key = i == 0 ? 0 : last_keys[i - 1] + 1;
+        parts[i].last_key = last_keys[i];
+        parts[i].visit = visit_count_row;
+        parts[i].arg = &counters[i];
+        counters[i].rows = 0;
+        counters[i].id_sum = 0;
+    }
+    table_scan_parallel(parts, num_parts);
+
+    *rows = 0;
+    *id_sum = 0;
+    for (i = 0; i < num_parts; i++) {
+        *rows += counters[i].rows;
+        *id_sum += counters[i].id_sum;
+    }
+    return num_parts;
+}
+
+int
+main(int argc, char *argv[])
+{
+    uint32_t   num_rows = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+    uint32_t   scans = argc > 2 ? strtoul(argv[2], NULL, 10) : 5;
+    uint32_t   max_threads = argc > 3 ? strtoul(argv[3], NULL, 10) :
+                                        sysconf(_SC_NPROCESSORS_ONLN);
+    DbOptions  options;
+    Database  *db;
+    Table     *table;
+    Row       *load;
+    double     base = 0;
+    double     start;
+    double     rate;
+    uint64_t   rows;
+    uint64_t   id_sum;
+    uint32_t   num_parts = 0;
+    uint32_t   threads;
+    uint32_t   i;
+
+    if (max_threads > MAX_PARTS) {
+        max_threads = MAX_PARTS;
+    }
+
+    unlink(BENCH_DB);
+    unlink(BENCH_WAL);
+    options.pool_frames = num_rows / 20 + 1024;
+    options.read_only = false;
+    options.io_backend = IO_BACKEND_SYNC;
+    options.sync_mode = SYNC_OFF;
+    options.page_size = DEFAULT_PAGE_SIZE;
+    options.search_kernel = KEY_SEARCH_AUTO;
+    options.scan_threads = 1;
+    db = db_open(BENCH_DB, &options);
+    table = db_table(db, DEFAULT_TABLE_NAME);
+
+    load = malloc(sizeof(Row) * num_rows);
+    for (i = 0; i < num_rows; i++) {
+        load[i].id = i + 1;
+        snprintf(load[i].username, sizeof(load[i].username), "user%u", i + 1);
+        snprintf(load[i].email, sizeof(load[i].email),
+                 "person%u@example.com", i + 1);
+    }
+    table_bulk_load(table, load, num_rows, BULK_LOAD_FILL_PERCENT);
+    pager_commit(table->pager);
+    free(load);
+
+    /* Warm the pool. */
+    scan(table, 1, &rows, &id_sum);
+
+    printf("%u rows, millions of rows scanned per second\n", num_rows);
+    printf("%7s %7s %10s %8s\n", "threads", "ranges", "rows/s", "scaling");
+    for (threads = 1; threads <= max_threads; threads *= 2) {
+        start = now();
+        for (i = 0; i < scans; i++) {
+            num_parts = scan(table, threads, &rows, &id_sum);
+            if (rows != num_rows ||
+                id_sum != (uint64_t) num_rows * (num_rows + 1) / 2) {
+                printf("Scan with %u threads saw %lu rows\n", threads,
+                       (unsigned long) rows);
+                exit(EXIT_FAILURE);
+            }
+        }
+        rate = (double) scans * num_rows / (now() - start);
+        if (threads == 1) {
+            base = rate;
+        }
+        printf("%7u %7u %10.2f %7.2fx\n", threads, num_parts, rate / 1e6,
+               rate / base);
+    }
+
+    db_close(db);
+    unlink(BENCH_DB);
+    unlink(BENCH_WAL);
+    return 0;
+}
@@ -0,0 +1,54 @@
+# Cold full-table scans against the raw sequential read bandwidth of
+# the same file.
+#
+# The table is built from random keys so leaves are scattered through
+# the file. Before each run the file is dropped from the page cache
+# (dd iflag=nocache), then a select is timed with the buffer pool on
+# both I/O backends and with the read-only mmap pager.
+#
+#   ROWS=2000000 ruby bench/scan_readahead.rb
+
+require "benchmark"
+
+DB = "bench.db"
+ROWS = Integer(ENV.fetch("ROWS", "500000"))
+
+def drop_cache
+  system("dd if=#{DB} iflag=nocache count=0 status=none") or
+    abort "dd iflag=nocache is needed to drop #{DB} from the page cache"
+end
+
+def cold_run(command)
+  drop_cache
+  output = nil
+  seconds = Benchmark.realtime { output = `#{command}` }
+  [seconds, output]
+end
+
+File.delete(DB) if File.exist?(DB)
+keys = (1..ROWS).to_a.shuffle(random: Random.new(1))
+IO.popen("./db #{DB} > /dev/null", "w") do |pipe|
+  keys.each { |i| pipe.puts "insert #{i} user#{i} person#{i}@example.com" }
+  pipe.puts ".exit"
+end
+mb = File.size(DB) / 1048576.0
+
+printf("%-12s %10s %10s %16s\n", "scan", "seconds", "MB/s", "readahead_pages")
+
+seconds, = cold_run("dd if=#{DB} of=/dev/null bs=1M status=none")
+printf("%-12s %10.3f %10.1f %16s\n", "dd", seconds, mb / seconds, "-")
+
+{
+  "sync" => "-i sync",
+  "uring" => "-i uring",
+  "mmap" => "-r",
+}.each do |name, options|
+  seconds, output = cold_run(
+    "printf 'select\\n.stats\\n.exit\\n' | ./db #{options} #{DB}")
+  rows = output.scan("@example.com)").size
+  abort "#{name}: scanned #{rows} rows, expected #{ROWS}" if rows != ROWS
+  readahead = output[/^readahead_pages: (\d+)$/, 1]
+  printf("%-12s %10.3f %10.1f %16s\n", name, seconds, mb / seconds, readahead)
+end
+
+File.delete(DB)
@@ -0,0 +1,95 @@
+# Inserts and point lookups per second through the REPL, against the
+# binary protocol of server mode one request at a time and pipelined.
+#
+# Every method inserts the same random-order rows into a fresh database
+# and then looks each of them up. The REPL is fed through a pipe; the
+# server is reached over a Unix domain socket, waiting for each reply
+# before the next request or sending DEPTH requests at a time.
+#
+#   ROWS=200000 DEPTH=64 ruby bench/server_protocol.rb
+
+require "benchmark"
+require "socket"
+
+DB = "bench.db"
+SOCKET = "bench.sock"
+ROWS = Integer(ENV.fetch("ROWS", "50000"))
+DEPTH = Integer(ENV.fetch("DEPTH", "64"))
+
+WIRE_INSERT = 1
+WIRE_GET = 3
+
+def fresh
+  [DB, "#{DB}.wal"].each { |f| File.delete(f) if File.exist?(f) }
+end
+
+def frame(op, body)
+  [body.bytesize + 1, op].pack("VC") + body
+end
+
+def insert_frame(i)
+  username = "user#{i}"
+  email = "person#{i}@example.com"
+  frame(WIRE_INSERT, [i, username.bytesize].pack("Vv") + username +
+                     [email.bytesize].pack("v") + email)
+end
+
+def get_frame(i)
+  frame(WIRE_GET, [i].pack("V"))
+end
+
+# Send the frames depth at a time and check every reply is a success.
+def exchange(socket, frames, depth)
+  frames.each_slice(depth) do |slice|
+    socket.write(slice.join)
+    slice.size.times do
+      length = socket.read(4).unpack1("V")
+      status = socket.read(length).getbyte(0)
+      raise "request failed with status #{status}" if status != 0
+    end
+  end
+end
+
+def serve
+  fresh
+  File.delete(SOCKET) if File.exist?(SOCKET)
+  pid = spawn("./db -l #{SOCKET} #{DB}")
+  sleep 0.01 until File.exist?(SOCKET)
+  socket = UNIXSocket.new(SOCKET)
+  yield socket
+  socket.close
+  Process.kill("TERM", pid)
+  Process.wait(pid)
+end
+
+keys = (1..ROWS).to_a.shuffle(random: Random.new(1))
+inserts = keys.map { |i| insert_frame(i) }
+gets = keys.map { |i| get_frame(i) }
+
+printf("%-10s %12s %12s\n", "method", "inserts/s", "lookups/s")
+
+fresh
+insert = Benchmark.realtime do
+  IO.popen("./db #{DB} > /dev/null", "w") do |pipe|
+    keys.each { |i| pipe.puts "insert #{i} user#{i} person#{i}@example.com" }
+    pipe.puts ".exit"
+  end
+end
+lookup = Benchmark.realtime do
+  IO.popen("./db #{DB} > /dev/null", "w") do |pipe|
+    keys.each { |i| pipe.puts "select where id = #{i}" }
+    pipe.puts ".exit"
+  end
+end
+printf("%-10s %12.0f %12.0f\n", "repl", ROWS / insert, ROWS / lookup)
+
+[1, DEPTH].each do |depth|
+  serve do |socket|
+    insert = Benchmark.realtime { exchange(socket, inserts, depth) }
+    lookup = Benchmark.realtime { exchange(socket, gets, depth) }
+  end
+  printf("%-10s %12.0f %12.0f\n", "depth #{depth}", ROWS / insert,
+         ROWS / lookup)
+end
+
+fresh
@@ -1,12 +1,32 @@
+#define _GNU_SOURCE     /* For writer-preferring rwlocks */
+
+#include <ctype.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <errno.h>
+#include <limits.h>
+#include <time.h>
 
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/io_uring.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #define unused(expr) ((void) (expr))
 
@@ -23,6 +43,11 @@ enum ExecuteResult_t
     EXECUTE_SUCCESS,
     EXECUTE_DUPLICATE_KEY,
     EXECUTE_TABLE_FULL,
+    EXECUTE_READ_ONLY,
+    EXECUTE_INDEX_EXISTS,
+    EXECUTE_TABLE_EXISTS,
+    EXECUTE_CATALOG_FULL,
+    EXECUTE_NO_TABLE,
     EXECUTE_UNKNOWN_STMT
 };
 typedef enum ExecuteResult_t ExecuteResult;
@@ -47,10 +72,38 @@ typedef enum PrepareResult_t PrepareResult;
 enum StatementType_t
 {
     STATEMENT_INSERT,
-    STATEMENT_SELECT
+    STATEMENT_SELECT,
+    STATEMENT_DELETE,
+    STATEMENT_CREATE_INDEX,
+    STATEMENT_CREATE_TABLE
 };
 typedef enum StatementType_t StatementType;
 
+/*
+ * The columns of a row. Every column after the id may have an index.
+ */
+enum Column_t
+{
+    COLUMN_ID,
+    COLUMN_USERNAME,
+    COLUMN_EMAIL,
+    NUM_COLUMNS
+};
+typedef enum Column_t Column;
+
+/*
+ * What a select returns: its rows, or one value computed from their ids.
+ */
+enum Aggregate_t
+{
+    AGGREGATE_NONE,
+    AGGREGATE_COUNT,
+    AGGREGATE_MIN,
+    AGGREGATE_MAX,
+    AGGREGATE_SUM
+};
+typedef enum Aggregate_t Aggregate;
+
 #define COLUMN_USERNAME_SIZE    32
 #define COLUMN_EMAIL_SIZE       255
 struct Row_t
@@ -64,46 +117,484 @@ typedef struct Row_t Row;
 struct Statement_t
 {
     StatementType type;
-    Row           row_to_insert;  /* Only used by insert statement */
+    Row          *rows_to_insert; /* Only used by insert statement */
+    uint32_t      num_rows;
+    uint32_t      first_id;       /* Range of ids for select and delete */
+    uint32_t      last_id;
+    Aggregate     aggregate;      /* Only used by select statement */
+    Column        column;         /* Of the where clause of select, or */
+                                  /* of create index */
+    char         *value;          /* Select's value when column isn't id */
+    char         *table_name;     /* Table the statement names, or the */
+                                  /* one created */
 };
 typedef struct Statement_t Statement;
 
 #define size_of_attribute(Struct, Attribute) sizeof(((Struct *)0)->Attribute)
 
+/*
+ * A serialized row is its id followed by each string column as a
+ * length and that many bytes, without the terminator.
+ */
 #define ID_SIZE          size_of_attribute(Row, id)
-#define USERNAME_SIZE    size_of_attribute(Row, username)
-#define EMAIL_SIZE       size_of_attribute(Row, email)
-#define ID_OFFSET        0
-#define USERNAME_OFFSET  (ID_OFFSET + ID_SIZE)
-#define EMAIL_OFFSET     (USERNAME_OFFSET + USERNAME_SIZE)
-#define ROW_SIZE         (ID_SIZE + USERNAME_SIZE + EMAIL_SIZE)
+#define LENGTH_SIZE      sizeof(uint16_t)
+#define ROW_MIN_SIZE     (ID_SIZE + LENGTH_SIZE + LENGTH_SIZE)
+#define ROW_MAX_SIZE     \
+    (ROW_MIN_SIZE + COLUMN_USERNAME_SIZE + COLUMN_EMAIL_SIZE)
+
+/*
+ * Pages are a power of two from MIN_PAGE_SIZE to MAX_PAGE_SIZE bytes,
+ * chosen when the database is created and kept in its meta page.
+ */
+#define DEFAULT_PAGE_SIZE  4096
+#define MIN_PAGE_SIZE      4096
+#define MAX_PAGE_SIZE      65536
+
+/*
+ * A tree of uint32 keys is at most TREE_MAX_LEVELS deep with the
+ * smallest pages, whose internal nodes other than the root have at
+ * least 256 children. A writer holds a page on each level of its path,
+ * a new page or a sibling on each level and one more for a new root,
+ * and the meta page, so the pool needs that many frames.
+ */
+#define TREE_MAX_LEVELS      5
+#define DEFAULT_POOL_FRAMES  256
+#define MIN_POOL_FRAMES      (2 * TREE_MAX_LEVELS + 2)
+#define INVALID_FRAME        (-1)
+#define FLUSH_MAX_PAGES      256    /* Pages per pwritev(), below IOV_MAX */
+#define IO_RING_ENTRIES      64
+#define SCAN_PREFETCH_PAGES  32
+#define SCAN_READAHEAD_MIN   8      /* First readahead window of a scan */
+#define SCAN_READAHEAD_MAX   512    /* Largest window, in leaf pages */
+#define SCALAR_SEARCH_WINDOW 8      /* Keys left for the scalar kernel */
+#define VECTOR_SEARCH_WINDOW 64     /* and for the vector ones */
+#define INVALID_PAGE_NUM     UINT32_MAX
+#define PAGER_LOCK_STRIPES   64     /* Locks the hash chains are split over */
+#define CACHE_LINE_SIZE      64
+#define OPTIMISTIC_RETRIES   4      /* Unlatched descents before latching */
+#define INDEX_HOME_MASK      0x7fffffff /* Keys a value may hash to */
+/* Ids an index entry holds, within the largest payload a cell takes. */
+#define INDEX_MAX_IDS        \
+    ((UINT16_MAX - ID_SIZE - LENGTH_SIZE - COLUMN_EMAIL_SIZE) / ID_SIZE)
+
+#define SERVER_MAX_EVENTS    64
+#define SERVER_READ_SIZE     65536
+#define SERVER_BUFFER_LIMIT  (4 << 20)  /* Bytes a connection holds at once */
+#define WIRE_MAX_FRAME       (16 << 20)
+
+#define WAL_MAGIC               0x57414c31  /* "WAL1" */
+#define WAL_HEADER_SIZE         16
+#define WAL_FRAME_HEADER_SIZE   16
+#define WAL_FRAME_SIZE          (WAL_FRAME_HEADER_SIZE + PAGE_SIZE)
+#define WAL_CHECKPOINT_FRAMES   1000    /* Log size that forces a checkpoint */
+#define CHECKPOINT_BATCH_BYTES  (4 << 20)   /* Read from the log at once */
+
+#define META_MAGIC      0x31424454  /* "TDB1" */
+#define META_VERSION    6   /* 2: slotted leaves, 3: internal prefixes, */
+                            /* 4: keys stored together, 5: indexes, */
+                            /* 6: catalog */
+#define META_NODES_VERSION  4   /* Last version that changed the nodes */
+#define META_INDEXES_VERSION    5   /* First version with indexes */
+
+#define CATALOG_NAME_SIZE   32      /* Of a table, with its terminator */
+#define CATALOG_MAX_TABLES  84      /* Entries that fit the smallest page */
+#define DEFAULT_TABLE_NAME  "users" /* Of statements that name no table */
+#define SCHEMA_USERS        1       /* Columns id, username and email */
+
+#define BULK_LOAD_FILL_PERCENT  100     /* Default fill of loaded nodes */
+#define BULK_LOAD_MIN_FILL      10
+#define BULK_LOAD_MAX_LEVELS    16
+
+/*
+ * A frame is one page-sized slot of the buffer pool. A frame whose
+ * pin_count is non-zero is in use by someone holding a pointer into
+ * it and must not be evicted.
+ *
+ * The latch guards the contents of the page against concurrent use:
+ * readers hold it shared and the writer exclusively. Only a pinned
+ * page may be latched.
+ *
+ * The version lets readers do without the latch, see pager_peek_frame().
+ * It is odd while the writer holds the latch and while the frame is
+ * between pages, and goes up by one at each change, so a reader that
+ * sees the same even version before and after reading the page has
+ * read it whole.
+ */
+typedef struct Frame_t
+{
+    uint32_t          page_num;
+    uint32_t          pin_count;
+    bool              in_use;       /* Holds a page */
+    bool              dirty;        /* Modified since it was read or written */
+    bool              referenced;   /* CLOCK reference bit */
+    int32_t           hash_next;    /* Next frame in the same hash bucket */
+    void             *data;
+    pthread_rwlock_t  latch;
+    uint64_t          version;
+} Frame;
+
+/*
+ * One of the locks the hash buckets of the buffer pool are spread over.
+ * It guards the chains of its buckets and the pin counts of the frames
+ * on them; hits are counted under it. Each stripe has a cache line of
+ * its own, so lookups of pages in different stripes do not contend.
+ */
+typedef struct PagerStripe_t
+{
+    pthread_mutex_t  lock;
+    uint64_t         hits;
+} __attribute__((aligned(CACHE_LINE_SIZE))) PagerStripe;
+
+typedef struct PagerStats_t
+{
+    uint64_t  misses;
+    uint64_t  evictions;
+    uint64_t  prefetched;
+    uint64_t  readahead;        /* Pages hinted to the kernel ahead of a scan */
+    uint64_t  bytes_written;
+    uint64_t  read_syscalls;
+    uint64_t  write_syscalls;
+    uint64_t  wal_frames;
+    uint64_t  wal_commits;
+    uint64_t  wal_syncs;
+    uint64_t  checkpoints;
+} PagerStats;
+
+typedef enum { IO_BACKEND_SYNC, IO_BACKEND_URING } IoBackend;
+
+/*
+ * How hard a commit tries to reach the disk. Every mode appends the
+ * commit to the log before the statement returns, so it survives the
+ * process dying:
+ *
+ * - SYNC_OFF never calls fdatasync().
+ * - SYNC_NORMAL syncs the log before a checkpoint copies it into the
+ *   database file, and the file afterwards. A power loss can lose the
+ *   latest commits but never tears the tree.
+ * - SYNC_FULL also syncs the log on every commit.
+ */
+typedef enum { SYNC_OFF, SYNC_NORMAL, SYNC_FULL } SyncMode;
 
-#define PAGE_SIZE        4096
-#define TABLE_MAX_PAGES  100
+/*
+ * How a node is searched once a binary search has narrowed its keys
+ * down to a window: one key at a time, or a vector of them.
+ */
+typedef enum
+{
+    KEY_SEARCH_AUTO,
+    KEY_SEARCH_SCALAR,
+    KEY_SEARCH_SSE4,
+    KEY_SEARCH_AVX2
+} KeySearchKernel;
+
+/*
+ * The write-ahead log is a header followed by frames, each a frame
+ * header and a page image. The last frame of a transaction has commit
+ * set to the size of the database in pages; recovery ignores frames
+ * after the last commit. A frame only counts if its salt matches the
+ * header's, which changes on every checkpoint, and its checksum holds.
+ */
+typedef struct WalHeader_t
+{
+    uint32_t  magic;
+    uint32_t  page_size;
+    uint32_t  salt;
+    uint32_t  checksum;
+} WalHeader;
+
+typedef struct WalFrameHeader_t
+{
+    uint32_t  page_num;
+    uint32_t  commit;
+    uint32_t  salt;
+    uint32_t  checksum;     /* Of the fields above and the page image */
+} WalFrameHeader;
+
+/*
+ * Group commit. Frames are counted as they are appended; a committer
+ * that needs its frames on disk either finds them already synced,
+ * waits for the fdatasync() in progress, or becomes the leader and
+ * syncs everything appended so far for all waiting committers.
+ */
+typedef struct GroupCommit_t
+{
+    pthread_mutex_t  lock;
+    pthread_cond_t   synced;
+    bool             syncing;   /* A leader is inside fdatasync() */
+    uint64_t         appended;  /* Frames written to the log, ever */
+    uint64_t         durable;   /* Frames known to be on disk */
+} GroupCommit;
+
+/*
+ * A minimal io_uring: the submission and completion rings and the SQE
+ * array, all shared with the kernel through mmap().
+ */
+typedef struct IoRing_t
+{
+    int                   ring_fd;
+    uint32_t              entries;
+    unsigned             *sq_head;
+    unsigned             *sq_tail;
+    unsigned             *sq_mask;
+    unsigned             *sq_array;
+    unsigned             *cq_head;
+    unsigned             *cq_tail;
+    unsigned             *cq_mask;
+    struct io_uring_sqe  *sqes;
+    struct io_uring_cqe  *cqes;
+    void                 *ring_ptr;
+    size_t                ring_length;
+    size_t                sqes_length;
+} IoRing;
+
+/*
+ * Options chosen when the database is opened. A read-only database is
+ * served straight out of a shared mapping of the file instead of the
+ * buffer pool.
+ */
+typedef struct DbOptions_t
+{
+    uint32_t  pool_frames;
+    bool      read_only;
+    IoBackend io_backend;
+    SyncMode  sync_mode;
+    uint32_t  page_size;    /* For a new database */
+    KeySearchKernel search_kernel;
+    uint32_t  scan_threads;
+} DbOptions;
 
 typedef struct Pager_t
 {
-    int       file_descriptor;
-    uint32_t  file_length;
-    uint32_t  num_pages;
-    void     *pages[TABLE_MAX_PAGES];
+    int         file_descriptor;
+    uint64_t    file_length;
+    uint32_t    num_pages;
+    bool        read_only;
+    char       *map;            /* Whole file, only when read_only */
+    int         map_advice;     /* Last madvise() hint for the mapping */
+    uint32_t    num_frames;
+    Frame      *frames;
+    void       *frame_data;     /* num_frames * PAGE_SIZE bytes */
+    int32_t    *buckets;        /* page_num -> first frame of the chain */
+    uint32_t    bucket_mask;
+    uint32_t    clock_hand;
+    IoRing     *ring;           /* Batched I/O, NULL for pread/pwrite */
+    int         wal_fd;         /* -1 when read_only */
+    char       *wal_path;
+    uint32_t    wal_salt;
+    uint32_t    wal_frames;     /* Frames since the last checkpoint */
+    uint32_t    wal_txn_frames; /* Of those, frames not yet committed */
+    uint32_t   *wal_index;      /* page_num -> 1 + its latest frame, or 0 */
+    uint32_t    wal_index_length;
+    SyncMode    sync_mode;
+    GroupCommit group;
+    PagerStats  stats;
+    /*
+     * A hit only takes the stripe of its page. Misses, evictions and
+     * everything that reads or writes the files take lock as well, so
+     * changing a hash chain takes both and looking one up takes either.
+     */
+    pthread_mutex_t  lock;
+    PagerStripe     *stripes;
+    pthread_mutex_t  write_lock;    /* Held by the writer, see Table */
+    uint32_t        *write_latches; /* Pages the writer holds exclusively */
+    uint32_t         num_write_latches;
+    uint32_t         write_latches_capacity;
 } Pager;
 
+/*
+ * Many threads may read a table while one writes it. Readers latch
+ * their way down the tree, see table_find(). The writer also holds the
+ * pager's write_lock from its first change through its commit, so one
+ * transaction at a time writes any of the tables of a file.
+ *
+ * An index is a tree of its own in the same file, with a Table of its
+ * own sharing the pager, see index_insert().
+ */
 struct Table_t
 {
-    Pager      *pager;
-    uint32_t    root_page_num;
+    Pager           *pager;
+    uint32_t         root_page_num;
+    uint32_t         rightmost_leaf; /* Last leaf the writer found at the */
+                                     /* right edge, a hint */
+    uint32_t         write_space;    /* Leaf bytes the write may need */
+    uint32_t         scan_threads;   /* Threads a full select may use */
+    uint32_t         root_offset;    /* Meta page field naming the root */
+    Column           column;         /* Column of an index */
+    struct Table_t  *indexes[NUM_COLUMNS]; /* By column, NULL for none */
+    char             name[CATALOG_NAME_SIZE];
 };
 typedef struct Table_t Table;
 
+/*
+ * An open file: its pager and the tables its catalog lists, in the
+ * order they were created. A new table is published by storing it and
+ * then raising num_tables, so readers may look tables up while one is
+ * created.
+ */
+typedef struct Database_t
+{
+    Pager     *pager;
+    Table     *tables[CATALOG_MAX_TABLES];
+    uint32_t   num_tables;
+    uint32_t   scan_threads;
+} Database;
+
+typedef void (*RowVisitor)(void *arg, Row *row);
+
+/*
+ * One range of keys of a parallel scan, see table_scan_parallel(). The
+ * visitor gets the rows of the range in order, each range its own arg.
+ */
+typedef struct ScanPart_t
+{
+    Table      *table;
+    uint32_t    first_key;
+    uint32_t    last_key;
+    RowVisitor  visit;
+    void       *arg;
+    pthread_t   thread;
+} ScanPart;
+
+/*
+ * A row's id and value, while many rows are added to or removed from an
+ * index, with the value's home.
+ */
+typedef struct IndexEntry_t
+{
+    uint32_t  key;
+    uint32_t  id;
+    char     *value;
+} IndexEntry;
+
+/*
+ * A value's entry in an index, as read from or written to its tree.
+ */
+typedef struct IndexValue_t
+{
+    uint32_t   key;
+    char       value[COLUMN_EMAIL_SIZE + 1];
+    uint32_t  *ids;
+    uint32_t   num_ids;
+} IndexValue;
+
+/*
+ * Rows gathered by a scan, or for an index being built the entries of
+ * their column.
+ */
+typedef struct RowList_t
+{
+    Row         *rows;
+    IndexEntry  *entries;
+    uint32_t     count;
+    uint32_t     capacity;
+    Column       column;
+} RowList;
+
+/*
+ * Printed rows kept for later, by a scan that is not the first in order,
+ * or the bytes a connection has read or is to write.
+ */
+typedef struct RowBuffer_t
+{
+    char    *data;
+    size_t   length;
+    size_t   capacity;
+} RowBuffer;
+
+/*
+ * Server Wire Protocol. A request is a frame: its length as a uint32,
+ * counting what follows, then an opcode byte and the body. A reply is a
+ * frame with a status byte in place of the opcode. Numbers are in the
+ * byte order of the host, as in the file; the server listens only on
+ * this host. A row is written as the table stores it, see
+ * serialize_row(): the id, then each string as a uint16 length and its
+ * bytes.
+ *
+ * - WIRE_INSERT takes one row and WIRE_BATCH a uint32 count and that
+ *   many rows, inserted all together or not at all. Both reply with
+ *   their status alone. As at the prompt, an id above INT_MAX is a bad
+ *   request.
+ * - WIRE_GET takes an id and replies with its row.
+ * - WIRE_RANGE takes a first and a last id and replies with a uint32
+ *   count and the rows between the two, inclusive, in order. A reply
+ *   stops once it holds SERVER_BUFFER_LIMIT bytes, with the status
+ *   WIRE_MORE; the client asks again from after the last id it got.
+ *
+ * A client may send many requests without waiting. The replies come
+ * back in the order of the requests.
+ */
+enum WireOp_t
+{
+    WIRE_INSERT = 1,
+    WIRE_BATCH,
+    WIRE_GET,
+    WIRE_RANGE
+};
+typedef enum WireOp_t WireOp;
+
+enum WireStatus_t
+{
+    WIRE_OK,
+    WIRE_NOT_FOUND,
+    WIRE_DUPLICATE_KEY,
+    WIRE_TABLE_FULL,
+    WIRE_READ_ONLY,
+    WIRE_BAD_REQUEST,
+    WIRE_MORE
+};
+typedef enum WireStatus_t WireStatus;
+
+typedef struct Connection_t
+{
+    int        fd;
+    RowBuffer  in;
+    RowBuffer  out;
+    size_t     sent;        /* Bytes of out already written */
+    uint32_t   events;      /* Those it is registered for */
+    bool       closed;      /* By the client, which still gets its replies */
+} Connection;
+
+/*
+ * A cursor keeps the page it points into pinned and latched until it is
+ * moved to another page or released by cursor_free().
+ */
 typedef struct {
     Table    *table;
     uint32_t  page_num;
     uint32_t  cell_num;
+    void     *node;         /* The pinned page at page_num */
     bool      end_of_table; /* Indicates a position one past the last element */
+    uint32_t  prefetch_parent;  /* Parent whose children are being read ahead */
+    uint32_t  prefetch_end;     /* First child of it not yet in the pool */
+    uint32_t  readahead_end;    /* First child of it not yet hinted */
+    uint32_t  readahead_window; /* Pages to hint next, grows while scanning */
+    uint32_t  end_key;          /* Last key the scan wants; bounds read ahead */
 } Cursor;
 
-typedef enum { NODE_INTERNAL, NODE_LEAF } NodeType;
+typedef enum { NODE_INTERNAL, NODE_LEAF, NODE_FREE, NODE_OVERFLOW } NodeType;
+
+typedef enum { PEEK_FOUND, PEEK_NOT_FOUND, PEEK_FAILED } PeekResult;
+
+/*
+ * The keys and children of an internal node written out in full, for
+ * the operations that rewrite one. keys[i] separates children[i] from
+ * children[i + 1]; the last child is the node's right child. There is
+ * room for the cells of two nodes at their narrowest and a few more,
+ * in the largest pages.
+ */
+#define INTERNAL_CELLS_MAX  (2 * MAX_PAGE_SIZE / 5 + 2)
+typedef struct InternalCells_t
+{
+    uint32_t  num_keys;
+    uint32_t  keys[INTERNAL_CELLS_MAX];
+    uint32_t  children[INTERNAL_CELLS_MAX + 1];
+} InternalCells;
+
+/*
+ * The page size of the open database, set by set_page_size() along with
+ * the sizes below that depend on it.
+ */
+uint32_t PAGE_SIZE = DEFAULT_PAGE_SIZE;
 
 /*
  * Common Node Header Layout
@@ -125,25 +616,48 @@ const uint32_t LEAF_NODE_NUM_CELLS_OFFSET = COMMON_NODE_HEADER_SIZE;
 const uint32_t LEAF_NODE_NEXT_LEAF_SIZE = sizeof(uint32_t);
 const uint32_t LEAF_NODE_NEXT_LEAF_OFFSET =
     LEAF_NODE_NUM_CELLS_OFFSET + LEAF_NODE_NUM_CELLS_SIZE;
+const uint32_t LEAF_NODE_CONTENT_START_SIZE = sizeof(uint32_t);
+const uint32_t LEAF_NODE_CONTENT_START_OFFSET =
+    LEAF_NODE_NEXT_LEAF_OFFSET + LEAF_NODE_NEXT_LEAF_SIZE;
+const uint32_t LEAF_NODE_FRAGMENTED_SIZE = sizeof(uint32_t);
+const uint32_t LEAF_NODE_FRAGMENTED_OFFSET =
+    LEAF_NODE_CONTENT_START_OFFSET + LEAF_NODE_CONTENT_START_SIZE;
 const uint32_t LEAF_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE +
-    LEAF_NODE_NUM_CELLS_SIZE + LEAF_NODE_NEXT_LEAF_SIZE;
+    LEAF_NODE_NUM_CELLS_SIZE + LEAF_NODE_NEXT_LEAF_SIZE +
+    LEAF_NODE_CONTENT_START_SIZE + LEAF_NODE_FRAGMENTED_SIZE;
 
 /*
- * Leaf Node Body Layout
+ * Leaf Node Body Layout. The keys of the cells, in order, follow the
+ * header back to back so that a search reads nothing else. After them
+ * comes an array of slots, one per cell in the same order, each holding
+ * the offset of its cell. Cells are packed against the end of the page
+ * and grow down towards the slots, from content_start. Deleting a cell
+ * leaves a hole counted in fragmented until the leaf is defragmented.
+ *
+ * A cell is the size of its payload and the payload itself, which
+ * starts with the key: a serialized row, whose id is the key, or in an
+ * index a value's entry. A payload longer than LEAF_NODE_MAX_LOCAL keeps
+ * only that much in the cell, followed by the first page of a chain of
+ * overflow pages holding the rest.
  */
 const uint32_t LEAF_NODE_KEY_SIZE = sizeof(uint32_t);
-const uint32_t LEAF_NODE_KEY_OFFSET = 0;
-const uint32_t LEAF_NODE_VALUE_SIZE = ROW_SIZE;
-const uint32_t LEAF_NODE_VALUE_OFFSET =
-    LEAF_NODE_KEY_OFFSET + LEAF_NODE_KEY_SIZE;
-const uint32_t LEAF_NODE_CELL_SIZE = LEAF_NODE_KEY_SIZE + LEAF_NODE_VALUE_SIZE;
-const uint32_t LEAF_NODE_SPACE_FOR_CELLS = PAGE_SIZE - LEAF_NODE_HEADER_SIZE;
-const uint32_t LEAF_NODE_MAX_CELLS =
-    LEAF_NODE_SPACE_FOR_CELLS / LEAF_NODE_CELL_SIZE;
-
-const uint32_t LEAF_NODE_RIGHT_SPLIT_COUNT = (LEAF_NODE_MAX_CELLS + 1) / 2;
-const uint32_t LEAF_NODE_LEFT_SPLIT_COUNT =
-    (LEAF_NODE_MAX_CELLS + 1) - LEAF_NODE_RIGHT_SPLIT_COUNT;
+const uint32_t LEAF_NODE_SLOT_SIZE = sizeof(uint16_t);
+/* What each cell takes in the leaf besides the cell itself. */
+const uint32_t LEAF_NODE_ENTRY_SIZE =
+    LEAF_NODE_KEY_SIZE + LEAF_NODE_SLOT_SIZE;
+const uint32_t LEAF_NODE_PAYLOAD_SIZE_SIZE = sizeof(uint16_t);
+const uint32_t LEAF_NODE_KEY_OFFSET = LEAF_NODE_PAYLOAD_SIZE_SIZE;
+const uint32_t LEAF_NODE_OVERFLOW_SIZE = sizeof(uint32_t);
+uint32_t LEAF_NODE_SPACE_FOR_CELLS;
+/* Small enough that any four cells fit in a leaf. */
+uint32_t LEAF_NODE_MAX_LOCAL;
+uint32_t LEAF_NODE_MAX_CELL_SIZE;
+
+/* The most cells a leaf can hold, all of rows with empty strings. */
+uint32_t LEAF_NODE_MAX_CELLS;
+
+/* A delete that leaves less in use borrows from or merges with a sibling. */
+uint32_t LEAF_NODE_MIN_USED;
 
 /*
  * Internal Node Header Layout
@@ -153,80 +667,389 @@ const uint32_t INTERNAL_NODE_NUM_KEYS_OFFSET = COMMON_NODE_HEADER_SIZE;
 const uint32_t INTERNAL_NODE_RIGHT_CHILD_SIZE = sizeof(uint32_t);
 const uint32_t INTERNAL_NODE_RIGHT_CHILD_OFFSET =
     INTERNAL_NODE_NUM_KEYS_OFFSET + INTERNAL_NODE_NUM_KEYS_SIZE;
+const uint32_t INTERNAL_NODE_PREFIX_LENGTH_SIZE = sizeof(uint8_t);
+const uint32_t INTERNAL_NODE_PREFIX_LENGTH_OFFSET =
+    INTERNAL_NODE_RIGHT_CHILD_OFFSET + INTERNAL_NODE_RIGHT_CHILD_SIZE;
 const uint32_t INTERNAL_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE +
-    INTERNAL_NODE_NUM_KEYS_SIZE + INTERNAL_NODE_RIGHT_CHILD_SIZE;
+    INTERNAL_NODE_NUM_KEYS_SIZE + INTERNAL_NODE_RIGHT_CHILD_SIZE +
+    INTERNAL_NODE_PREFIX_LENGTH_SIZE;
 
 /*
- * Internal Node Body Layout
+ * Internal Node Body Layout. The high-order bytes that every key of the
+ * node shares are stored once, after the header. The rest of each key,
+ * the low-order bytes that tell the node's keys apart, low byte first,
+ * follow back to back, and then the children, each to the left of its
+ * key. The closer the keys of a node, the narrower its cells and the
+ * more of them fit.
  */
 const uint32_t INTERNAL_NODE_KEY_SIZE = sizeof(uint32_t);
 const uint32_t INTERNAL_NODE_CHILD_SIZE = sizeof(uint32_t);
+const uint32_t INTERNAL_NODE_MAX_PREFIX = INTERNAL_NODE_KEY_SIZE - 1;
 const uint32_t INTERNAL_NODE_CELL_SIZE =
     INTERNAL_NODE_KEY_SIZE + INTERNAL_NODE_CHILD_SIZE;
-/* Keep this small for testing */
-const uint32_t INTERNAL_NODE_MAX_CELLS = 3;
+uint32_t INTERNAL_NODE_SPACE_FOR_CELLS;
+/* Cells that fit whatever the keys. */
+uint32_t INTERNAL_NODE_MAX_CELLS;
+uint32_t INTERNAL_NODE_MIN_KEYS;
+
+/*
+ * Meta Page Layout. Page 0 describes the file: how many pages are in
+ * use, the head of the list of free pages and the catalog of tables.
+ * Before version 6 the file held one table, whose root was at
+ * META_ROOT_PAGE_OFFSET and the roots of its indexes at
+ * META_INDEX_ROOTS_OFFSET; both are 0 since.
+ *
+ * The catalog is an array of table_count entries. Each holds the name
+ * of a table, padded with zeros, its schema, and then a root for each
+ * column: the table's own for the id, then those of the indexes, 0
+ * where the column has none.
+ */
+const uint32_t META_MAGIC_OFFSET = 0;
+const uint32_t META_VERSION_OFFSET = 4;
+const uint32_t META_PAGE_SIZE_OFFSET = 8;
+const uint32_t META_ROOT_PAGE_OFFSET = 12;
+const uint32_t META_PAGE_COUNT_OFFSET = 16;
+const uint32_t META_FREELIST_HEAD_OFFSET = 20;
+const uint32_t META_FREELIST_COUNT_OFFSET = 24;
+const uint32_t META_INDEX_ROOTS_OFFSET = 28;
+const uint32_t META_TABLE_COUNT_OFFSET = 36;
+const uint32_t META_CATALOG_OFFSET = 64;
+
+const uint32_t CATALOG_NAME_OFFSET = 0;
+const uint32_t CATALOG_SCHEMA_OFFSET = CATALOG_NAME_SIZE;
+const uint32_t CATALOG_ROOTS_OFFSET = CATALOG_NAME_SIZE + sizeof(uint32_t);
+const uint32_t CATALOG_ENTRY_SIZE =
+    CATALOG_NAME_SIZE + sizeof(uint32_t) + NUM_COLUMNS * sizeof(uint32_t);
+
+/*
+ * Free Page Layout. A free page keeps the common header, with the node
+ * type set to NODE_FREE, followed by the next page of the freelist.
+ */
+const uint32_t FREE_PAGE_NEXT_OFFSET = COMMON_NODE_HEADER_SIZE;
+
+/*
+ * Overflow Page Layout. The common header with the node type set to
+ * NODE_OVERFLOW, the next page of the chain or 0, then row bytes.
+ */
+const uint32_t OVERFLOW_PAGE_NEXT_OFFSET = COMMON_NODE_HEADER_SIZE;
+const uint32_t OVERFLOW_PAGE_HEADER_SIZE =
+    COMMON_NODE_HEADER_SIZE + sizeof(uint32_t);
+uint32_t OVERFLOW_PAGE_SPACE;
 
 void indent(uint32_t level);
 void print_prompt();
 void print_row(Row *row);
+void visit_print_row(void *arg, Row *row);
+void visit_buffer_row(void *arg, Row *row);
+void visit_print_match(void *arg, Row *row);
+void visit_collect_row(void *arg, Row *row);
+void visit_collect_entry(void *arg, Row *row);
 void print_constants();
+void print_stats(Pager *pager);
 void print_tree(Pager *pager, uint32_t page_num, uint32_t indentation_level);
 
 InputBuffer *new_input_buffer();
 void read_input(InputBuffer *input_buffer);
 
-MetaCommandResult do_meta_command(InputBuffer *input_buffer, Table *table);
+MetaCommandResult do_meta_command(InputBuffer *input_buffer, Database *db);
 PrepareResult prepare_statement(InputBuffer *input_buffer, Statement *statement);
 PrepareResult prepare_insert(InputBuffer *input_buffer, Statement *statement);
+PrepareResult prepare_delete(InputBuffer *input_buffer, Statement *statement);
+PrepareResult prepare_select(InputBuffer *input_buffer, Statement *statement);
+PrepareResult prepare_create(InputBuffer *input_buffer, Statement *statement);
 ExecuteResult execute_insert(Statement *statement, Table *table);
 ExecuteResult execute_select(Statement *statement, Table *table);
-ExecuteResult execute_statement(Statement *statement, Table *table);
-
-Table *db_open(const char *filename);
-void db_close(Table *table);
+ExecuteResult execute_aggregate(Statement *statement, Table *table);
+ExecuteResult execute_select_value(Statement *statement, Table *table);
+ExecuteResult execute_delete(Statement *statement, Table *table);
+ExecuteResult execute_create_index(Statement *statement, Table *table);
+ExecuteResult execute_create_table(Statement *statement, Database *db);
+ExecuteResult execute_statement(Statement *statement, Database *db);
+
+Database *db_open(const char *filename, DbOptions *options);
+void db_close(Database *db);
+void db_upgrade(Pager *pager);
+void db_upgrade_nodes(Table *table);
+void db_upgrade_catalog(Pager *pager);
+Table *db_table(Database *db, const char *name);
+Table *db_open_table(Database *db, uint32_t entry);
+uint32_t catalog_entry_offset(uint32_t table_num);
+uint32_t catalog_add_table(Pager *pager, const char *name);
+void leaf_node_upgrade_fixed(Pager *pager, uint32_t page_num);
+void leaf_node_upgrade_slotted(Table *table, uint32_t page_num);
+uint32_t serialized_row_size(Row *row);
 void serialize_row(Row *source, void *destination);
 void deserialize_row(void *source, Row *destination);
 
-Pager *pager_open(const char *filename);
+void set_page_size(uint32_t page_size);
+uint32_t pager_find_page_size(int fd, const char *filename,
+                              uint32_t new_page_size);
+Pager *pager_open(const char *filename, DbOptions *options);
+void pager_open_map(Pager *pager);
+void pager_advise(Pager *pager, int advice);
 void *get_page(Pager *pager, uint32_t page_num);
-void pager_flush(Pager* pager, uint32_t page_num);
+void unpin_page(Pager *pager, uint32_t page_num);
+void mark_page_dirty(Pager *pager, uint32_t page_num);
+void pager_write_sorted(Pager *pager, uint32_t *page_nums, void **data,
+                        uint32_t count);
+void pager_commit(Pager *pager);
+void pager_checkpoint(Pager *pager);
+void pager_truncate(Pager *pager, uint32_t num_pages);
+void pager_free_page(Pager *pager, uint32_t page_num);
+bool pager_page_location(Pager *pager, uint32_t page_num,
+                         int *fd, off_t *offset);
+void pager_pwritev(Pager *pager, int fd, off_t offset,
+                   struct iovec *iov, uint32_t count);
+int compare_frame_page_num(const void *a, const void *b);
+int32_t pager_lookup_frame(Pager *pager, uint32_t page_num);
+int32_t pager_evict_frame(Pager *pager);
+void pager_install_frame(Pager *pager, int32_t frame_num, uint32_t page_num);
+uint32_t pager_file_pages(Pager *pager);
+void pager_read_page(Pager *pager, uint32_t page_num, void *buffer);
+void pager_read_batch(Pager *pager, Frame **frames, uint32_t count);
+void pager_write_pages(Pager *pager, uint32_t first_page,
+                       struct iovec *iov, uint32_t count);
+uint32_t pager_prefetch(Pager *pager, uint32_t *page_nums, uint32_t count);
+void pager_readahead(Pager *pager, uint32_t *page_nums, uint32_t count);
+int compare_page_num(const void *a, const void *b);
+
+bool io_ring_init(IoRing *ring, uint32_t entries);
+void io_ring_free(IoRing *ring);
+struct io_uring_sqe *io_ring_next_sqe(IoRing *ring);
+uint32_t io_ring_submit_and_wait(IoRing *ring, uint32_t count,
+                                 int32_t *results);
+
+void wal_open(Pager *pager, const char *filename);
+void wal_recover(Pager *pager);
+void wal_reset(Pager *pager, uint32_t salt);
+void wal_append(Pager *pager, Frame **frames, uint32_t count, bool commit);
+void wal_sync(Pager *pager);
+void wal_close(Pager *pager);
+uint32_t wal_lookup(Pager *pager, uint32_t page_num);
+void wal_index_set(Pager *pager, uint32_t page_num, uint32_t frame_num);
+uint32_t wal_checksum(const void *data, size_t length, uint32_t seed);
+uint32_t pager_bucket(Pager *pager, uint32_t page_num);
+void pager_hash_remove(Pager *pager, int32_t frame_num);
+PagerStripe *pager_stripe(Pager *pager, uint32_t page_num);
+uint64_t pager_hits(Pager *pager);
+Frame *pager_frame(Pager *pager, void *page);
+void pager_begin_write(Pager *pager);
+void pager_end_write(Pager *pager);
+bool pager_is_writer(Pager *pager);
+void *latch_page(Pager *pager, uint32_t page_num);
+void *try_latch_page(Pager *pager, uint32_t page_num);
+void unlatch_page(Pager *pager, uint32_t page_num, void *page);
+void pager_release_latch(Pager *pager, uint32_t page_num);
+void pager_release_latches(Pager *pager, uint32_t keep_page_num);
+Frame *pager_peek_frame(Pager *pager, uint32_t page_num, uint64_t *version);
+bool frame_validate(Frame *frame, uint64_t version);
+void frame_begin_change(Frame *frame);
+void frame_end_change(Frame *frame);
 
 Cursor *table_start(Table *table);
 Cursor *table_find(Table *table, uint32_t key);
+void table_scan(Table *table, uint32_t first_key, uint32_t last_key,
+                RowVisitor visit, void *arg);
+uint32_t table_scan_split(Table *table, uint32_t first_key,
+                          uint32_t last_key, uint32_t max_parts,
+                          uint32_t *last_keys);
+void table_scan_parallel(ScanPart *parts, uint32_t num_parts);
+void *scan_part_run(void *arg);
+bool table_aggregate(Table *table, Aggregate aggregate, uint32_t first_key,
+                     uint32_t last_key, uint64_t *value);
+bool table_min_key(Table *table, uint32_t first_key, uint32_t last_key,
+                   uint32_t *key);
+bool table_max_key(Table *table, uint32_t first_key, uint32_t last_key,
+                   uint32_t *key);
+bool table_leaf_floor_key(Table *table, uint32_t bound, uint32_t *key);
+bool table_left_separator(Table *table, uint32_t key, uint32_t *separator);
+void table_count_keys(Table *table, uint32_t first_key, uint32_t last_key,
+                      uint64_t *count, uint64_t *sum);
+bool table_get_row(Table *table, uint32_t key, Row *row);
+Table *table_tree(Table *table, Column column);
+Table *table_open_index(Table *table, Column column, uint32_t root_page_num);
+Table *table_create_index(Table *table, Column column);
+void table_index_rows(Table *table, Row *rows, uint32_t num_rows);
+void table_unindex_range(Table *table, uint32_t first_key, uint32_t last_key);
+uint32_t index_root_offset(Table *table, Column column);
+char *row_column(Row *row, Column column);
+uint32_t index_home(const char *value);
+bool index_read(Table *index, uint32_t key, IndexValue *entry);
+void index_write(Table *index, IndexValue *entry);
+uint32_t index_lookup(Table *index, const char *value, uint32_t **ids);
+void index_insert(Table *index, const char *value, uint32_t *ids,
+                  uint32_t num_ids);
+void index_delete(Table *index, const char *value, uint32_t *ids,
+                  uint32_t num_ids);
+void index_remove_entry(Table *index, uint32_t key);
+int compare_index_entry(const void *a, const void *b);
+uint32_t index_group(IndexEntry *entries, uint32_t num_entries, uint32_t *ids,
+                     uint32_t *starts);
+void index_load(Table *index, IndexEntry *entries, uint32_t num_entries);
+void index_unload(Table *index, IndexEntry *entries, uint32_t num_entries);
+int compare_id(const void *a, const void *b);
+Frame *table_peek_leaf(Table *table, uint32_t key, uint64_t *version);
+PeekResult table_peek_row(Table *table, uint32_t key, Row *row);
+ExecuteResult table_insert(Table *table, Row *row);
+ExecuteResult table_insert_payload(Table *table, void *payload,
+                                   uint32_t payload_size);
+ExecuteResult table_insert_batch(Table *table, Row *rows, uint32_t num_rows);
+uint32_t table_delete(Table *table, uint32_t first_key, uint32_t last_key);
+void table_rebalance(Table *table, uint32_t page_num);
+void table_collapse_root(Table *table);
+ExecuteResult table_bulk_load(Table *table, Row *rows, uint32_t num_rows,
+                              uint32_t fill_percent);
+void bulk_load_level(Table *table, uint32_t level, uint32_t num_levels,
+                     uint32_t *counts, uint32_t *bases, uint32_t *max_keys,
+                     uint32_t *leaf_starts, Row *rows);
+int compare_row_id(const void *a, const void *b);
+bool sort_rows(Row *rows, uint32_t num_rows);
+ExecuteResult db_vacuum(Database *db, uint32_t *reclaimed);
+void vacuum_move_page(Database *db, uint32_t src, uint32_t dest,
+                      uint32_t *referrer);
+void vacuum_find_overflow(Table *table, uint32_t page_num, void *leaf,
+                          uint32_t *referrer);
+void vacuum_find_referrers(Table *tree, uint32_t *referrer);
+bool read_rows_file(const char *filename, Row **rows, uint32_t *num_rows);
+PrepareResult prepare_row(char *id_string, char *username, char *email,
+                          Row *row);
 
 void cursor_advance(Cursor *cursor);
-void *cursor_value(Cursor *cursor);
-
+void cursor_read_row(Cursor *cursor, Row *row);
+void leaf_cell_read_row(Pager *pager, void *cell, Row *row);
+uint32_t leaf_cell_read(Pager *pager, void *cell, void *payload);
+void cursor_free(Cursor *cursor);
+void cursor_prefetch(Cursor *cursor);
+void cursor_seek_past(Cursor *cursor, uint32_t key);
+
+void initialize_meta_page(void *meta);
+uint32_t *meta_field(void *meta, uint32_t offset);
+uint32_t *free_page_next(void *node);
+uint32_t *overflow_page_next(void *node);
 void initialize_leaf_node(void *node);
 void initialize_internal_node(void *node);
 uint32_t *leaf_node_num_cells(void *node);
+uint32_t *leaf_node_content_start(void *node);
+uint32_t *leaf_node_fragmented(void *node);
+uint16_t *leaf_node_slot(void *node, uint32_t cell_num);
 void *leaf_node_cell(void *node, uint32_t cell_num);
 uint32_t *leaf_node_key(void *node, uint32_t cell_num);
-void *leaf_node_value(void *node, uint32_t cell_num);
-void leaf_node_insert(Cursor *cursor, uint32_t key, Row *value);
-Cursor *leaf_node_find(Table *table, uint32_t page_num, uint32_t key);
-void leaf_node_split_and_insert(Cursor *cursor, uint32_t key, Row *value);
+uint32_t leaf_node_free_space(void *node);
+uint32_t leaf_node_used_space(void *node);
+void leaf_node_defragment(void *node);
+void leaf_node_put_cell(void *node, uint32_t cell_num, void *cell,
+                        uint32_t cell_size);
+void leaf_node_set_cells(void *node, void **cells, uint32_t count);
+void leaf_node_truncate(void *node, uint32_t count);
+uint32_t leaf_node_run_end(void *node, Row *rows, uint32_t start,
+                           uint32_t num_rows);
+bool leaf_node_has_any(Cursor *cursor, Row *rows, uint32_t count);
+void leaf_node_insert_run(Cursor *cursor, Row *rows, uint32_t count);
+uint32_t leaf_split_point(void **cells, uint32_t count);
+uint32_t cell_size_for_payload(uint32_t payload_size);
+uint32_t leaf_cell_size(void *cell);
+uint32_t leaf_cell_key(void *cell);
+uint32_t *leaf_cell_overflow(void *cell);
+uint32_t leaf_cell_build(Pager *pager, Row *row, void *cell);
+uint32_t leaf_cell_write(Pager *pager, void *payload, uint32_t payload_size,
+                         void *cell);
+void leaf_cell_free_overflow(Pager *pager, void *cell);
+void leaf_node_insert(Cursor *cursor, void *payload, uint32_t payload_size);
+Cursor *leaf_node_find(Table *table, uint32_t page_num, void *node,
+                       uint32_t key);
+PeekResult leaf_node_peek_row(Frame *frame, uint64_t version, uint32_t key,
+                              Row *row);
+void leaf_node_split_and_insert(Cursor *cursor, void *cell);
+void leaf_node_delete(Cursor *cursor, uint32_t count);
+void leaf_node_redistribute(Table *table, uint32_t parent_page_num,
+                            uint32_t index);
+void leaf_node_merge(Table *table, uint32_t parent_page_num, uint32_t index);
 uint32_t *leaf_node_next_leaf(void *node);
 
 NodeType get_node_type(void *node);
 void set_node_type(void *node, NodeType type);
 uint32_t get_unused_page_num(Pager *pager);
-uint32_t get_node_max_key(void *node);
+uint32_t get_node_max_key(Pager *pager, void *node);
 bool is_node_root(void *node);
 void set_node_root(void *node, bool is_root);
 
 void create_new_root(Table *table, uint32_t right_child_page_num);
 uint32_t *node_parent(void *node);
+uint32_t get_node_parent(void *node);
+void set_node_parent(void *node, uint32_t parent_page_num);
 uint32_t *internal_node_num_keys(void *node);
 uint32_t *internal_node_right_child(void *node);
-uint32_t *internal_node_cell(void *node, uint32_t cell_num);
+uint32_t internal_node_prefix_length(void *node);
+uint32_t internal_node_prefix(void *node);
+uint32_t internal_node_suffix_size(void *node);
+uint8_t *internal_node_suffixes(void *node);
 uint32_t *internal_node_child(void *node, uint32_t child_num);
-uint32_t *internal_node_key(void *node, uint32_t key_num);
-Cursor *internal_node_find(Table *table, uint32_t page_num, uint32_t key);
+uint32_t internal_node_key(void *node, uint32_t key_num);
+uint32_t internal_node_find_child(void *node, uint32_t key);
+uint32_t internal_node_search(void *node, uint32_t num_keys,
+                              uint32_t prefix_length, uint32_t key);
+uint32_t internal_node_peek_child(void *node, uint32_t key);
+Cursor *internal_node_find(Table *table, uint32_t page_num, void *node,
+                           uint32_t key);
+bool node_is_safe(Table *table, void *node);
+uint32_t read_key_bytes(const uint8_t *src, uint32_t size);
+void write_key_bytes(uint8_t *dest, uint32_t value, uint32_t size);
+uint32_t key_count_below_scalar(const uint8_t *keys, uint32_t width,
+                                uint32_t count, uint32_t key);
+#if defined(__x86_64__) || defined(__i386__)
+uint32_t key_count_below_sse4(const uint8_t *keys, uint32_t width,
+                              uint32_t count, uint32_t key);
+uint32_t key_count_below_avx2(const uint8_t *keys, uint32_t width,
+                              uint32_t count, uint32_t key);
+#endif
+void key_search_init(KeySearchKernel kernel);
+uint32_t key_search(const uint8_t *keys, uint32_t width, uint32_t count,
+                    uint32_t key);
+
+/* The kernel key_search() counts with; see key_search_init(). */
+uint32_t (*key_count_below)(const uint8_t *keys, uint32_t width,
+                            uint32_t count, uint32_t key) =
+    key_count_below_scalar;
+uint32_t key_search_window = SCALAR_SEARCH_WINDOW;
+
+/* The pager this thread writes through, see pager_begin_write(). */
+__thread Pager *writing_pager = NULL;
+uint32_t internal_prefix_length(uint32_t first_key, uint32_t last_key);
+uint32_t internal_node_capacity(uint32_t prefix_length);
+bool internal_keys_fit(uint32_t *keys, uint32_t num_keys);
+void internal_node_read(void *node, InternalCells *cells);
+void internal_node_write(void *node, InternalCells *cells);
+void internal_node_upgrade(void *node, uint32_t version);
+void internal_node_store(Table *table, uint32_t page_num,
+                         InternalCells *cells, bool append);
+void internal_node_set_key(Table *table, uint32_t page_num, uint32_t index,
+                           uint32_t key);
 void internal_node_insert(Table *table, uint32_t parent_page_num,
-                          uint32_t child_page_num);
-
-void update_internal_node_key(void *node, uint32_t old_key, uint32_t new_key);
+                          uint32_t child_page_num, uint32_t child_max_key,
+                          uint32_t new_child_page_num);
+uint32_t internal_node_child_index(void *node, uint32_t child_page_num);
+void internal_node_remove_right(void *node, uint32_t index);
+void internal_node_redistribute(Table *table, uint32_t parent_page_num,
+                                uint32_t index);
+void internal_node_merge(Table *table, uint32_t parent_page_num,
+                         uint32_t index);
+
+void update_node_max_key(Table *table, uint32_t page_num, uint32_t new_max);
+
+void row_buffer_reserve(RowBuffer *buffer, size_t size);
+int server_listen(const char *socket_path, uint32_t port);
+void server_run(Database *db, int listen_fd);
+void server_accept(int epoll_fd, int listen_fd);
+bool server_read(Connection *connection);
+bool server_service(Table *table, int epoll_fd, Connection *connection);
+bool server_handle_requests(Table *table, Connection *connection);
+void server_request(Table *table, Connection *connection, char *frame,
+                    uint32_t length, bool *writing);
+void server_close(Connection *connection);
+size_t wire_read_row(char *source, size_t size, Row *row);
+void wire_write_row(RowBuffer *out, Row *row);
+size_t wire_begin_reply(RowBuffer *out);
+void wire_end_reply(RowBuffer *out, size_t start, WireStatus status);
 
 
 void
@@ -242,23 +1065,119 @@ void
 print_prompt()
 {
     printf("db > ");
+    /* Let a client on a pipe see each prompt as the command finishes. */
+    fflush(stdout);
 }
 
+#define ROW_PRINT_FORMAT    "(%d, %s, %s)\n"
+#define ROW_PRINT_MAX_SIZE  (ROW_MAX_SIZE + 16)
+
 void
 print_row(Row *row)
 {
-    printf("(%d, %s, %s)\n", row->id, row->username, row->email);
+    printf(ROW_PRINT_FORMAT, row->id, row->username, row->email);
+}
+
+void
+visit_print_row(void *arg, Row *row)
+{
+    unused(arg);
+    print_row(row);
+}
+
+/*
+ * Make room for size more bytes after those in the buffer.
+ */
+void
+row_buffer_reserve(RowBuffer *buffer, size_t size)
+{
+    if (buffer->length + size > buffer->capacity) {
+        buffer->capacity = 2 * buffer->capacity + size;
+        buffer->data = realloc(buffer->data, buffer->capacity);
+    }
+}
+
+void
+visit_buffer_row(void *arg, Row *row)
+{
+    RowBuffer *buffer = arg;
+
+    row_buffer_reserve(buffer, ROW_PRINT_MAX_SIZE);
+    buffer->length += sprintf(buffer->data + buffer->length, ROW_PRINT_FORMAT,
+                              row->id, row->username, row->email);
+}
+
+/*
+ * Print the row if it has the value the select statement asks for.
+ */
+void
+visit_print_match(void *arg, Row *row)
+{
+    Statement *statement = arg;
+
+    if (strcmp(row_column(row, statement->column), statement->value) == 0) {
+        print_row(row);
+    }
+}
+
+void
+visit_collect_row(void *arg, Row *row)
+{
+    RowList *list = arg;
+
+    if (list->count == list->capacity) {
+        list->capacity = 2 * list->capacity + 16;
+        list->rows = realloc(list->rows, sizeof(Row) * list->capacity);
+    }
+    list->rows[list->count++] = *row;
+}
+
+void
+visit_collect_entry(void *arg, Row *row)
+{
+    RowList *list = arg;
+
+    if (list->count == list->capacity) {
+        list->capacity = 2 * list->capacity + 16;
+        list->entries = realloc(list->entries,
+                                sizeof(IndexEntry) * list->capacity);
+    }
+    list->entries[list->count].id = row->id;
+    list->entries[list->count].value = strdup(row_column(row, list->column));
+    list->count++;
 }
 
 void
 print_constants()
 {
-    printf("ROW_SIZE: %lu\n", ROW_SIZE);
+    printf("PAGE_SIZE: %d\n", PAGE_SIZE);
+    printf("ROW_MAX_SIZE: %lu\n", ROW_MAX_SIZE);
     printf("COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
     printf("LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
-    printf("LEAF_NODE_CELL_SIZE: %d\n", LEAF_NODE_CELL_SIZE);
+    printf("LEAF_NODE_SLOT_SIZE: %d\n", LEAF_NODE_SLOT_SIZE);
     printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n", LEAF_NODE_SPACE_FOR_CELLS);
-    printf("LEAF_NODE_MAX_CELLS: %d\n", LEAF_NODE_MAX_CELLS);
+    printf("LEAF_NODE_MAX_LOCAL: %d\n", LEAF_NODE_MAX_LOCAL);
+}
+
+void
+print_stats(Pager *pager)
+{
+    printf("pool_frames: %u\n", pager->num_frames);
+    printf("pool_hits: %lu\n", pager_hits(pager));
+    printf("pool_misses: %lu\n", pager->stats.misses);
+    printf("pool_evictions: %lu\n", pager->stats.evictions);
+    printf("pool_prefetched: %lu\n", pager->stats.prefetched);
+    printf("readahead_pages: %lu\n", pager->stats.readahead);
+    printf("bytes_written: %lu\n", pager->stats.bytes_written);
+    printf("read_syscalls: %lu\n", pager->stats.read_syscalls);
+    printf("write_syscalls: %lu\n", pager->stats.write_syscalls);
+    printf("wal_frames: %lu\n", pager->stats.wal_frames);
+    printf("wal_commits: %lu\n", pager->stats.wal_commits);
+    printf("wal_syncs: %lu\n", pager->stats.wal_syncs);
+    printf("checkpoints: %lu\n", pager->stats.checkpoints);
+    printf("free_pages: %u\n",
+           *meta_field(get_page(pager, 0), META_FREELIST_COUNT_OFFSET));
+    unpin_page(pager, 0);
 }
 
 void
@@ -288,13 +1207,29 @@ print_tree(Pager *pager, uint32_t page_num, uint32_t indentation_level)
             print_tree(pager, child, indentation_level + 1);
 
             indent(indentation_level + 1);
-            printf("- key %d\n", *internal_node_key(node, i));
+            printf("- key %d\n", internal_node_key(node, i));
         }
 
         child = *internal_node_right_child(node);
         print_tree(pager, child, indentation_level + 1);
         break;
+    case NODE_FREE:
+        /* A tree never links to these; say so rather than skip them. */
+        indent(indentation_level);
+        printf("- free page %d\n", page_num);
+        break;
+    case NODE_OVERFLOW:
+        indent(indentation_level);
+        printf("- overflow page %d\n", page_num);
+        break;
+    default:
+        indent(indentation_level);
+        printf("- page %d of unknown type %d\n", page_num,
+               get_node_type(node));
+        break;
     }
+
+    unpin_page(pager, page_num);
 }
 
 InputBuffer *
@@ -327,20 +1262,114 @@ read_input(InputBuffer *input_buffer)
     input_buffer->buffer[bytes_read - 1] = 0;
 }
 
+/*
+ * ".btree" prints the tree of the default table, ".btree <table>" that
+ * of another, and ".tables" the names of all of them. ".load" loads
+ * into the default table.
+ */
 MetaCommandResult
-do_meta_command(InputBuffer *input_buffer, Table *table)
+do_meta_command(InputBuffer *input_buffer, Database *db)
 {
+    Pager *pager = db->pager;
+
     if (strcmp(input_buffer->buffer, ".exit") == 0) {
-        db_close(table);
+        db_close(db);
         exit(EXIT_SUCCESS);
-    } else if (strcmp(input_buffer->buffer, ".btree") == 0) {
+    } else if (strcmp(input_buffer->buffer, ".btree") == 0 ||
+               strncmp(input_buffer->buffer, ".btree ", 7) == 0) {
+        Table *table = db_table(db, input_buffer->input_length > 7 ?
+                                    input_buffer->buffer + 7 :
+                                    DEFAULT_TABLE_NAME);
+
+        if (table == NULL) {
+            printf("Error: No such table.\n");
+            return META_COMMAND_SUCCESS;
+        }
         printf("Tree:\n");
-        print_tree(table->pager, 0, 0);
+        print_tree(pager, table->root_page_num, 0);
+        return META_COMMAND_SUCCESS;
+    } else if (strcmp(input_buffer->buffer, ".tables") == 0) {
+        uint32_t num_tables = __atomic_load_n(&db->num_tables,
+                                              __ATOMIC_ACQUIRE);
+        uint32_t i;
+
+        for (i = 0; i < num_tables; i++) {
+            printf("%s\n", db->tables[i]->name);
+        }
         return META_COMMAND_SUCCESS;
     } else if (strcmp(input_buffer->buffer, ".constants") == 0) {
         printf("Constants:\n");
         print_constants();
         return META_COMMAND_SUCCESS;
+    } else if (strcmp(input_buffer->buffer, ".flush") == 0) {
+        pthread_mutex_lock(&pager->write_lock);
+        pager_commit(pager);
+        pager_checkpoint(pager);
+        pthread_mutex_unlock(&pager->write_lock);
+        return META_COMMAND_SUCCESS;
+    } else if (strncmp(input_buffer->buffer, ".load ", 6) == 0) {
+        char     *keyword = strtok(input_buffer->buffer, " ");
+        char     *filename = strtok(NULL, " ");
+        char     *fill_string = strtok(NULL, " ");
+        uint32_t  fill_percent = BULK_LOAD_FILL_PERCENT;
+        Table    *table = db_table(db, DEFAULT_TABLE_NAME);
+        Row      *rows;
+        uint32_t  num_rows;
+        ExecuteResult result;
+
+        unused(keyword);
+
+        if (fill_string != NULL) {
+            fill_percent = atoi(fill_string);
+            if (fill_percent < BULK_LOAD_MIN_FILL || fill_percent > 100) {
+                printf("Fill factor must be between %d and 100.\n",
+                       BULK_LOAD_MIN_FILL);
+                return META_COMMAND_SUCCESS;
+            }
+        }
+        if (filename == NULL || !read_rows_file(filename, &rows, &num_rows)) {
+            return META_COMMAND_SUCCESS;
+        }
+
+        pthread_mutex_lock(&pager->write_lock);
+        result = table_bulk_load(table, rows, num_rows, fill_percent);
+        if (result == EXECUTE_SUCCESS) {
+            table_index_rows(table, rows, num_rows);
+            pager_commit(pager);
+        }
+        pthread_mutex_unlock(&pager->write_lock);
+        switch (result) {
+        case EXECUTE_SUCCESS:
+            printf("Loaded %u rows.\n", num_rows);
+            break;
+        case EXECUTE_DUPLICATE_KEY:
+            printf("Error: Duplicate key.\n");
+            break;
+        case EXECUTE_READ_ONLY:
+            printf("Error: Database is read-only.\n");
+            break;
+        default:
+            break;
+        }
+        free(rows);
+        return META_COMMAND_SUCCESS;
+    } else if (strcmp(input_buffer->buffer, ".vacuum") == 0) {
+        uint32_t      reclaimed;
+        ExecuteResult result;
+
+        pthread_mutex_lock(&pager->write_lock);
+        result = db_vacuum(db, &reclaimed);
+        pthread_mutex_unlock(&pager->write_lock);
+        if (result == EXECUTE_READ_ONLY) {
+            printf("Error: Database is read-only.\n");
+        } else {
+            printf("Reclaimed %u pages.\n", reclaimed);
+        }
+        return META_COMMAND_SUCCESS;
+    } else if (strcmp(input_buffer->buffer, ".stats") == 0) {
+        printf("Stats:\n");
+        print_stats(pager);
+        return META_COMMAND_SUCCESS;
     }
 
     return META_COMMAND_UNRECOGNIZED_COMMAND;
@@ -353,743 +1382,7366 @@ prepare_statement(InputBuffer *input_buffer, Statement *statement)
         return prepare_insert(input_buffer, statement);
     }
     if (strncmp(input_buffer->buffer, "select", 6) == 0) {
-        statement->type = STATEMENT_SELECT;
-        return PREPARE_SUCCESS;
+        return prepare_select(input_buffer, statement);
+    }
+    if (strncmp(input_buffer->buffer, "delete", 6) == 0) {
+        return prepare_delete(input_buffer, statement);
+    }
+    if (strncmp(input_buffer->buffer, "create", 6) == 0) {
+        return prepare_create(input_buffer, statement);
     }
 
     return PREPARE_UNRECOGNIZED_STATEMENT;
 }
 
+/*
+ * "insert <id> <username> <email>" adds one row. More rows may follow
+ * on the same line, three fields each, to be inserted as one batch.
+ * "insert into <table> ..." inserts into a table other than the default.
+ */
 PrepareResult
 prepare_insert(InputBuffer *input_buffer, Statement *statement)
 {
-    char *keyword = strtok(input_buffer->buffer, " ");
-    char *id_string = strtok(NULL, " ");
-    char *username = strtok(NULL, " ");
-    char *email = strtok(NULL, " ");
+    char          *keyword = strtok(input_buffer->buffer, " ");
+    char          *id_string = strtok(NULL, " ");
+    uint32_t       capacity = 1;
+    PrepareResult  result;
 
     unused(keyword);
 
     statement->type = STATEMENT_INSERT;
-
-    if (id_string == NULL || username == NULL || email == NULL) {
-        return PREPARE_SYNTAX_ERROR;
+    statement->table_name = DEFAULT_TABLE_NAME;
+    if (id_string != NULL && strcmp(id_string, "into") == 0) {
+        statement->table_name = strtok(NULL, " ");
+        id_string = strtok(NULL, " ");
     }
+    statement->rows_to_insert = malloc(sizeof(Row));
+    statement->num_rows = 0;
 
-    int id = atoi(id_string);
-    if (id < 0) {
-        return PREPARE_NEGATIVE_ID;
-    }
-    if (strlen(username) > COLUMN_USERNAME_SIZE) {
-        return PREPARE_STRING_TOO_LONG;
-    }
-    if (strlen(email) > COLUMN_EMAIL_SIZE) {
-        return PREPARE_STRING_TOO_LONG;
-    }
+    do {
+        char *username = strtok(NULL, " ");
+        char *email = strtok(NULL, " ");
 
-    statement->row_to_insert.id = id;
-    strcpy(statement->row_to_insert.username, username);
-    strcpy(statement->row_to_insert.email, email);
+        if (statement->num_rows == capacity) {
+            capacity *= 2;
+            statement->rows_to_insert = realloc(statement->rows_to_insert,
+                                                sizeof(Row) * capacity);
+        }
+        result = prepare_row(id_string, username, email,
+                             &statement->rows_to_insert[statement->num_rows]);
+        if (result != PREPARE_SUCCESS) {
+            free(statement->rows_to_insert);
+            return result;
+        }
+        statement->num_rows++;
+    } while ((id_string = strtok(NULL, " ")) != NULL);
 
     return PREPARE_SUCCESS;
 }
 
-ExecuteResult
-execute_insert(Statement *statement, Table *table)
+/*
+ * "select" returns every row, "select where id = <id>" one row and
+ * "select where id between <first_id> and <last_id>" every row with an id
+ * in the range, inclusive.
+ *
+ * "select where username = <username>" and "select where email = <email>"
+ * return the rows with that value, through the column's index if it has
+ * one.
+ *
+ * "select count(*)", "select min(id)", "select max(id)" and
+ * "select sum(id)" return one value over the same rows instead, and take
+ * the same where clause on the id.
+ *
+ * "from <table>", after the aggregate if there is one, selects from a
+ * table other than the default.
+ */
+PrepareResult
+prepare_select(InputBuffer *input_buffer, Statement *statement)
 {
-    Row    *row_to_insert;
-    Cursor *cursor;
-    void   *node = get_page(table->pager, table->root_page_num);
-    uint32_t num_cells = (*leaf_node_num_cells(node));
-    uint32_t key_to_insert;
+    char *keyword = strtok(input_buffer->buffer, " ");
+    char *where = strtok(NULL, " ");
+    char *column;
+    char *operator;
+    char *first_string;
+    char *and;
+    char *last_string;
+    int   first_id;
+    int   last_id;
 
-    row_to_insert = &statement->row_to_insert;
-    key_to_insert = row_to_insert->id;
-    cursor = table_find(table, key_to_insert);
+    unused(keyword);
 
-    if (cursor->cell_num < num_cells) {
-        uint32_t key_at_index = *leaf_node_key(node, cursor->cell_num);
-        if (key_at_index == key_to_insert) {
-            return EXECUTE_DUPLICATE_KEY;
+    statement->type = STATEMENT_SELECT;
+    statement->first_id = 0;
+    statement->last_id = UINT32_MAX;
+    statement->aggregate = AGGREGATE_NONE;
+    statement->column = COLUMN_ID;
+    statement->table_name = DEFAULT_TABLE_NAME;
+
+    if (where != NULL && strcmp(where, "where") != 0 &&
+        strcmp(where, "from") != 0) {
+        if (strcmp(where, "count(*)") == 0) {
+            statement->aggregate = AGGREGATE_COUNT;
+        } else if (strcmp(where, "min(id)") == 0) {
+            statement->aggregate = AGGREGATE_MIN;
+        } else if (strcmp(where, "max(id)") == 0) {
+            statement->aggregate = AGGREGATE_MAX;
+        } else if (strcmp(where, "sum(id)") == 0) {
+            statement->aggregate = AGGREGATE_SUM;
+        } else {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        where = strtok(NULL, " ");
+    }
+    if (where != NULL && strcmp(where, "from") == 0) {
+        statement->table_name = strtok(NULL, " ");
+        if (statement->table_name == NULL) {
+            return PREPARE_SYNTAX_ERROR;
         }
+        where = strtok(NULL, " ");
     }
+    column = strtok(NULL, " ");
+    operator = strtok(NULL, " ");
+    first_string = strtok(NULL, " ");
+    and = strtok(NULL, " ");
+    last_string = strtok(NULL, " ");
 
-    leaf_node_insert(cursor, row_to_insert->id, row_to_insert);
+    if (where == NULL) {
+        return PREPARE_SUCCESS;
+    }
+    if (strcmp(where, "where") != 0 || column == NULL || operator == NULL ||
+        first_string == NULL) {
+        return PREPARE_SYNTAX_ERROR;
+    }
 
-    free(cursor);
+    if (strcmp(column, "id") != 0) {
+        if (strcmp(column, "username") == 0) {
+            statement->column = COLUMN_USERNAME;
+        } else if (strcmp(column, "email") == 0) {
+            statement->column = COLUMN_EMAIL;
+        } else {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        if (statement->aggregate != AGGREGATE_NONE ||
+            strcmp(operator, "=") != 0 || and != NULL) {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        if (strlen(first_string) > (statement->column == COLUMN_USERNAME ?
+                                    COLUMN_USERNAME_SIZE :
+                                    COLUMN_EMAIL_SIZE)) {
+            return PREPARE_STRING_TOO_LONG;
+        }
+        statement->value = first_string;
+        return PREPARE_SUCCESS;
+    }
 
-    return EXECUTE_SUCCESS;
-}
+    first_id = atoi(first_string);
+    if (strcmp(operator, "=") == 0 && and == NULL) {
+        last_id = first_id;
+    } else if (strcmp(operator, "between") == 0 && and != NULL &&
+               strcmp(and, "and") == 0 && last_string != NULL &&
+               strtok(NULL, " ") == NULL) {
+        last_id = atoi(last_string);
+    } else {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    if (first_id < 0 || last_id < 0) {
+        return PREPARE_NEGATIVE_ID;
+    }
+    if (last_id < first_id) {
+        return PREPARE_SYNTAX_ERROR;
+    }
 
-ExecuteResult
-execute_select(Statement *statement, Table *table)
-{
-    Cursor *cursor = table_start(table);
-    Row     row;
+    statement->first_id = first_id;
+    statement->last_id = last_id;
 
-    unused(statement);
+    return PREPARE_SUCCESS;
+}
 
-    while (!(cursor->end_of_table)) {
-        deserialize_row(cursor_value(cursor), &row);
-        print_row(&row);
-        cursor_advance(cursor);
+/*
+ * "delete <id>" removes one row, "delete <first_id> <last_id>" every row
+ * with an id between the two, inclusive. "delete from <table> ..."
+ * deletes from a table other than the default.
+ */
+PrepareResult
+prepare_delete(InputBuffer *input_buffer, Statement *statement)
+{
+    char *keyword = strtok(input_buffer->buffer, " ");
+    char *first_string = strtok(NULL, " ");
+    char *last_string = strtok(NULL, " ");
+    int   first_id;
+    int   last_id;
+
+    unused(keyword);
+
+    statement->type = STATEMENT_DELETE;
+    statement->table_name = DEFAULT_TABLE_NAME;
+    if (first_string != NULL && strcmp(first_string, "from") == 0) {
+        statement->table_name = last_string;
+        first_string = strtok(NULL, " ");
+        last_string = strtok(NULL, " ");
     }
 
-    free(cursor);
+    if (first_string == NULL) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    first_id = atoi(first_string);
+    last_id = last_string == NULL ? first_id : atoi(last_string);
+    if (first_id < 0 || last_id < 0) {
+        return PREPARE_NEGATIVE_ID;
+    }
+    if (last_id < first_id) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    statement->first_id = first_id;
+    statement->last_id = last_id;
+
+    return PREPARE_SUCCESS;
+}
+
+/*
+ * "create table <name>" adds a table with the columns of users. A name
+ * is letters, digits and underscores.
+ *
+ * "create index on <table>(username)" and "create index on
+ * <table>(email)" index a column.
+ */
+PrepareResult
+prepare_create(InputBuffer *input_buffer, Statement *statement)
+{
+    char *keyword = strtok(input_buffer->buffer, " ");
+    char *object = strtok(NULL, " ");
+    char *on = strtok(NULL, " ");
+    char *target = strtok(NULL, " ");
+    char *column;
+    char *name;
+
+    unused(keyword);
+
+    if (object != NULL && strcmp(object, "table") == 0) {
+        statement->type = STATEMENT_CREATE_TABLE;
+        statement->table_name = on;
+        if (on == NULL || target != NULL) {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        if (strlen(on) >= CATALOG_NAME_SIZE) {
+            return PREPARE_STRING_TOO_LONG;
+        }
+        for (name = on; *name != 0; name++) {
+            if (!isalnum((unsigned char) *name) && *name != '_') {
+                return PREPARE_SYNTAX_ERROR;
+            }
+        }
+        return PREPARE_SUCCESS;
+    }
+
+    statement->type = STATEMENT_CREATE_INDEX;
+
+    if (object == NULL || strcmp(object, "index") != 0 || on == NULL ||
+        strcmp(on, "on") != 0 || target == NULL || strtok(NULL, " ") != NULL) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    column = strchr(target, '(');
+    if (column == NULL || column == target ||
+        target[strlen(target) - 1] != ')') {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    *column++ = 0;
+    column[strlen(column) - 1] = 0;
+    statement->table_name = target;
+    if (strcmp(column, "username") == 0) {
+        statement->column = COLUMN_USERNAME;
+    } else if (strcmp(column, "email") == 0) {
+        statement->column = COLUMN_EMAIL;
+    } else {
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    return PREPARE_SUCCESS;
+}
+
+/*
+ * Validate the fields of a row and fill it in.
+ */
+PrepareResult
+prepare_row(char *id_string, char *username, char *email, Row *row)
+{
+    if (id_string == NULL || username == NULL || email == NULL) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    int id = atoi(id_string);
+    if (id < 0) {
+        return PREPARE_NEGATIVE_ID;
+    }
+    if (strlen(username) > COLUMN_USERNAME_SIZE) {
+        return PREPARE_STRING_TOO_LONG;
+    }
+    if (strlen(email) > COLUMN_EMAIL_SIZE) {
+        return PREPARE_STRING_TOO_LONG;
+    }
+
+    row->id = id;
+    strcpy(row->username, username);
+    strcpy(row->email, email);
+
+    return PREPARE_SUCCESS;
+}
+
+ExecuteResult
+execute_insert(Statement *statement, Table *table)
+{
+    ExecuteResult result;
+
+    if (table->pager->read_only) {
+        result = EXECUTE_READ_ONLY;
+    } else {
+        pthread_mutex_lock(&table->pager->write_lock);
+        if (statement->num_rows == 1) {
+            result = table_insert(table, statement->rows_to_insert);
+        } else {
+            result = table_insert_batch(table, statement->rows_to_insert,
+                                        statement->num_rows);
+        }
+        if (result == EXECUTE_SUCCESS) {
+            table_index_rows(table, statement->rows_to_insert,
+                             statement->num_rows);
+        }
+        pager_commit(table->pager);
+        pthread_mutex_unlock(&table->pager->write_lock);
+    }
+
+    free(statement->rows_to_insert);
+    return result;
+}
+
+/*
+ * Read rows for .load, one "id username email" per line. Prints the
+ * problem and returns false on the first bad line.
+ */
+bool
+read_rows_file(const char *filename, Row **rows, uint32_t *num_rows)
+{
+    FILE      *file = fopen(filename, "r");
+    char      *line = NULL;
+    size_t     line_length = 0;
+    uint32_t   capacity = 0;
+    uint32_t   line_num = 0;
+
+    if (file == NULL) {
+        printf("Unable to open '%s'.\n", filename);
+        return false;
+    }
+
+    *rows = NULL;
+    *num_rows = 0;
+    while (getline(&line, &line_length, file) != -1) {
+        char          *id_string = strtok(line, " \n");
+        char          *username = strtok(NULL, " \n");
+        char          *email = strtok(NULL, " \n");
+        PrepareResult  result;
+
+        line_num++;
+        if (id_string == NULL) {
+            continue;   /* Blank line */
+        }
+
+        if (*num_rows == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            *rows = realloc(*rows, sizeof(Row) * capacity);
+        }
+
+        result = prepare_row(id_string, username, email, &(*rows)[*num_rows]);
+        if (result != PREPARE_SUCCESS) {
+            printf("Error on line %u of '%s': %s\n", line_num, filename,
+                   result == PREPARE_NEGATIVE_ID ? "ID must be positive." :
+                   result == PREPARE_STRING_TOO_LONG ? "String is too long." :
+                   "Could not parse row.");
+            free(*rows);
+            free(line);
+            fclose(file);
+            return false;
+        }
+        (*num_rows)++;
+    }
+
+    free(line);
+    fclose(file);
+    return true;
+}
+
+int
+compare_row_id(const void *a, const void *b)
+{
+    uint32_t id_a = ((Row *) a)->id;
+    uint32_t id_b = ((Row *) b)->id;
+
+    return (id_a > id_b) - (id_a < id_b);
+}
+
+/*
+ * Sort rows by id, unless they already are. Returns false if an id
+ * appears twice.
+ */
+bool
+sort_rows(Row *rows, uint32_t num_rows)
+{
+    uint32_t i;
+
+    for (i = 1; i < num_rows && rows[i - 1].id <= rows[i].id; i++) {
+    }
+    if (i < num_rows) {
+        qsort(rows, num_rows, sizeof(Row), compare_row_id);
+    }
+    for (i = 1; i < num_rows; i++) {
+        if (rows[i - 1].id == rows[i].id) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Load many rows at once. Rows are sorted by id unless they already
+ * are. Into an empty table the tree is built bottom-up: leaves are
+ * packed to fill_percent of their capacity in key order on consecutive
+ * pages, and each internal level is written once over the level below.
+ * A table that already has rows gets them as a batch insert. Either way
+ * nothing is loaded if any id is a duplicate, and nothing is committed.
+ * The caller holds write_lock; a load into an empty table writes its
+ * pages unlatched, so nobody may read it meanwhile.
+ */
+ExecuteResult
+table_bulk_load(Table *table, Row *rows, uint32_t num_rows,
+                uint32_t fill_percent)
+{
+    Pager     *pager = table->pager;
+    uint32_t   counts[BULK_LOAD_MAX_LEVELS];
+    uint32_t   bases[BULK_LOAD_MAX_LEVELS];
+    uint32_t  *max_keys;
+    uint32_t  *leaf_starts;
+    uint32_t   leaf_fill;
+    uint32_t   used;
+    uint32_t   size;
+    uint32_t   last;
+    uint32_t   internal_fill;
+    uint32_t   num_levels;
+    uint32_t   next_page;
+    uint32_t   level;
+    uint32_t   i;
+    void      *root;
+    bool       empty;
+
+    if (pager->read_only) {
+        return EXECUTE_READ_ONLY;
+    }
+    if (num_rows == 0) {
+        return EXECUTE_SUCCESS;
+    }
+
+    if (!sort_rows(rows, num_rows)) {
+        return EXECUTE_DUPLICATE_KEY;
+    }
+
+    root = get_page(pager, table->root_page_num);
+    empty = (get_node_type(root) == NODE_LEAF &&
+             *leaf_node_num_cells(root) == 0);
+    unpin_page(pager, table->root_page_num);
+
+    if (!empty) {
+        return table_insert_batch(table, rows, num_rows);
+    }
+
+    leaf_fill = LEAF_NODE_SPACE_FOR_CELLS * fill_percent / 100;
+    /* At least four children keeps every node at two or more. */
+    internal_fill = (INTERNAL_NODE_MAX_CELLS + 1) * fill_percent / 100;
+    if (internal_fill < 4) {
+        internal_fill = 4;
+    }
+
+    /*
+     * Size every level, leaves first, up to a single root. Each leaf
+     * takes rows until the next would go past leaf_fill bytes.
+     */
+    leaf_starts = malloc(sizeof(uint32_t) * (num_rows + 1));
+    counts[0] = 0;
+    used = 0;
+    for (i = 0; i < num_rows; i++) {
+        size = cell_size_for_payload(serialized_row_size(&rows[i])) +
+               LEAF_NODE_ENTRY_SIZE;
+        if (i == 0 || used + size > leaf_fill) {
+            leaf_starts[counts[0]++] = i;
+            used = 0;
+        }
+        used += size;
+    }
+    leaf_starts[counts[0]] = num_rows;
+    /* Fill the last leaf to half from the one before it. */
+    last = counts[0] - 1;
+    while (last > 0 && used < leaf_fill / 2 &&
+           leaf_starts[last] - leaf_starts[last - 1] > 1) {
+        leaf_starts[last]--;
+        used += cell_size_for_payload(
+                    serialized_row_size(&rows[leaf_starts[last]])) +
+                LEAF_NODE_ENTRY_SIZE;
+    }
+    num_levels = 1;
+    while (counts[num_levels - 1] > 1) {
+        if (num_levels == BULK_LOAD_MAX_LEVELS) {
+            free(leaf_starts);
+            return EXECUTE_TABLE_FULL;
+        }
+        counts[num_levels] =
+            (counts[num_levels - 1] + internal_fill - 1) / internal_fill;
+        num_levels++;
+    }
+
+    /* The root keeps its page; the levels below go at the end. */
+    next_page = pager->num_pages;
+    for (level = 0; level < num_levels - 1; level++) {
+        bases[level] = next_page;
+        next_page += counts[level];
+    }
+    bases[num_levels - 1] = table->root_page_num;
+    /* Claim them, so overflow pages are allocated elsewhere. */
+    pager->num_pages = next_page;
+
+    max_keys = malloc(sizeof(uint32_t) * counts[0]);
+    for (level = 0; level < num_levels; level++) {
+        bulk_load_level(table, level, num_levels, counts, bases, max_keys,
+                        leaf_starts, rows);
+    }
+    free(max_keys);
+    free(leaf_starts);
 
     return EXECUTE_SUCCESS;
 }
 
+/*
+ * Write the nodes of one level of a bulk load. Leaf k gets the rows
+ * from leaf_starts[k] up to leaf_starts[k + 1]; children are spread
+ * evenly over the nodes of the levels above. max_keys holds the largest
+ * key under each node of the level below and is overwritten with this
+ * level's.
+ */
+void
+bulk_load_level(Table *table, uint32_t level, uint32_t num_levels,
+                uint32_t *counts, uint32_t *bases, uint32_t *max_keys,
+                uint32_t *leaf_starts, Row *rows)
+{
+    Pager     *pager = table->pager;
+    uint32_t   count = counts[level];
+    uint32_t   below = level == 0 ? 0 : counts[level - 1];
+    char       cell[LEAF_NODE_MAX_CELL_SIZE];
+    uint32_t   k;
+    InternalCells cells;
+
+    for (k = 0; k < count; k++) {
+        uint32_t  page_num = bases[level] + k;
+        uint32_t  first = (uint64_t) k * below / count;
+        uint32_t  end = (uint64_t) (k + 1) * below / count;
+        void     *node = get_page(pager, page_num);
+        uint32_t  i;
+
+        if (level == 0) {
+            first = leaf_starts[k];
+            end = leaf_starts[k + 1];
+            initialize_leaf_node(node);
+            for (i = first; i < end; i++) {
+                leaf_node_put_cell(node, i - first, cell,
+                                   leaf_cell_build(pager, &rows[i], cell));
+            }
+            *leaf_node_next_leaf(node) = k + 1 < count ? page_num + 1 : 0;
+            max_keys[k] = rows[end - 1].id;
+        } else {
+            cells.num_keys = end - first - 1;
+            for (i = first; i < end; i++) {
+                cells.children[i - first] = bases[level - 1] + i;
+                cells.keys[i - first] = max_keys[i];
+            }
+            initialize_internal_node(node);
+            internal_node_write(node, &cells);
+            max_keys[k] = max_keys[end - 1];
+        }
+
+        if (level == num_levels - 1) {
+            set_node_root(node, true);
+        } else {
+            uint32_t parents = counts[level + 1];
+            uint32_t parent = ((uint64_t) (k + 1) * parents + count - 1) /
+                              count - 1;
+
+            *node_parent(node) = bases[level + 1] + parent;
+        }
+
+        mark_page_dirty(pager, page_num);
+        unpin_page(pager, page_num);
+    }
+}
+
+/*
+ * Insert one row without committing. The caller holds write_lock.
+ */
+ExecuteResult
+table_insert(Table *table, Row *row_to_insert)
+{
+    char payload[ROW_MAX_SIZE];
+
+    serialize_row(row_to_insert, payload);
+    return table_insert_payload(table, payload,
+                                serialized_row_size(row_to_insert));
+}
+
+/*
+ * Insert a cell's payload, whose first ID_SIZE bytes are its key,
+ * without committing. The caller holds write_lock. Only the nodes a
+ * split of the leaf would reach stay latched.
+ */
 ExecuteResult
-execute_statement(Statement *statement, Table *table)
+table_insert_payload(Table *table, void *payload, uint32_t payload_size)
 {
-    switch (statement->type) {
-    case STATEMENT_INSERT:
-        return execute_insert(statement, table);
-    case STATEMENT_SELECT:
-        return execute_select(statement, table);
+    Cursor *cursor;
+    void   *node;
+    uint32_t num_cells;
+    uint32_t key_to_insert;
+    ExecuteResult result = EXECUTE_SUCCESS;
+
+    pager_begin_write(table->pager);
+    table->write_space =
+        cell_size_for_payload(payload_size) + LEAF_NODE_ENTRY_SIZE;
+
+    memcpy(&key_to_insert, payload, ID_SIZE);
+    cursor = table_find(table, key_to_insert);
+
+    /* The duplicate check must look at the leaf the cursor landed in. */
+    node = cursor->node;
+    num_cells = *leaf_node_num_cells(node);
+    if (cursor->cell_num < num_cells &&
+        *leaf_node_key(node, cursor->cell_num) == key_to_insert) {
+        result = EXECUTE_DUPLICATE_KEY;
+    } else {
+        leaf_node_insert(cursor, payload, payload_size);
+    }
+
+    cursor_free(cursor);
+    pager_end_write(table->pager);
+
+    return result;
+}
+
+/*
+ * Insert many rows without committing, or none of them if an id is
+ * repeated or already in the table. The rows are sorted by id, so those
+ * that go in the same leaf come together: each such run is checked in
+ * one merge pass against the keys of its leaf, then merged into it,
+ * with one descent for each. The caller holds write_lock. A run may
+ * split its leaf many times, so each descent keeps its whole path.
+ */
+ExecuteResult
+table_insert_batch(Table *table, Row *rows, uint32_t num_rows)
+{
+    Cursor   *cursor;
+    uint32_t  start;
+    uint32_t  end;
+    bool      duplicate;
+
+    if (!sort_rows(rows, num_rows)) {
+        return EXECUTE_DUPLICATE_KEY;
+    }
+
+    pager_begin_write(table->pager);
+    table->write_space = UINT32_MAX;
+
+    for (start = 0; start < num_rows; start = end) {
+        cursor = table_find(table, rows[start].id);
+        end = leaf_node_run_end(cursor->node, rows, start, num_rows);
+        duplicate = leaf_node_has_any(cursor, rows + start, end - start);
+        cursor_free(cursor);
+        pager_release_latches(table->pager, INVALID_PAGE_NUM);
+        if (duplicate) {
+            pager_end_write(table->pager);
+            return EXECUTE_DUPLICATE_KEY;
+        }
+    }
+
+    for (start = 0; start < num_rows; start = end) {
+        cursor = table_find(table, rows[start].id);
+        end = leaf_node_run_end(cursor->node, rows, start, num_rows);
+        leaf_node_insert_run(cursor, rows + start, end - start);
+        cursor_free(cursor);
+        pager_release_latches(table->pager, INVALID_PAGE_NUM);
+    }
+
+    pager_end_write(table->pager);
+    return EXECUTE_SUCCESS;
+}
+
+/*
+ * Delete every row with a key from first_key to last_key, without
+ * committing. Returns the number of rows deleted. The matching cells of
+ * one leaf go at once, then the leaf is rebalanced and the rest of the
+ * range looked up again, since rebalancing may have moved it. The caller
+ * holds write_lock. Rebalancing may reach any node on the path, so the
+ * descent keeps all of it.
+ */
+uint32_t
+table_delete(Table *table, uint32_t first_key, uint32_t last_key)
+{
+    Cursor   *cursor;
+    void     *node;
+    uint32_t  num_cells;
+    uint32_t  end;
+    uint32_t  page_num;
+    uint32_t  deleted = 0;
+
+    pager_begin_write(table->pager);
+    table->write_space = UINT32_MAX;
+
+    while (true) {
+        cursor = table_find(table, first_key);
+        node = cursor->node;
+        num_cells = *leaf_node_num_cells(node);
+
+        end = cursor->cell_num;
+        while (end < num_cells && *leaf_node_key(node, end) <= last_key) {
+            end++;
+        }
+        if (end == cursor->cell_num) {
+            cursor_free(cursor);
+            break;
+        }
+
+        leaf_node_delete(cursor, end - cursor->cell_num);
+        deleted += end - cursor->cell_num;
+        page_num = cursor->page_num;
+        cursor_free(cursor);
+
+        table_rebalance(table, page_num);
+        pager_release_latches(table->pager, INVALID_PAGE_NUM);
+    }
+
+    pager_end_write(table->pager);
+    return deleted;
+}
+
+/*
+ * Restore the minimum fill of a node after a delete. An underfull node
+ * merges with a sibling when their entries fit in one node, which takes
+ * an entry out of the parent and may leave that underfull in turn.
+ * Otherwise the two share their entries evenly. A root left with a
+ * single child is replaced by it.
+ */
+void
+table_rebalance(Table *table, uint32_t page_num)
+{
+    Pager     *pager = table->pager;
+    void      *node = get_page(pager, page_num);
+    void      *parent;
+    void      *left;
+    void      *right;
+    uint32_t   parent_page_num = *node_parent(node);
+    uint32_t   left_page_num;
+    uint32_t   right_page_num;
+    uint32_t   index;
+    uint32_t   separator;
+    bool       is_leaf = (get_node_type(node) == NODE_LEAF);
+    bool       underfull;
+    bool       fits;
+
+    if (is_node_root(node)) {
+        unpin_page(pager, page_num);
+        table_collapse_root(table);
+        return;
+    }
+
+    if (is_leaf) {
+        underfull = leaf_node_used_space(node) < LEAF_NODE_MIN_USED;
+    } else {
+        underfull = *internal_node_num_keys(node) < INTERNAL_NODE_MIN_KEYS;
+    }
+    unpin_page(pager, page_num);
+    if (!underfull) {
+        return;
+    }
+
+    /*
+     * Appends leave the right edge with nodes of a single child. Such a
+     * parent is rebalanced first, which gives the node a sibling.
+     */
+    parent = get_page(pager, parent_page_num);
+    if (*internal_node_num_keys(parent) == 0) {
+        unpin_page(pager, parent_page_num);
+        table_rebalance(table, parent_page_num);
+
+        node = get_page(pager, page_num);
+        parent_page_num = *node_parent(node);
+        unpin_page(pager, page_num);
+        parent = get_page(pager, parent_page_num);
+    }
+
+    /* Pair the node with its left sibling, or its right one if first. */
+    index = internal_node_child_index(parent, page_num);
+    if (index > 0) {
+        index--;
+    }
+    left_page_num = *internal_node_child(parent, index);
+    right_page_num = *internal_node_child(parent, index + 1);
+    separator = internal_node_key(parent, index);
+    unpin_page(pager, parent_page_num);
+
+    left = get_page(pager, left_page_num);
+    right = get_page(pager, right_page_num);
+    if (is_leaf) {
+        fits = leaf_node_used_space(left) + leaf_node_used_space(right) <=
+               LEAF_NODE_SPACE_FOR_CELLS;
+    } else {
+        /*
+         * Merging brings the separator down as well, and the merged
+         * keys may share a shorter prefix than either node's did.
+         */
+        uint32_t  num_keys = *internal_node_num_keys(left) + 1 +
+                             *internal_node_num_keys(right);
+        uint32_t  first_key = *internal_node_num_keys(left) > 0 ?
+                              internal_node_key(left, 0) : separator;
+        uint32_t  last_key = *internal_node_num_keys(right) > 0 ?
+            internal_node_key(right, *internal_node_num_keys(right) - 1) :
+            separator;
+
+        fits = num_keys + 1 <= internal_node_capacity(
+                   internal_prefix_length(first_key, last_key));
+    }
+    unpin_page(pager, right_page_num);
+    unpin_page(pager, left_page_num);
+
+    if (!fits) {
+        if (is_leaf) {
+            leaf_node_redistribute(table, parent_page_num, index);
+        } else {
+            internal_node_redistribute(table, parent_page_num, index);
+        }
+        return;
+    }
+
+    if (is_leaf) {
+        leaf_node_merge(table, parent_page_num, index);
+    } else {
+        internal_node_merge(table, parent_page_num, index);
+    }
+    table_rebalance(table, parent_page_num);
+}
+
+/*
+ * While the root is an internal node with one child, copy the child
+ * into the root page and free the child's page. The root stays put.
+ */
+void
+table_collapse_root(Table *table)
+{
+    Pager     *pager = table->pager;
+    uint32_t   root_page_num = table->root_page_num;
+    void      *root = latch_page(pager, root_page_num);
+    uint32_t   i;
+
+    while (get_node_type(root) == NODE_INTERNAL &&
+           *internal_node_num_keys(root) == 0) {
+        uint32_t  child_page_num = *internal_node_right_child(root);
+        void     *child = latch_page(pager, child_page_num);
+
+        memcpy(root, child, PAGE_SIZE);
+        set_node_root(root, true);
+        unlatch_page(pager, child_page_num, child);
+        pager_free_page(pager, child_page_num);
+
+        if (get_node_type(root) == NODE_INTERNAL) {
+            for (i = 0; i <= *internal_node_num_keys(root); i++) {
+                uint32_t  grandchild_page_num = *internal_node_child(root, i);
+                void     *grandchild = get_page(pager, grandchild_page_num);
+
+                set_node_parent(grandchild, root_page_num);
+                mark_page_dirty(pager, grandchild_page_num);
+                unpin_page(pager, grandchild_page_num);
+            }
+        }
+        mark_page_dirty(pager, root_page_num);
+    }
+
+    unlatch_page(pager, root_page_num, root);
+}
+
+/*
+ * Compact the file: every page in use past the point the file would end
+ * without free pages moves into a free page before it, and the tail is
+ * cut off. The moves are one transaction, checkpointed before the file
+ * is truncated. Pages move without latches, so the caller must be the
+ * file's only user.
+ */
+ExecuteResult
+db_vacuum(Database *db, uint32_t *reclaimed)
+{
+    Pager     *pager = db->pager;
+    void      *meta;
+    void      *node;
+    bool      *is_free;
+    uint32_t  *referrer;
+    uint32_t   num_free;
+    uint32_t   num_pages = pager->num_pages;
+    uint32_t   new_num_pages;
+    uint32_t   page_num;
+    uint32_t   next;
+    uint32_t   src;
+    uint32_t   dest;
+    uint32_t   i;
+    Column     column;
+
+    *reclaimed = 0;
+    if (pager->read_only) {
+        return EXECUTE_READ_ONLY;
+    }
+
+    meta = get_page(pager, 0);
+    num_free = *meta_field(meta, META_FREELIST_COUNT_OFFSET);
+    page_num = *meta_field(meta, META_FREELIST_HEAD_OFFSET);
+    unpin_page(pager, 0);
+    if (num_free == 0) {
+        return EXECUTE_SUCCESS;
+    }
+
+    is_free = calloc(num_pages, sizeof(bool));
+    referrer = malloc(sizeof(uint32_t) * num_pages);
+    while (page_num != 0) {
+        is_free[page_num] = true;
+        node = get_page(pager, page_num);
+        next = *free_page_next(node);
+        unpin_page(pager, page_num);
+        page_num = next;
+    }
+
+    /*
+     * Moving a leaf repoints its left neighbour and moving an overflow
+     * page the page before it in its chain, so find them all, in the
+     * tables and in their indexes.
+     */
+    for (i = 0; i < db->num_tables; i++) {
+        for (column = COLUMN_ID; column < NUM_COLUMNS; column++) {
+            if (table_tree(db->tables[i], column) != NULL) {
+                vacuum_find_referrers(table_tree(db->tables[i], column),
+                                      referrer);
+            }
+        }
+    }
+
+    new_num_pages = num_pages - num_free;
+    dest = 1;
+    for (src = num_pages - 1; src >= new_num_pages; src--) {
+        if (is_free[src]) {
+            continue;
+        }
+        while (!is_free[dest]) {
+            dest++;
+        }
+        vacuum_move_page(db, src, dest, referrer);
+        is_free[dest] = false;
+    }
+    free(referrer);
+    free(is_free);
+
+    meta = get_page(pager, 0);
+    *meta_field(meta, META_FREELIST_HEAD_OFFSET) = 0;
+    *meta_field(meta, META_FREELIST_COUNT_OFFSET) = 0;
+    mark_page_dirty(pager, 0);
+    unpin_page(pager, 0);
+
+    /* The hints may name pages that just moved. */
+    for (i = 0; i < db->num_tables; i++) {
+        for (column = COLUMN_ID; column < NUM_COLUMNS; column++) {
+            if (table_tree(db->tables[i], column) != NULL) {
+                table_tree(db->tables[i], column)->rightmost_leaf =
+                    INVALID_PAGE_NUM;
+            }
+        }
+    }
+    pager->num_pages = new_num_pages;
+    pager_commit(pager);
+    pager_checkpoint(pager);
+    pager_truncate(pager, new_num_pages);
+
+    *reclaimed = num_free;
+    return EXECUTE_SUCCESS;
+}
+
+/*
+ * Record the referrer of each leaf of a tree, the leaf before it, and of
+ * each of their overflow pages.
+ */
+void
+vacuum_find_referrers(Table *tree, uint32_t *referrer)
+{
+    Pager     *pager = tree->pager;
+    uint32_t   page_num = tree->root_page_num;
+    uint32_t   next;
+    void      *node = get_page(pager, page_num);
+
+    while (get_node_type(node) == NODE_INTERNAL) {
+        next = *internal_node_child(node, 0);
+        unpin_page(pager, page_num);
+        page_num = next;
+        node = get_page(pager, page_num);
+    }
+    referrer[page_num] = INVALID_PAGE_NUM;
+    while (true) {
+        vacuum_find_overflow(tree, page_num, node, referrer);
+        next = *leaf_node_next_leaf(node);
+        if (next == 0) {
+            break;
+        }
+        referrer[next] = page_num;
+        unpin_page(pager, page_num);
+        page_num = next;
+        node = get_page(pager, page_num);
+    }
+    unpin_page(pager, page_num);
+}
+
+/*
+ * Record the referrer of each overflow page of a leaf: the leaf for the
+ * first page of a chain, the page before it for the others.
+ */
+void
+vacuum_find_overflow(Table *table, uint32_t page_num, void *leaf,
+                     uint32_t *referrer)
+{
+    Pager     *pager = table->pager;
+    uint32_t   i;
+    uint32_t   prev;
+    uint32_t   overflow;
+    void      *cell;
+    void      *page;
+
+    for (i = 0; i < *leaf_node_num_cells(leaf); i++) {
+        cell = leaf_node_cell(leaf, i);
+        if (*(uint16_t *) cell <= LEAF_NODE_MAX_LOCAL) {
+            continue;
+        }
+        prev = page_num;
+        overflow = *leaf_cell_overflow(cell);
+        while (overflow != 0) {
+            referrer[overflow] = prev;
+            prev = overflow;
+            page = get_page(pager, overflow);
+            overflow = *overflow_page_next(page);
+            unpin_page(pager, prev);
+        }
+    }
+}
+
+/*
+ * Move a page in use from src to the free page dest and repoint
+ * everything that refers to it: its parent, or the meta page for the
+ * root; the children of an internal node; the previous leaf of a leaf;
+ * the leaf or previous page of an overflow page. referrer holds the
+ * last two and is kept up to date for the pages that refer to dest.
+ */
+void
+vacuum_move_page(Database *db, uint32_t src, uint32_t dest,
+                 uint32_t *referrer)
+{
+    Pager     *pager = db->pager;
+    void      *src_node = get_page(pager, src);
+    void      *node = get_page(pager, dest);
+    void      *other;
+    uint32_t   other_page_num;
+    uint32_t   i;
+
+    memcpy(node, src_node, PAGE_SIZE);
+    unpin_page(pager, src);
+
+    if (get_node_type(node) == NODE_OVERFLOW) {
+        other_page_num = referrer[src];
+        other = get_page(pager, other_page_num);
+        if (get_node_type(other) == NODE_OVERFLOW) {
+            *overflow_page_next(other) = dest;
+        } else {
+            for (i = 0; i < *leaf_node_num_cells(other); i++) {
+                void *cell = leaf_node_cell(other, i);
+
+                if (*(uint16_t *) cell > LEAF_NODE_MAX_LOCAL &&
+                    *leaf_cell_overflow(cell) == src) {
+                    *leaf_cell_overflow(cell) = dest;
+                    break;
+                }
+            }
+        }
+        mark_page_dirty(pager, other_page_num);
+        unpin_page(pager, other_page_num);
+
+        if (*overflow_page_next(node) != 0) {
+            referrer[*overflow_page_next(node)] = dest;
+        }
+        referrer[dest] = other_page_num;
+        mark_page_dirty(pager, dest);
+        unpin_page(pager, dest);
+        return;
+    }
+
+    if (is_node_root(node)) {
+        void     *meta = get_page(pager, 0);
+        uint32_t  j;
+        Column    column;
+
+        for (j = 0; j < db->num_tables; j++) {
+            for (column = COLUMN_ID; column < NUM_COLUMNS; column++) {
+                Table *tree = table_tree(db->tables[j], column);
+
+                if (tree != NULL && tree->root_page_num == src) {
+                    *meta_field(meta, tree->root_offset) = dest;
+                    tree->root_page_num = dest;
+                }
+            }
+        }
+        mark_page_dirty(pager, 0);
+        unpin_page(pager, 0);
+    } else {
+        other_page_num = *node_parent(node);
+        other = get_page(pager, other_page_num);
+        for (i = 0; i <= *internal_node_num_keys(other); i++) {
+            if (*internal_node_child(other, i) == src) {
+                *internal_node_child(other, i) = dest;
+                break;
+            }
+        }
+        mark_page_dirty(pager, other_page_num);
+        unpin_page(pager, other_page_num);
+    }
+
+    if (get_node_type(node) == NODE_INTERNAL) {
+        for (i = 0; i <= *internal_node_num_keys(node); i++) {
+            other_page_num = *internal_node_child(node, i);
+            other = get_page(pager, other_page_num);
+            *node_parent(other) = dest;
+            mark_page_dirty(pager, other_page_num);
+            unpin_page(pager, other_page_num);
+        }
+    } else {
+        other_page_num = referrer[src];
+        if (other_page_num != INVALID_PAGE_NUM) {
+            other = get_page(pager, other_page_num);
+            *leaf_node_next_leaf(other) = dest;
+            mark_page_dirty(pager, other_page_num);
+            unpin_page(pager, other_page_num);
+        }
+        if (*leaf_node_next_leaf(node) != 0) {
+            referrer[*leaf_node_next_leaf(node)] = dest;
+        }
+        referrer[dest] = other_page_num;
+
+        for (i = 0; i < *leaf_node_num_cells(node); i++) {
+            void *cell = leaf_node_cell(node, i);
+
+            if (*(uint16_t *) cell > LEAF_NODE_MAX_LOCAL) {
+                referrer[*leaf_cell_overflow(cell)] = dest;
+            }
+        }
+    }
+
+    mark_page_dirty(pager, dest);
+    unpin_page(pager, dest);
+}
+
+/*
+ * Print the rows with ids from first_id to last_id. The scan seeks to
+ * first_id and stops at last_id without stepping into the next leaf, so
+ * a lookup of one id reads only the path from the root to its leaf.
+ *
+ * With scan_threads set, a range is split among that many threads.
+ * Each range after the first is printed into a buffer, and the buffers
+ * are written out in order once all are done.
+ */
+ExecuteResult
+execute_select(Statement *statement, Table *table)
+{
+    ScanPart   *parts;
+    RowBuffer  *buffers;
+    uint32_t   *last_keys;
+    uint32_t    num_parts;
+    Row         row;
+    uint32_t    i;
+
+    if (statement->aggregate != AGGREGATE_NONE) {
+        return execute_aggregate(statement, table);
+    }
+    if (statement->column != COLUMN_ID) {
+        return execute_select_value(statement, table);
+    }
+
+    /* A point lookup reads its row without latching anything, if it can. */
+    if (statement->first_id == statement->last_id) {
+        switch (table_peek_row(table, statement->first_id, &row)) {
+        case PEEK_FOUND:
+            print_row(&row);
+            return EXECUTE_SUCCESS;
+        case PEEK_NOT_FOUND:
+            return EXECUTE_SUCCESS;
+        case PEEK_FAILED:
+            break;
+        }
+    }
+
+    last_keys = malloc(sizeof(uint32_t) * table->scan_threads);
+    num_parts = table_scan_split(table, statement->first_id,
+                                 statement->last_id, table->scan_threads,
+                                 last_keys);
+    if (num_parts == 1) {
+        table_scan(table, statement->first_id, statement->last_id,
+                   visit_print_row, NULL);
+        free(last_keys);
+        return EXECUTE_SUCCESS;
+    }
+
+    parts = malloc(sizeof(ScanPart) * num_parts);
+    buffers = calloc(num_parts, sizeof(RowBuffer));
+    for (i = 0; i < num_parts; i++) {
+        parts[i].table = table;
+        parts[i].first_key = i == 0 ? statement->first_id
+                                    : last_keys[i - 1] + 1;
+        parts[i].last_key = last_keys[i];
+        parts[i].visit = i == 0 ? visit_print_row : visit_buffer_row;
+        parts[i].arg = &buffers[i];
+    }
+    table_scan_parallel(parts, num_parts);
+
+    for (i = 1; i < num_parts; i++) {
+        fwrite(buffers[i].data, 1, buffers[i].length, stdout);
+        free(buffers[i].data);
+    }
+    free(buffers);
+    free(parts);
+    free(last_keys);
+
+    return EXECUTE_SUCCESS;
+}
+
+/*
+ * Visit the rows with keys from first_key to last_key in order.
+ */
+void
+table_scan(Table *table, uint32_t first_key, uint32_t last_key,
+           RowVisitor visit, void *arg)
+{
+    Cursor   *cursor = table_find(table, first_key);
+    Row       row;
+    uint32_t  key;
+
+    /*
+     * Every separator is the largest key under its child, so the leaf
+     * found holds a key >= first_key unless no such key exists.
+     */
+    cursor->end_key = last_key;
+    cursor->end_of_table =
+        cursor->cell_num >= *leaf_node_num_cells(cursor->node);
+
+    /* The scan reads leaves in file order more often than not. */
+    if (first_key != last_key) {
+        pager_advise(table->pager, MADV_SEQUENTIAL);
+    }
+    cursor_prefetch(cursor);
+
+    while (!(cursor->end_of_table)) {
+        key = *leaf_node_key(cursor->node, cursor->cell_num);
+        if (key > last_key) {
+            break;
+        }
+        cursor_read_row(cursor, &row);
+        visit(arg, &row);
+        if (key == last_key) {
+            break;
+        }
+        cursor_advance(cursor);
+    }
+
+    cursor_free(cursor);
+}
+
+/*
+ * Split the keys from first_key to last_key into up to max_parts ranges
+ * at separators of the root, each range covering about as many of its
+ * children. Stores the last key of each range in last_keys and returns
+ * the number of ranges, 1 if the root is a leaf.
+ */
+uint32_t
+table_scan_split(Table *table, uint32_t first_key, uint32_t last_key,
+                 uint32_t max_parts, uint32_t *last_keys)
+{
+    Pager     *pager = table->pager;
+    uint32_t   root_page_num = table->root_page_num;
+    void      *root = latch_page(pager, root_page_num);
+    uint32_t   num_parts = 1;
+    uint32_t   first;
+    uint32_t   children;
+    uint32_t   i;
+
+    if (get_node_type(root) == NODE_INTERNAL && max_parts > 1) {
+        first = internal_node_find_child(root, first_key);
+        children = internal_node_find_child(root, last_key) - first + 1;
+        if (max_parts > children) {
+            max_parts = children;
+        }
+        for (; num_parts < max_parts; num_parts++) {
+            i = first + (uint64_t) num_parts * children / max_parts - 1;
+            last_keys[num_parts - 1] = internal_node_key(root, i);
+        }
+    }
+    unlatch_page(pager, root_page_num, root);
+
+    last_keys[num_parts - 1] = last_key;
+    return num_parts;
+}
+
+/*
+ * Scan each part in a thread of its own, the first in the calling
+ * thread, and wait for all of them.
+ */
+void
+table_scan_parallel(ScanPart *parts, uint32_t num_parts)
+{
+    uint32_t i;
+
+    for (i = 1; i < num_parts; i++) {
+        if (pthread_create(&parts[i].thread, NULL, scan_part_run,
+                           &parts[i]) != 0) {
+            printf("Error starting scan thread: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+    }
+    scan_part_run(&parts[0]);
+    for (i = 1; i < num_parts; i++) {
+        pthread_join(parts[i].thread, NULL);
+    }
+}
+
+void *
+scan_part_run(void *arg)
+{
+    ScanPart *part = arg;
+
+    table_scan(part->table, part->first_key, part->last_key, part->visit,
+               part->arg);
+    return NULL;
+}
+
+/*
+ * Print the aggregate over the rows with ids from first_id to last_id,
+ * or NULL when min, max or sum has no rows to go on.
+ */
+ExecuteResult
+execute_aggregate(Statement *statement, Table *table)
+{
+    uint64_t value;
+
+    if (table_aggregate(table, statement->aggregate, statement->first_id,
+                        statement->last_id, &value)) {
+        printf("(%lu)\n", value);
+    } else {
+        printf("(NULL)\n");
+    }
+
+    return EXECUTE_SUCCESS;
+}
+
+/*
+ * Compute the aggregate over the keys from first_key to last_key. The
+ * id is the key, so no row is read: min and max look at the ends of the
+ * range only, count and sum at the keys of each leaf. Returns false if
+ * the value is NULL.
+ */
+bool
+table_aggregate(Table *table, Aggregate aggregate, uint32_t first_key,
+                uint32_t last_key, uint64_t *value)
+{
+    uint64_t  count;
+    uint64_t  sum;
+    uint32_t  key;
+
+    switch (aggregate) {
+    case AGGREGATE_MIN:
+        if (!table_min_key(table, first_key, last_key, &key)) {
+            return false;
+        }
+        *value = key;
+        return true;
+    case AGGREGATE_MAX:
+        if (!table_max_key(table, first_key, last_key, &key)) {
+            return false;
+        }
+        *value = key;
+        return true;
+    case AGGREGATE_COUNT:
+        table_count_keys(table, first_key, last_key, &count, NULL);
+        *value = count;
+        return true;
+    case AGGREGATE_SUM:
+        table_count_keys(table, first_key, last_key, &count, &sum);
+        *value = sum;
+        return count > 0;
+    case AGGREGATE_NONE:
+        break;
+    }
+
+    return false;
+}
+
+/*
+ * The smallest key from first_key to last_key, the first the cursor
+ * finds. For the whole table that is the first key of the leftmost leaf.
+ */
+bool
+table_min_key(Table *table, uint32_t first_key, uint32_t last_key,
+              uint32_t *key)
+{
+    Cursor *cursor = table_find(table, first_key);
+    bool    found = false;
+
+    /* The leaf found holds a key >= first_key unless none exists. */
+    if (cursor->cell_num < *leaf_node_num_cells(cursor->node)) {
+        *key = *leaf_node_key(cursor->node, cursor->cell_num);
+        found = *key <= last_key;
+    }
+    cursor_free(cursor);
+
+    return found;
+}
+
+/*
+ * The largest key from first_key to last_key. The leaf that would hold
+ * last_key has every smaller key after those of earlier leaves, so the
+ * answer is in it unless all of its keys are larger. Then it is the
+ * largest key of the leaf before, which holds the separator left of
+ * the path to this one. For the whole table the leaf is the rightmost
+ * one and the answer its largest key.
+ */
+bool
+table_max_key(Table *table, uint32_t first_key, uint32_t last_key,
+              uint32_t *key)
+{
+    uint32_t separator;
+
+    if (!table_leaf_floor_key(table, last_key, key) &&
+        (!table_left_separator(table, last_key, &separator) ||
+         !table_leaf_floor_key(table, separator, key))) {
+        return false;
+    }
+    return *key >= first_key;
+}
+
+/*
+ * The largest key up to the given one in the leaf that would hold it.
+ * Returns false if every key of that leaf is larger.
+ */
+bool
+table_leaf_floor_key(Table *table, uint32_t bound, uint32_t *key)
+{
+    Cursor   *cursor = table_find(table, bound);
+    uint32_t  num_cells = *leaf_node_num_cells(cursor->node);
+    uint32_t  cell_num = cursor->cell_num;
+    bool      found = true;
+
+    if (cell_num < num_cells &&
+        *leaf_node_key(cursor->node, cell_num) == bound) {
+        *key = bound;
+    } else if (cell_num == num_cells && num_cells > 0) {
+        *key = get_node_max_key(table->pager, cursor->node);
+    } else if (cell_num > 0) {
+        *key = *leaf_node_key(cursor->node, cell_num - 1);
+    } else {
+        found = false;
+    }
+    cursor_free(cursor);
+
+    return found;
+}
+
+/*
+ * The separator just left of the path from the root to the leaf for the
+ * key; every key of an earlier leaf is at most it. The deepest such
+ * separator is the closest. Returns false if the leaf is the first.
+ */
+bool
+table_left_separator(Table *table, uint32_t key, uint32_t *separator)
+{
+    Pager     *pager = table->pager;
+    uint32_t   page_num = table->root_page_num;
+    void      *node = latch_page(pager, page_num);
+    void      *child;
+    uint32_t   child_index;
+    uint32_t   child_num;
+    bool       found = false;
+
+    while (get_node_type(node) == NODE_INTERNAL) {
+        child_index = internal_node_find_child(node, key);
+        if (child_index > 0) {
+            *separator = internal_node_key(node, child_index - 1);
+            found = true;
+        }
+        child_num = *internal_node_child(node, child_index);
+        child = latch_page(pager, child_num);
+        unlatch_page(pager, page_num, node);
+        page_num = child_num;
+        node = child;
+    }
+    unlatch_page(pager, page_num, node);
+
+    return found;
+}
+
+/*
+ * Count the keys from first_key to last_key, and sum them if sum is not
+ * NULL. A leaf whose largest key is in range counts whole, from its
+ * number of cells, and only the last leaf is compared key by key.
+ */
+void
+table_count_keys(Table *table, uint32_t first_key, uint32_t last_key,
+                 uint64_t *count, uint64_t *sum)
+{
+    Cursor   *cursor = table_find(table, first_key);
+    uint32_t  num_cells;
+    uint32_t  cell_num;
+    bool      last_leaf;
+
+    *count = 0;
+    if (sum != NULL) {
+        *sum = 0;
+    }
+
+    cursor->end_key = last_key;
+    cursor->end_of_table =
+        cursor->cell_num >= *leaf_node_num_cells(cursor->node);
+    if (first_key != last_key) {
+        pager_advise(table->pager, MADV_SEQUENTIAL);
+    }
+    cursor_prefetch(cursor);
+
+    while (!cursor->end_of_table) {
+        void *node = cursor->node;
+
+        num_cells = *leaf_node_num_cells(node);
+        last_leaf = get_node_max_key(table->pager, node) >= last_key;
+        if (last_leaf) {
+            num_cells = cursor->cell_num;
+            while (num_cells < *leaf_node_num_cells(node) &&
+                   *leaf_node_key(node, num_cells) <= last_key) {
+                num_cells++;
+            }
+        }
+
+        *count += num_cells - cursor->cell_num;
+        if (sum != NULL) {
+            for (cell_num = cursor->cell_num; cell_num < num_cells;
+                 cell_num++) {
+                *sum += *leaf_node_key(node, cell_num);
+            }
+        }
+        if (last_leaf) {
+            break;
+        }
+
+        /* Step from the last cell into the next leaf. */
+        cursor->cell_num = num_cells - 1;
+        cursor_advance(cursor);
+    }
+
+    cursor_free(cursor);
+}
+
+/*
+ * Print the rows whose column has the statement's value, in id order.
+ * Without an index on the column every row is read.
+ */
+ExecuteResult
+execute_select_value(Statement *statement, Table *table)
+{
+    Table     *index = __atomic_load_n(&table->indexes[statement->column],
+                                       __ATOMIC_ACQUIRE);
+    uint32_t  *ids;
+    uint32_t   count;
+    uint32_t   i;
+    Row        row;
+
+    if (index == NULL) {
+        table_scan(table, 0, UINT32_MAX, visit_print_match, statement);
+        return EXECUTE_SUCCESS;
+    }
+
+    count = index_lookup(index, statement->value, &ids);
+    qsort(ids, count, sizeof(uint32_t), compare_id);
+    for (i = 0; i < count; i++) {
+        /* The writer may have changed the row since its entry was read. */
+        if ((i == 0 || ids[i] != ids[i - 1]) &&
+            table_get_row(table, ids[i], &row)) {
+            visit_print_match(statement, &row);
+        }
+    }
+    free(ids);
+
+    return EXECUTE_SUCCESS;
+}
+
+int
+compare_id(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a;
+    uint32_t y = *(const uint32_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * Read the row with the key, without latching anything if possible.
+ * Returns false if there is none.
+ */
+bool
+table_get_row(Table *table, uint32_t key, Row *row)
+{
+    Cursor *cursor;
+    bool    found;
+
+    switch (table_peek_row(table, key, row)) {
+    case PEEK_FOUND:
+        return true;
+    case PEEK_NOT_FOUND:
+        return false;
+    case PEEK_FAILED:
+        break;
+    }
+
+    cursor = table_find(table, key);
+    found = cursor->cell_num < *leaf_node_num_cells(cursor->node) &&
+            *leaf_node_key(cursor->node, cursor->cell_num) == key;
+    if (found) {
+        cursor_read_row(cursor, row);
+    }
+    cursor_free(cursor);
+
+    return found;
+}
+
+/*
+ * The table itself for the id, or the column's index.
+ */
+Table *
+table_tree(Table *table, Column column)
+{
+    return column == COLUMN_ID ? table : table->indexes[column];
+}
+
+/*
+ * The meta page field naming the root of the table's index on the
+ * column, in the table's catalog entry after its own root.
+ */
+uint32_t
+index_root_offset(Table *table, Column column)
+{
+    return table->root_offset + column * sizeof(uint32_t);
+}
+
+char *
+row_column(Row *row, Column column)
+{
+    return column == COLUMN_USERNAME ? row->username : row->email;
+}
+
+Table *
+table_open_index(Table *table, Column column, uint32_t root_page_num)
+{
+    Table *index = calloc(1, sizeof(Table));
+
+    index->pager = table->pager;
+    index->root_page_num = root_page_num;
+    index->rightmost_leaf = INVALID_PAGE_NUM;
+    index->scan_threads = 1;
+    index->root_offset = index_root_offset(table, column);
+    index->column = column;
+
+    return index;
+}
+
+/*
+ * An index is a tree of its own, with one entry for each value of the
+ * column: the key it is at, the value, and the ids of the table's rows
+ * that have it, in no order. As a cell's payload an entry is its key,
+ * the value as a uint16 length and that many bytes, then the ids until
+ * the end of the payload. A value with more than INDEX_MAX_IDS rows has
+ * as many more entries as it takes to hold the rest.
+ *
+ * Entries are found by hashing: a value's home is a key in the lower
+ * half of the key space, and its entries are at the first keys from
+ * there that are free when they are added, as in a hash table with
+ * linear probing. The entries of a value are thus among the run of
+ * keys in use from its home on, which is short since rows that share a
+ * value share its entry. Nothing in the upper half of the key space is
+ * a home, so runs never wrap around.
+ */
+uint32_t
+index_home(const char *value)
+{
+    uint32_t hash = 2166136261u;
+
+    for (; *value != '\0'; value++) {
+        hash = (hash ^ (uint8_t) *value) * 16777619u;
+    }
+
+    return hash & INDEX_HOME_MASK;
+}
+
+/*
+ * Read the entry at the key, if there is one. Its ids are allocated
+ * and the caller frees them.
+ */
+bool
+index_read(Table *index, uint32_t key, IndexValue *entry)
+{
+    Cursor    *cursor = table_find(index, key);
+    void      *cell;
+    char      *payload;
+    uint32_t   payload_size;
+    uint16_t   length;
+
+    if (cursor->cell_num >= *leaf_node_num_cells(cursor->node) ||
+        *leaf_node_key(cursor->node, cursor->cell_num) != key) {
+        cursor_free(cursor);
+        return false;
+    }
+    cell = leaf_node_cell(cursor->node, cursor->cell_num);
+    payload = malloc(*(uint16_t *) cell);
+    payload_size = leaf_cell_read(index->pager, cell, payload);
+    cursor_free(cursor);
+
+    entry->key = key;
+    memcpy(&length, payload + ID_SIZE, LENGTH_SIZE);
+    memcpy(entry->value, payload + ID_SIZE + LENGTH_SIZE, length);
+    entry->value[length] = '\0';
+    entry->num_ids = (payload_size - ID_SIZE - LENGTH_SIZE - length) /
+                     sizeof(uint32_t);
+    entry->ids = malloc(sizeof(uint32_t) * entry->num_ids);
+    memcpy(entry->ids, payload + ID_SIZE + LENGTH_SIZE + length,
+           sizeof(uint32_t) * entry->num_ids);
+    free(payload);
+
+    return true;
+}
+
+/*
+ * Insert the entry at its key, which is free.
+ */
+void
+index_write(Table *index, IndexValue *entry)
+{
+    uint16_t   length = strlen(entry->value);
+    uint32_t   payload_size = ID_SIZE + LENGTH_SIZE + length +
+                              sizeof(uint32_t) * entry->num_ids;
+    char      *payload = malloc(payload_size);
+
+    memcpy(payload, &entry->key, ID_SIZE);
+    memcpy(payload + ID_SIZE, &length, LENGTH_SIZE);
+    memcpy(payload + ID_SIZE + LENGTH_SIZE, entry->value, length);
+    memcpy(payload + ID_SIZE + LENGTH_SIZE + length, entry->ids,
+           sizeof(uint32_t) * entry->num_ids);
+    table_insert_payload(index, payload, payload_size);
+    free(payload);
+}
+
+/*
+ * The ids of the rows with the value, in no order. The caller frees
+ * them.
+ */
+uint32_t
+index_lookup(Table *index, const char *value, uint32_t **ids)
+{
+    uint32_t    key = index_home(value);
+    uint32_t    count = 0;
+    IndexValue  entry;
+
+    *ids = malloc(sizeof(uint32_t));
+    while (index_read(index, key, &entry)) {
+        if (strcmp(entry.value, value) == 0) {
+            *ids = realloc(*ids, sizeof(uint32_t) * (count + entry.num_ids));
+            memcpy(*ids + count, entry.ids, sizeof(uint32_t) * entry.num_ids);
+            count += entry.num_ids;
+        }
+        free(entry.ids);
+        if (key == UINT32_MAX) {
+            break;
+        }
+        key++;
+    }
+
+    return count;
+}
+
+/*
+ * Add the ids of rows with the value: to the value's entries that have
+ * room, then to new ones at the first free keys from there. The caller
+ * holds the pager's write_lock.
+ */
+void
+index_insert(Table *index, const char *value, uint32_t *ids,
+             uint32_t num_ids)
+{
+    uint32_t    key = index_home(value);
+    uint32_t    count;
+    IndexValue  entry;
+    bool        room;
+
+    while (num_ids > 0) {
+        if (index_read(index, key, &entry)) {
+            room = strcmp(entry.value, value) == 0 &&
+                   entry.num_ids < INDEX_MAX_IDS;
+        } else {
+            entry.key = key;
+            strcpy(entry.value, value);
+            entry.ids = NULL;
+            entry.num_ids = 0;
+            room = true;
+        }
+
+        if (room) {
+            if (entry.num_ids > 0) {
+                table_delete(index, key, key);
+            }
+            count = INDEX_MAX_IDS - entry.num_ids;
+            if (count > num_ids) {
+                count = num_ids;
+            }
+            entry.ids = realloc(entry.ids,
+                                sizeof(uint32_t) * (entry.num_ids + count));
+            memcpy(entry.ids + entry.num_ids, ids, sizeof(uint32_t) * count);
+            entry.num_ids += count;
+            ids += count;
+            num_ids -= count;
+            index_write(index, &entry);
+        }
+        free(entry.ids);
+
+        if (num_ids > 0 && key == UINT32_MAX) {
+            printf("Index is out of keys.\n");
+            exit(EXIT_FAILURE);
+        }
+        key++;
+    }
+}
+
+/*
+ * Remove the ids of rows with the value, sorted, from the value's
+ * entries. An entry left with none is removed.
+ */
+void
+index_delete(Table *index, const char *value, uint32_t *ids,
+             uint32_t num_ids)
+{
+    uint32_t    key = index_home(value);
+    uint32_t    kept;
+    uint32_t    i;
+    IndexValue  entry;
+
+    while (num_ids > 0 && index_read(index, key, &entry)) {
+        kept = entry.num_ids;
+        if (strcmp(entry.value, value) == 0) {
+            for (i = 0, kept = 0; i < entry.num_ids; i++) {
+                if (bsearch(&entry.ids[i], ids, num_ids, sizeof(uint32_t),
+                            compare_id) == NULL) {
+                    entry.ids[kept++] = entry.ids[i];
+                }
+            }
+        }
+
+        if (kept == 0) {
+            /* Another entry of the run may have moved into the key. */
+            index_remove_entry(index, key);
+            num_ids -= entry.num_ids;
+            free(entry.ids);
+            continue;
+        }
+        if (kept < entry.num_ids) {
+            table_delete(index, key, key);
+            num_ids -= entry.num_ids - kept;
+            entry.num_ids = kept;
+            index_write(index, &entry);
+        }
+        free(entry.ids);
+        if (key == UINT32_MAX) {
+            return;
+        }
+        key++;
+    }
+}
+
+/*
+ * Remove the entry at the key. That leaves a hole in the run of keys in
+ * use, which would hide the entries after it from a lookup that starts
+ * before it. So each entry further along the run whose home is at or
+ * before the hole moves into it, leaving a hole where it was, until the
+ * run ends.
+ */
+void
+index_remove_entry(Table *index, uint32_t key)
+{
+    uint32_t    hole = key;
+    IndexValue  entry;
+
+    table_delete(index, key, key);
+    while (key < UINT32_MAX && index_read(index, ++key, &entry)) {
+        if (index_home(entry.value) <= hole) {
+            table_delete(index, key, key);
+            entry.key = hole;
+            index_write(index, &entry);
+            hole = key;
+        }
+        free(entry.ids);
+    }
+}
+
+int
+compare_index_entry(const void *a, const void *b)
+{
+    const IndexEntry *x = a;
+    const IndexEntry *y = b;
+    int               order;
+
+    if (x->key != y->key) {
+        return (x->key > y->key) - (x->key < y->key);
+    }
+    order = strcmp(x->value, y->value);
+    if (order != 0) {
+        return order;
+    }
+    return (x->id > y->id) - (x->id < y->id);
+}
+
+/*
+ * Sort the rows' entries by home and value, so that those of a value
+ * come together, and return the number of values. ids then holds the
+ * ids of each value's rows in order, and starts the index of each
+ * value's first entry, with num_entries after the last.
+ */
+uint32_t
+index_group(IndexEntry *entries, uint32_t num_entries, uint32_t *ids,
+            uint32_t *starts)
+{
+    uint32_t num_values = 0;
+    uint32_t i;
+
+    for (i = 0; i < num_entries; i++) {
+        entries[i].key = index_home(entries[i].value);
+    }
+    qsort(entries, num_entries, sizeof(IndexEntry), compare_index_entry);
+    for (i = 0; i < num_entries; i++) {
+        if (i == 0 || strcmp(entries[i].value, entries[i - 1].value) != 0) {
+            starts[num_values++] = i;
+        }
+        ids[i] = entries[i].id;
+    }
+    starts[num_values] = num_entries;
+
+    return num_values;
+}
+
+/*
+ * Add the entries of many rows at once, each value's in one probe.
+ * Taken in order of home, the values of an empty index go in at
+ * increasing keys, as appends.
+ */
+void
+index_load(Table *index, IndexEntry *entries, uint32_t num_entries)
+{
+    uint32_t *ids = malloc(sizeof(uint32_t) * (num_entries + 1));
+    uint32_t *starts = malloc(sizeof(uint32_t) * (num_entries + 1));
+    uint32_t  num_values = index_group(entries, num_entries, ids, starts);
+    uint32_t  i;
+
+    for (i = 0; i < num_values; i++) {
+        index_insert(index, entries[starts[i]].value, ids + starts[i],
+                     starts[i + 1] - starts[i]);
+    }
+    free(starts);
+    free(ids);
+}
+
+/*
+ * Remove the entries of many rows at once, each value's in one probe.
+ */
+void
+index_unload(Table *index, IndexEntry *entries, uint32_t num_entries)
+{
+    uint32_t *ids = malloc(sizeof(uint32_t) * (num_entries + 1));
+    uint32_t *starts = malloc(sizeof(uint32_t) * (num_entries + 1));
+    uint32_t  num_values = index_group(entries, num_entries, ids, starts);
+    uint32_t  i;
+
+    for (i = 0; i < num_values; i++) {
+        index_delete(index, entries[starts[i]].value, ids + starts[i],
+                     starts[i + 1] - starts[i]);
+    }
+    free(starts);
+    free(ids);
+}
+
+/*
+ * Create an empty index on the column and add an entry for every row,
+ * without committing. The caller holds write_lock, and publishes the
+ * index once it is committed.
+ */
+Table *
+table_create_index(Table *table, Column column)
+{
+    Pager     *pager = table->pager;
+    uint32_t   root_page_num = get_unused_page_num(pager);
+    void      *root = get_page(pager, root_page_num);
+    void      *meta;
+    Table     *index;
+    RowList    list;
+    uint32_t   i;
+
+    initialize_leaf_node(root);
+    set_node_root(root, true);
+    mark_page_dirty(pager, root_page_num);
+    unpin_page(pager, root_page_num);
+
+    meta = get_page(pager, 0);
+    *meta_field(meta, index_root_offset(table, column)) = root_page_num;
+    mark_page_dirty(pager, 0);
+    unpin_page(pager, 0);
+
+    index = table_open_index(table, column, root_page_num);
+
+    memset(&list, 0, sizeof(list));
+    list.column = column;
+    table_scan(table, 0, UINT32_MAX, visit_collect_entry, &list);
+    index_load(index, list.entries, list.count);
+    for (i = 0; i < list.count; i++) {
+        free(list.entries[i].value);
+    }
+    free(list.entries);
+
+    return index;
+}
+
+/*
+ * Add the entries of rows just inserted to every index.
+ */
+void
+table_index_rows(Table *table, Row *rows, uint32_t num_rows)
+{
+    Column      column;
+    IndexEntry *entries;
+    uint32_t    i;
+
+    for (column = COLUMN_USERNAME; column < NUM_COLUMNS; column++) {
+        if (table->indexes[column] == NULL) {
+            continue;
+        }
+        entries = malloc(sizeof(IndexEntry) * num_rows);
+        for (i = 0; i < num_rows; i++) {
+            entries[i].value = row_column(&rows[i], column);
+            entries[i].id = rows[i].id;
+        }
+        index_load(table->indexes[column], entries, num_rows);
+        free(entries);
+    }
+}
+
+/*
+ * Remove the entries of the rows from first_key to last_key from every
+ * index, before the rows themselves are deleted.
+ */
+void
+table_unindex_range(Table *table, uint32_t first_key, uint32_t last_key)
+{
+    Column      column;
+    RowList     list;
+    IndexEntry *entries;
+    uint32_t    i;
+
+    if (table->indexes[COLUMN_USERNAME] == NULL &&
+        table->indexes[COLUMN_EMAIL] == NULL) {
+        return;
+    }
+
+    memset(&list, 0, sizeof(list));
+    table_scan(table, first_key, last_key, visit_collect_row, &list);
+    entries = malloc(sizeof(IndexEntry) * (list.count + 1));
+    for (column = COLUMN_USERNAME; column < NUM_COLUMNS; column++) {
+        if (table->indexes[column] == NULL) {
+            continue;
+        }
+        for (i = 0; i < list.count; i++) {
+            entries[i].value = row_column(&list.rows[i], column);
+            entries[i].id = list.rows[i].id;
+        }
+        index_unload(table->indexes[column], entries, list.count);
+    }
+    free(entries);
+    free(list.rows);
+}
+
+ExecuteResult
+execute_delete(Statement *statement, Table *table)
+{
+    if (table->pager->read_only) {
+        return EXECUTE_READ_ONLY;
+    }
+
+    pthread_mutex_lock(&table->pager->write_lock);
+    table_unindex_range(table, statement->first_id, statement->last_id);
+    table_delete(table, statement->first_id, statement->last_id);
+    pager_commit(table->pager);
+    pthread_mutex_unlock(&table->pager->write_lock);
+
+    return EXECUTE_SUCCESS;
+}
+
+/*
+ * Build the index in the transaction that records it, and let readers
+ * use it only once it is committed.
+ */
+ExecuteResult
+execute_create_index(Statement *statement, Table *table)
+{
+    Table *index;
+
+    if (table->pager->read_only) {
+        return EXECUTE_READ_ONLY;
+    }
+
+    pthread_mutex_lock(&table->pager->write_lock);
+    if (table->indexes[statement->column] != NULL) {
+        pthread_mutex_unlock(&table->pager->write_lock);
+        return EXECUTE_INDEX_EXISTS;
+    }
+    index = table_create_index(table, statement->column);
+    pager_commit(table->pager);
+    __atomic_store_n(&table->indexes[statement->column], index,
+                     __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&table->pager->write_lock);
+
+    return EXECUTE_SUCCESS;
+}
+
+/*
+ * Add the table's catalog entry and its root in one transaction, and
+ * publish it once that is committed.
+ */
+ExecuteResult
+execute_create_table(Statement *statement, Database *db)
+{
+    Pager    *pager = db->pager;
+    uint32_t  entry;
+
+    if (pager->read_only) {
+        return EXECUTE_READ_ONLY;
+    }
+
+    pthread_mutex_lock(&pager->write_lock);
+    if (db_table(db, statement->table_name) != NULL) {
+        pthread_mutex_unlock(&pager->write_lock);
+        return EXECUTE_TABLE_EXISTS;
+    }
+    if (db->num_tables == CATALOG_MAX_TABLES) {
+        pthread_mutex_unlock(&pager->write_lock);
+        return EXECUTE_CATALOG_FULL;
+    }
+    entry = catalog_add_table(pager, statement->table_name);
+    pager_commit(pager);
+    db->tables[db->num_tables] = db_open_table(db, entry);
+    __atomic_store_n(&db->num_tables, db->num_tables + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&pager->write_lock);
+
+    return EXECUTE_SUCCESS;
+}
+
+ExecuteResult
+execute_statement(Statement *statement, Database *db)
+{
+    Table *table;
+
+    if (statement->type == STATEMENT_CREATE_TABLE) {
+        return execute_create_table(statement, db);
+    }
+    table = db_table(db, statement->table_name);
+    if (table == NULL) {
+        return EXECUTE_NO_TABLE;
+    }
+
+    switch (statement->type) {
+    case STATEMENT_INSERT:
+        return execute_insert(statement, table);
+    case STATEMENT_SELECT:
+        return execute_select(statement, table);
+    case STATEMENT_DELETE:
+        return execute_delete(statement, table);
+    case STATEMENT_CREATE_INDEX:
+        return execute_create_index(statement, table);
+    case STATEMENT_CREATE_TABLE:
+        break;
+    }
+
+    return EXECUTE_UNKNOWN_STMT;
+}
+
+/*
+ * The table of that name, or NULL if the catalog has none.
+ */
+Table *
+db_table(Database *db, const char *name)
+{
+    uint32_t num_tables = __atomic_load_n(&db->num_tables, __ATOMIC_ACQUIRE);
+    uint32_t i;
+
+    for (i = 0; i < num_tables; i++) {
+        if (strcmp(db->tables[i]->name, name) == 0) {
+            return db->tables[i];
+        }
+    }
+    return NULL;
+}
+
+uint32_t
+catalog_entry_offset(uint32_t table_num)
+{
+    return META_CATALOG_OFFSET + table_num * CATALOG_ENTRY_SIZE;
+}
+
+/*
+ * Add an entry for a new, empty table to the catalog, without
+ * committing, and return its offset in the meta page. The caller holds
+ * write_lock.
+ */
+uint32_t
+catalog_add_table(Pager *pager, const char *name)
+{
+    uint32_t   root_page_num = get_unused_page_num(pager);
+    void      *root = get_page(pager, root_page_num);
+    void      *meta;
+    uint32_t   entry;
+
+    initialize_leaf_node(root);
+    set_node_root(root, true);
+    mark_page_dirty(pager, root_page_num);
+    unpin_page(pager, root_page_num);
+
+    meta = get_page(pager, 0);
+    entry = catalog_entry_offset(*meta_field(meta, META_TABLE_COUNT_OFFSET));
+    memset(meta + entry, 0, CATALOG_ENTRY_SIZE);
+    strcpy(meta + entry + CATALOG_NAME_OFFSET, name);
+    *meta_field(meta, entry + CATALOG_SCHEMA_OFFSET) = SCHEMA_USERS;
+    *meta_field(meta, entry + CATALOG_ROOTS_OFFSET) = root_page_num;
+    *meta_field(meta, META_TABLE_COUNT_OFFSET) += 1;
+    mark_page_dirty(pager, 0);
+    unpin_page(pager, 0);
+
+    return entry;
+}
+
+/*
+ * Open the table of a catalog entry and the indexes it lists.
+ */
+Table *
+db_open_table(Database *db, uint32_t entry)
+{
+    Pager    *pager = db->pager;
+    Table    *table = calloc(1, sizeof(Table));
+    void     *meta = get_page(pager, 0);
+    Column    column;
+
+    table->pager = pager;
+    table->rightmost_leaf = INVALID_PAGE_NUM;
+    table->write_space = 0;
+    table->scan_threads = db->scan_threads;
+    table->root_offset = entry + CATALOG_ROOTS_OFFSET;
+    table->column = COLUMN_ID;
+    table->root_page_num = *meta_field(meta, table->root_offset);
+    memcpy(table->name, meta + entry + CATALOG_NAME_OFFSET,
+           CATALOG_NAME_SIZE);
+    table->name[CATALOG_NAME_SIZE - 1] = 0;
+    for (column = COLUMN_USERNAME; column < NUM_COLUMNS; column++) {
+        uint32_t root_page_num =
+            *meta_field(meta, index_root_offset(table, column));
+
+        if (root_page_num != 0) {
+            table->indexes[column] =
+                table_open_index(table, column, root_page_num);
+        }
+    }
+    unpin_page(pager, 0);
+
+    return table;
+}
+
+Database *
+db_open(const char *filename, DbOptions *options)
+{
+    Pager     *pager;
+    Database  *db = calloc(1, sizeof(Database));
+    void      *meta;
+    uint32_t   page_count;
+    uint32_t   num_tables;
+    uint32_t   i;
+
+    key_search_init(options->search_kernel);
+    pager = pager_open(filename, options);
+    db->pager = pager;
+    db->scan_threads = options->scan_threads > 0 ? options->scan_threads : 1;
+
+    if (pager->num_pages == 0) {
+        if (pager->read_only) {
+            printf("Cannot open an empty database read-only.\n");
+            exit(EXIT_FAILURE);
+        }
+
+        /* New database file. Page 0 describes it, page 1 is a leaf. */
+        meta = get_page(pager, 0);
+        initialize_meta_page(meta);
+        mark_page_dirty(pager, 0);
+        unpin_page(pager, 0);
+        catalog_add_table(pager, DEFAULT_TABLE_NAME);
+        pager_commit(pager);
+    }
+
+    meta = get_page(pager, 0);
+    if (*meta_field(meta, META_MAGIC_OFFSET) != META_MAGIC) {
+        unpin_page(pager, 0);
+        db_upgrade(pager);
+        meta = get_page(pager, 0);
+    }
+    if (*meta_field(meta, META_VERSION_OFFSET) > META_VERSION ||
+        *meta_field(meta, META_PAGE_SIZE_OFFSET) != PAGE_SIZE) {
+        printf("Database was written by a newer version "
+               "or with another page size.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (*meta_field(meta, META_VERSION_OFFSET) < META_VERSION) {
+        unpin_page(pager, 0);
+        db_upgrade_catalog(pager);
+        meta = get_page(pager, 0);
+    }
+
+    num_tables = *meta_field(meta, META_TABLE_COUNT_OFFSET);
+    page_count = *meta_field(meta, META_PAGE_COUNT_OFFSET);
+    unpin_page(pager, 0);
+    if (num_tables > CATALOG_MAX_TABLES) {
+        printf("Catalog lists more tables than fit the meta page.\n");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < num_tables; i++) {
+        db->tables[i] = db_open_table(db, catalog_entry_offset(i));
+    }
+    db->num_tables = num_tables;
+
+    /* Pages past the count were left behind by a vacuum that crashed. */
+    if (page_count < pager->num_pages) {
+        if (pager->read_only) {
+            pager->num_pages = page_count;
+        } else {
+            pager_truncate(pager, page_count);
+        }
+    }
+
+    return db;
+}
+
+/*
+ * Give a file from before the meta page one. Page 0 held the root, so
+ * the root moves to a new page at the end and page 0 is rewritten.
+ */
+void
+db_upgrade(Pager *pager)
+{
+    uint32_t   root_page_num = pager->num_pages;
+    void      *meta = get_page(pager, 0);
+    void      *root;
+    char       new_root[PAGE_SIZE];
+    uint32_t   i;
+
+    if (get_node_type(meta) > NODE_LEAF || !is_node_root(meta)) {
+        printf("Not a database file.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (pager->read_only) {
+        printf("Database needs an upgrade. "
+               "Open it read-write once to upgrade it.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    root = get_page(pager, root_page_num);
+    memcpy(root, meta, PAGE_SIZE);
+    if (get_node_type(root) == NODE_INTERNAL) {
+        /* The root is rewritten later; read its children as it will be. */
+        memcpy(new_root, root, PAGE_SIZE);
+        internal_node_upgrade(new_root, 1);
+        for (i = 0; i <= *internal_node_num_keys(new_root); i++) {
+            uint32_t  child_page_num = *internal_node_child(new_root, i);
+            void     *child = get_page(pager, child_page_num);
+
+            *node_parent(child) = root_page_num;
+            mark_page_dirty(pager, child_page_num);
+            unpin_page(pager, child_page_num);
+        }
+    }
+    initialize_meta_page(meta);
+    /* Its nodes are still laid out as in version 1. */
+    *meta_field(meta, META_VERSION_OFFSET) = 1;
+    *meta_field(meta, META_ROOT_PAGE_OFFSET) = root_page_num;
+
+    mark_page_dirty(pager, root_page_num);
+    unpin_page(pager, root_page_num);
+    mark_page_dirty(pager, 0);
+    unpin_page(pager, 0);
+    pager_commit(pager);
+}
+
+/*
+ * Rewrite the nodes of a file from an older version. A version 1 leaf
+ * had a shorter header and fixed-size cells: the key, then the row with
+ * each string padded to its largest size. Leaves of versions 2 and 3
+ * had no array of keys, so the cells of a full one may not all fit
+ * with their keys; those left over go back in as rows. Before version
+ * 4 internal nodes kept each key next to its child.
+ */
+void
+db_upgrade_nodes(Table *table)
+{
+    Pager     *pager = table->pager;
+    uint32_t   num_pages = pager->num_pages;
+    uint32_t  *leaves = malloc(sizeof(uint32_t) * num_pages);
+    uint32_t   num_leaves = 0;
+    uint32_t   version;
+    uint32_t   page_num;
+    uint32_t   i;
+    void      *node;
+    void      *meta;
+
+    if (pager->read_only) {
+        printf("Database needs an upgrade. "
+               "Open it read-write once to upgrade it.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    meta = get_page(pager, 0);
+    version = *meta_field(meta, META_VERSION_OFFSET);
+    table->root_page_num = *meta_field(meta, META_ROOT_PAGE_OFFSET);
+    unpin_page(pager, 0);
+
+    /*
+     * Internal nodes first, so that rows put back into a leaf can find
+     * it. Leaves are listed before any page is allocated for a split.
+     */
+    for (page_num = 1; page_num < num_pages; page_num++) {
+        node = get_page(pager, page_num);
+        if (get_node_type(node) == NODE_INTERNAL) {
+            internal_node_upgrade(node, version);
+            mark_page_dirty(pager, page_num);
+        } else if (get_node_type(node) == NODE_LEAF) {
+            leaves[num_leaves++] = page_num;
+        }
+        unpin_page(pager, page_num);
+    }
+
+    for (i = 0; i < num_leaves; i++) {
+        if (version < 2) {
+            leaf_node_upgrade_fixed(pager, leaves[i]);
+        } else {
+            leaf_node_upgrade_slotted(table, leaves[i]);
+        }
+    }
+    free(leaves);
+
+    meta = get_page(pager, 0);
+    *meta_field(meta, META_VERSION_OFFSET) = META_NODES_VERSION;
+    mark_page_dirty(pager, 0);
+    unpin_page(pager, 0);
+    pager_commit(pager);
+}
+
+/*
+ * Bring a file from before the catalog up to date: rewrite its nodes if
+ * they are older still, then list its one table in the catalog as the
+ * default table, with the indexes it had.
+ */
+void
+db_upgrade_catalog(Pager *pager)
+{
+    Table      table;
+    void      *meta;
+    uint32_t   version;
+    uint32_t   entry = catalog_entry_offset(0);
+    Column     column;
+
+    if (pager->read_only) {
+        printf("Database needs an upgrade. "
+               "Open it read-write once to upgrade it.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    meta = get_page(pager, 0);
+    version = *meta_field(meta, META_VERSION_OFFSET);
+    unpin_page(pager, 0);
+    if (version < META_NODES_VERSION) {
+        memset(&table, 0, sizeof(table));
+        table.pager = pager;
+        table.rightmost_leaf = INVALID_PAGE_NUM;
+        table.scan_threads = 1;
+        table.root_offset = META_ROOT_PAGE_OFFSET;
+        db_upgrade_nodes(&table);
+    }
+
+    meta = get_page(pager, 0);
+    memset(meta + entry, 0, CATALOG_ENTRY_SIZE);
+    strcpy(meta + entry + CATALOG_NAME_OFFSET, DEFAULT_TABLE_NAME);
+    *meta_field(meta, entry + CATALOG_SCHEMA_OFFSET) = SCHEMA_USERS;
+    *meta_field(meta, entry + CATALOG_ROOTS_OFFSET) =
+        *meta_field(meta, META_ROOT_PAGE_OFFSET);
+    *meta_field(meta, META_ROOT_PAGE_OFFSET) = 0;
+    for (column = COLUMN_USERNAME; column < NUM_COLUMNS; column++) {
+        uint32_t offset = META_INDEX_ROOTS_OFFSET +
+                          (column - COLUMN_USERNAME) * sizeof(uint32_t);
+
+        if (version >= META_INDEXES_VERSION) {
+            *meta_field(meta, entry + CATALOG_ROOTS_OFFSET +
+                              column * sizeof(uint32_t)) =
+                *meta_field(meta, offset);
+        }
+        *meta_field(meta, offset) = 0;
+    }
+    *meta_field(meta, META_TABLE_COUNT_OFFSET) = 1;
+    *meta_field(meta, META_VERSION_OFFSET) = META_VERSION;
+    mark_page_dirty(pager, 0);
+    unpin_page(pager, 0);
+    pager_commit(pager);
+}
+
+/*
+ * Rewrite a version 1 leaf, whose cells always fit in a slotted leaf.
+ */
+void
+leaf_node_upgrade_fixed(Pager *pager, uint32_t page_num)
+{
+    const uint32_t  old_header_size =
+        LEAF_NODE_NEXT_LEAF_OFFSET + LEAF_NODE_NEXT_LEAF_SIZE;
+    const uint32_t  old_username_size = COLUMN_USERNAME_SIZE + 1;
+    const uint32_t  old_email_size = COLUMN_EMAIL_SIZE + 1;
+    const uint32_t  old_cell_size =
+        2 * ID_SIZE + old_username_size + old_email_size;
+    void           *node = get_page(pager, page_num);
+    uint32_t        num_cells = *leaf_node_num_cells(node);
+    uint32_t        i;
+    char            old_node[PAGE_SIZE];
+    char            cell[LEAF_NODE_MAX_CELL_SIZE];
+    char           *old_cell;
+    Row             row;
+
+    memcpy(old_node, node, PAGE_SIZE);
+    *leaf_node_num_cells(node) = 0;
+    *leaf_node_content_start(node) = PAGE_SIZE;
+    *leaf_node_fragmented(node) = 0;
+    for (i = 0; i < num_cells; i++) {
+        old_cell = old_node + old_header_size + i * old_cell_size + ID_SIZE;
+        memcpy(&row.id, old_cell, ID_SIZE);
+        memcpy(row.username, old_cell + ID_SIZE, old_username_size);
+        memcpy(row.email, old_cell + ID_SIZE + old_username_size,
+               old_email_size);
+        leaf_node_put_cell(node, i, cell, leaf_cell_build(pager, &row, cell));
+    }
+
+    mark_page_dirty(pager, page_num);
+    unpin_page(pager, page_num);
+}
+
+/*
+ * Rewrite a leaf of version 2 or 3, where the slots came right after
+ * the header. The cells are kept in order for as long as they fit; the
+ * rest are read back as rows and inserted again, splitting the leaf.
+ */
+void
+leaf_node_upgrade_slotted(Table *table, uint32_t page_num)
+{
+    Pager     *pager = table->pager;
+    void      *node = get_page(pager, page_num);
+    uint32_t   num_cells = *leaf_node_num_cells(node);
+    uint32_t   used = 0;
+    uint32_t   kept;
+    uint32_t   i;
+    char       old_node[PAGE_SIZE];
+    uint16_t  *old_slots = (void *) old_node + LEAF_NODE_HEADER_SIZE;
+    void      *cells[num_cells + 1];
+    Row       *rows;
+
+    memcpy(old_node, node, PAGE_SIZE);
+    for (i = 0; i < num_cells; i++) {
+        cells[i] = old_node + old_slots[i];
+    }
+    for (kept = 0; kept < num_cells; kept++) {
+        used += leaf_cell_size(cells[kept]) + LEAF_NODE_ENTRY_SIZE;
+        if (used > LEAF_NODE_SPACE_FOR_CELLS) {
+            break;
+        }
+    }
+    leaf_node_set_cells(node, cells, kept);
+
+    rows = malloc(sizeof(Row) * (num_cells - kept + 1));
+    for (i = kept; i < num_cells; i++) {
+        leaf_cell_read_row(pager, cells[i], &rows[i - kept]);
+        leaf_cell_free_overflow(pager, cells[i]);
+    }
+    mark_page_dirty(pager, page_num);
+    unpin_page(pager, page_num);
+
+    for (i = kept; i < num_cells; i++) {
+        table_insert(table, &rows[i - kept]);
+    }
+    free(rows);
+}
+
+void
+db_close(Database *db)
+{
+    Pager     *pager = db->pager;
+    int        result;
+    uint32_t   i;
+    Column     column;
+
+    if (pager->read_only) {
+        if (pager->map != NULL) {
+            munmap(pager->map, pager->file_length);
+        }
+        wal_close(pager);
+    } else {
+        pager_commit(pager);
+        pager_checkpoint(pager);
+        wal_close(pager);
+    }
+
+    if (pager->ring != NULL) {
+        io_ring_free(pager->ring);
+        free(pager->ring);
+    }
+
+    result = close(pager->file_descriptor);
+    if (result == -1) {
+        printf("Error closing db file.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < pager->num_frames; i++) {
+        pthread_rwlock_destroy(&pager->frames[i].latch);
+    }
+    for (i = 0; i < PAGER_LOCK_STRIPES; i++) {
+        pthread_mutex_destroy(&pager->stripes[i].lock);
+    }
+    pthread_mutex_destroy(&pager->lock);
+    pthread_mutex_destroy(&pager->write_lock);
+    for (i = 0; i < db->num_tables; i++) {
+        for (column = COLUMN_USERNAME; column < NUM_COLUMNS; column++) {
+            free(db->tables[i]->indexes[column]);
+        }
+        free(db->tables[i]);
+    }
+
+    free(pager->write_latches);
+    free(pager->stripes);
+    free(pager->frame_data);
+    free(pager->frames);
+    free(pager->buckets);
+    free(pager);
+    free(db);
+}
+
+uint32_t
+serialized_row_size(Row *row)
+{
+    return ROW_MIN_SIZE + strlen(row->username) + strlen(row->email);
+}
+
+void
+serialize_row(Row *source, void *destination)
+{
+    char     *dest = (char *) destination;
+    uint16_t  length;
+
+    memcpy(dest, &(source->id), ID_SIZE);
+    dest += ID_SIZE;
+    length = strlen(source->username);
+    memcpy(dest, &length, LENGTH_SIZE);
+    memcpy(dest + LENGTH_SIZE, source->username, length);
+    dest += LENGTH_SIZE + length;
+    length = strlen(source->email);
+    memcpy(dest, &length, LENGTH_SIZE);
+    memcpy(dest + LENGTH_SIZE, source->email, length);
+}
+
+void
+deserialize_row(void *source, Row *destination)
+{
+    char     *src = (char *) source;
+    uint16_t  length;
+
+    memcpy(&(destination->id), src, ID_SIZE);
+    src += ID_SIZE;
+    memcpy(&length, src, LENGTH_SIZE);
+    memcpy(destination->username, src + LENGTH_SIZE, length);
+    destination->username[length] = '\0';
+    src += LENGTH_SIZE + length;
+    memcpy(&length, src, LENGTH_SIZE);
+    memcpy(destination->email, src + LENGTH_SIZE, length);
+    destination->email[length] = '\0';
+}
+
+Pager *
+pager_open(const char *filename, DbOptions *options)
+{
+    int        fd;
+    off_t      file_length;
+    uint32_t   i;
+    uint32_t   num_buckets;
+    uint32_t   pool_frames = options->pool_frames;
+    Pager     *pager;
+    pthread_rwlockattr_t latch_attr;
+
+    if (pool_frames < MIN_POOL_FRAMES) {
+        printf("Buffer pool needs at least %d frames.\n", MIN_POOL_FRAMES);
+        exit(EXIT_FAILURE);
+    }
+
+    if (options->read_only) {
+        fd = open(filename, O_RDONLY);
+    } else {
+        fd = open(filename,
+                  O_RDWR |      /* Read/Write mode */
+                  O_CREAT,      /* Create file if it does not exist */
+                  S_IWUSR |     /* User write permission */
+                  S_IRUSR);     /* User Read permission */
+    }
+
+    if (fd == -1) {
+        printf("Unable to open file\n");
+        exit(EXIT_FAILURE);
+    }
+
+    set_page_size(pager_find_page_size(fd, filename, options->page_size));
+    file_length = lseek(fd, 0, SEEK_END);
+
+    pager = malloc(sizeof(Pager));
+    pager->file_descriptor = fd;
+    pager->file_length = file_length;
+    pager->num_pages = (file_length / PAGE_SIZE);
+    pager->read_only = options->read_only;
+    pager->map = NULL;
+    pager->map_advice = MADV_NORMAL;
+    pager->num_frames = 0;
+    pager->frames = NULL;
+    pager->frame_data = NULL;
+    pager->buckets = NULL;
+    pager->ring = NULL;
+    pager->wal_fd = -1;
+    pager->wal_path = NULL;
+    pager->wal_frames = 0;
+    pager->wal_txn_frames = 0;
+    pager->wal_index = NULL;
+    pager->wal_index_length = 0;
+    pager->sync_mode = options->sync_mode;
+    memset(&pager->stats, 0, sizeof(PagerStats));
+    pthread_mutex_init(&pager->lock, NULL);
+    pthread_mutex_init(&pager->write_lock, NULL);
+    pager->stripes = aligned_alloc(CACHE_LINE_SIZE,
+                                   sizeof(PagerStripe) * PAGER_LOCK_STRIPES);
+    for (i = 0; i < PAGER_LOCK_STRIPES; i++) {
+        pthread_mutex_init(&pager->stripes[i].lock, NULL);
+        pager->stripes[i].hits = 0;
+    }
+    pager->write_latches = NULL;
+    pager->num_write_latches = 0;
+    pager->write_latches_capacity = 0;
+
+    if (file_length % PAGE_SIZE != 0) {
+        printf("Db file is not a whole number of pages. Corrupt file.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (pager->read_only) {
+        /* Pages come straight from the mapping; no buffer pool needed. */
+        pager->bucket_mask = PAGER_LOCK_STRIPES - 1;    /* For the hits */
+        wal_open(pager, filename);
+        pager_open_map(pager);
+        return pager;
+    }
+
+    /* Twice as many buckets as frames keeps the chains short. */
+    num_buckets = 1;
+    while (num_buckets < 2 * pool_frames) {
+        num_buckets <<= 1;
+    }
+
+    pager->num_frames = pool_frames;
+    pager->frames = malloc(sizeof(Frame) * pool_frames);
+    pager->frame_data = malloc((size_t) PAGE_SIZE * pool_frames);
+    pager->buckets = malloc(sizeof(int32_t) * num_buckets);
+    pager->bucket_mask = num_buckets - 1;
+    pager->clock_hand = 0;
+
+    if (pager->frames == NULL || pager->frame_data == NULL ||
+        pager->buckets == NULL) {
+        printf("Unable to allocate buffer pool of %u frames\n", pool_frames);
+        exit(EXIT_FAILURE);
+    }
+
+    /* A writer waiting for a latch keeps new readers out. */
+    pthread_rwlockattr_init(&latch_attr);
+    pthread_rwlockattr_setkind_np(&latch_attr,
+        PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+
+    for (i = 0; i < pool_frames; i++) {
+        Frame *frame = &pager->frames[i];
+        frame->page_num = 0;
+        frame->pin_count = 0;
+        frame->in_use = false;
+        frame->dirty = false;
+        frame->referenced = false;
+        frame->hash_next = INVALID_FRAME;
+        frame->version = 1;
+        frame->data = (char *) pager->frame_data + (size_t) i * PAGE_SIZE;
+        pthread_rwlock_init(&frame->latch, &latch_attr);
+    }
+    pthread_rwlockattr_destroy(&latch_attr);
+
+    for (i = 0; i < num_buckets; i++) {
+        pager->buckets[i] = INVALID_FRAME;
+    }
+
+    if (options->io_backend == IO_BACKEND_URING) {
+        pager->ring = malloc(sizeof(IoRing));
+        if (!io_ring_init(pager->ring, IO_RING_ENTRIES)) {
+            fprintf(stderr, "io_uring unavailable, using pread/pwrite.\n");
+            free(pager->ring);
+            pager->ring = NULL;
+        }
+    }
+
+    wal_open(pager, filename);
+
+    return pager;
+}
+
+/*
+ * Use pages of page_size bytes and lay nodes out to fill them.
+ */
+void
+set_page_size(uint32_t page_size)
+{
+    if (page_size < MIN_PAGE_SIZE || page_size > MAX_PAGE_SIZE ||
+        (page_size & (page_size - 1)) != 0) {
+        printf("Page size must be a power of two from %d to %d.\n",
+               MIN_PAGE_SIZE, MAX_PAGE_SIZE);
+        exit(EXIT_FAILURE);
+    }
+
+    PAGE_SIZE = page_size;
+
+    LEAF_NODE_SPACE_FOR_CELLS = PAGE_SIZE - LEAF_NODE_HEADER_SIZE;
+    LEAF_NODE_MAX_LOCAL = LEAF_NODE_SPACE_FOR_CELLS / 4 -
+        LEAF_NODE_ENTRY_SIZE - LEAF_NODE_PAYLOAD_SIZE_SIZE -
+        LEAF_NODE_OVERFLOW_SIZE;
+    LEAF_NODE_MAX_CELL_SIZE = LEAF_NODE_PAYLOAD_SIZE_SIZE +
+        LEAF_NODE_MAX_LOCAL + LEAF_NODE_OVERFLOW_SIZE;
+    LEAF_NODE_MAX_CELLS = LEAF_NODE_SPACE_FOR_CELLS /
+        (LEAF_NODE_ENTRY_SIZE + LEAF_NODE_PAYLOAD_SIZE_SIZE + ROW_MIN_SIZE);
+    LEAF_NODE_MIN_USED = LEAF_NODE_SPACE_FOR_CELLS / 2;
+
+    INTERNAL_NODE_SPACE_FOR_CELLS = PAGE_SIZE - INTERNAL_NODE_HEADER_SIZE;
+    INTERNAL_NODE_MAX_CELLS =
+        INTERNAL_NODE_SPACE_FOR_CELLS / INTERNAL_NODE_CELL_SIZE;
+    INTERNAL_NODE_MIN_KEYS = INTERNAL_NODE_MAX_CELLS / 2;
+
+    OVERFLOW_PAGE_SPACE = PAGE_SIZE - OVERFLOW_PAGE_HEADER_SIZE;
+}
+
+/*
+ * The page size of the database in fd, from its meta page. The meta
+ * page of a database created just before a crash may still be only in
+ * the log, whose header has it too. A file from before the meta page
+ * has pages of the default size, and a new one new_page_size.
+ */
+uint32_t
+pager_find_page_size(int fd, const char *filename, uint32_t new_page_size)
+{
+    char        meta[META_PAGE_SIZE_OFFSET + sizeof(uint32_t)];
+    ssize_t     bytes_read = pread(fd, meta, sizeof(meta), 0);
+    char       *wal_path;
+    int         wal_fd;
+    WalHeader   header;
+
+    if (bytes_read == sizeof(meta) &&
+        *meta_field(meta, META_MAGIC_OFFSET) == META_MAGIC) {
+        return *meta_field(meta, META_PAGE_SIZE_OFFSET);
+    }
+    if (bytes_read > 0) {
+        return DEFAULT_PAGE_SIZE;
+    }
+
+    wal_path = malloc(strlen(filename) + sizeof(".wal"));
+    sprintf(wal_path, "%s.wal", filename);
+    wal_fd = open(wal_path, O_RDONLY);
+    if (wal_fd != -1) {
+        if (pread(wal_fd, &header, WAL_HEADER_SIZE, 0) == WAL_HEADER_SIZE &&
+            header.magic == WAL_MAGIC) {
+            new_page_size = header.page_size;
+        }
+        close(wal_fd);
+    }
+    free(wal_path);
+
+    return new_page_size;
+}
+
+/*
+ * Map the whole file for a read-only pager. get_page() then hands out
+ * pointers into the mapping, so a miss costs a page fault rather than a
+ * malloc() and a read() into a private copy.
+ */
+void
+pager_open_map(Pager *pager)
+{
+    if (pager->file_length == 0) {
+        return;
+    }
+
+    pager->map = mmap(NULL, pager->file_length, PROT_READ, MAP_SHARED,
+                      pager->file_descriptor, 0);
+    if (pager->map == MAP_FAILED) {
+        printf("Error mapping file: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Tell the kernel how the mapping is about to be read: MADV_SEQUENTIAL
+ * lets it read ahead aggressively for scans, MADV_RANDOM stops it from
+ * reading around every fault during point lookups.
+ */
+void
+pager_advise(Pager *pager, int advice)
+{
+    if (pager->map == NULL || pager->map_advice == advice) {
+        return;
+    }
+
+    if (madvise(pager->map, pager->file_length, advice) == -1) {
+        printf("Error advising mapping: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    pager->map_advice = advice;
+}
+
+uint32_t
+pager_bucket(Pager *pager, uint32_t page_num)
+{
+    /* Fibonacci hashing spreads consecutive page numbers. */
+    return (page_num * 2654435769u) & pager->bucket_mask;
+}
+
+/*
+ * The stripe guarding the bucket of a page. A bucket always maps to the
+ * same stripe, however many buckets there are.
+ */
+PagerStripe *
+pager_stripe(Pager *pager, uint32_t page_num)
+{
+    return &pager->stripes[pager_bucket(pager, page_num) &
+                           (PAGER_LOCK_STRIPES - 1)];
+}
+
+uint64_t
+pager_hits(Pager *pager)
+{
+    uint64_t  hits = 0;
+    uint32_t  i;
+
+    for (i = 0; i < PAGER_LOCK_STRIPES; i++) {
+        hits += pager->stripes[i].hits;
+    }
+    return hits;
+}
+
+/*
+ * Return the frame holding the given page, or INVALID_FRAME if the
+ * page is not cached. The caller holds the page's stripe or the pager
+ * lock.
+ */
+int32_t
+pager_lookup_frame(Pager *pager, uint32_t page_num)
+{
+    int32_t i = pager->buckets[pager_bucket(pager, page_num)];
+
+    while (i != INVALID_FRAME) {
+        if (pager->frames[i].page_num == page_num) {
+            return i;
+        }
+        i = pager->frames[i].hash_next;
+    }
+
+    return INVALID_FRAME;
+}
+
+void
+pager_hash_remove(Pager *pager, int32_t frame_num)
+{
+    int32_t *link = &pager->buckets[pager_bucket(pager,
+                                    pager->frames[frame_num].page_num)];
+
+    while (*link != frame_num) {
+        link = &pager->frames[*link].hash_next;
+    }
+    /* Unlatched readers may be walking the chain; see pager_peek_frame(). */
+    __atomic_store_n(link, pager->frames[frame_num].hash_next,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&pager->frames[frame_num].hash_next, INVALID_FRAME,
+                     __ATOMIC_RELAXED);
+}
+
+/*
+ * Find the frame holding a page, and its version, without pinning it or
+ * taking any lock, for a reader that checks the version again once it
+ * has read the page; see frame_validate(). The frame may change pages
+ * meanwhile, which changes its version. Returns NULL if the page is not
+ * cached or is being changed. A chain that changes under the walk may
+ * hide a page; the caller falls back to get_page() then.
+ */
+Frame *
+pager_peek_frame(Pager *pager, uint32_t page_num, uint64_t *version)
+{
+    int32_t   i = __atomic_load_n(&pager->buckets[pager_bucket(pager, page_num)],
+                                  __ATOMIC_ACQUIRE);
+    uint32_t  steps;
+
+    for (steps = 0; i != INVALID_FRAME && steps < pager->num_frames;
+         steps++) {
+        Frame *frame = &pager->frames[i];
+
+        if (__atomic_load_n(&frame->page_num, __ATOMIC_RELAXED) == page_num) {
+            *version = __atomic_load_n(&frame->version, __ATOMIC_ACQUIRE);
+            if ((*version & 1) ||
+                __atomic_load_n(&frame->page_num, __ATOMIC_RELAXED) !=
+                page_num) {
+                return NULL;
+            }
+            return frame;
+        }
+        i = __atomic_load_n(&frame->hash_next, __ATOMIC_ACQUIRE);
+    }
+
+    return NULL;
+}
+
+/*
+ * Whether the frame still has the version read before the caller read
+ * from it, so that what it read was one state of one page.
+ */
+bool
+frame_validate(Frame *frame, uint64_t version)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&frame->version, __ATOMIC_RELAXED) == version;
+}
+
+/*
+ * Make the version odd before the frame's page is changed or replaced,
+ * and even again after.
+ */
+void
+frame_begin_change(Frame *frame)
+{
+    __atomic_store_n(&frame->version, frame->version + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void
+frame_end_change(Frame *frame)
+{
+    __atomic_store_n(&frame->version, frame->version + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Pick a frame for a new page using the CLOCK algorithm: sweep the
+ * frames, giving every referenced frame a second chance, and take the
+ * first unpinned frame whose reference bit is clear. A dirty page is
+ * appended to the log, uncommitted, before the frame is reused. The
+ * caller holds the pager lock.
+ */
+int32_t
+pager_evict_frame(Pager *pager)
+{
+    uint32_t  scanned;
+
+    /* Two full sweeps clear every reference bit at least once. */
+    for (scanned = 0; scanned < 2 * pager->num_frames; scanned++) {
+        int32_t       i = pager->clock_hand;
+        Frame        *frame = &pager->frames[i];
+        PagerStripe  *stripe;
+
+        pager->clock_hand = (pager->clock_hand + 1) % pager->num_frames;
+
+        if (!frame->in_use) {
+            return i;
+        }
+
+        stripe = pager_stripe(pager, frame->page_num);
+        pthread_mutex_lock(&stripe->lock);
+        if (frame->pin_count > 0) {
+            pthread_mutex_unlock(&stripe->lock);
+            continue;
+        }
+        if (frame->referenced) {
+            frame->referenced = false;
+            pthread_mutex_unlock(&stripe->lock);
+            continue;
+        }
+        frame_begin_change(frame);
+        pager_hash_remove(pager, i);
+        frame->in_use = false;
+        pthread_mutex_unlock(&stripe->lock);
+
+        /* Out of the hash, nobody can pin the page while it is logged. */
+        if (frame->dirty) {
+            wal_append(pager, &frame, 1, false);
+        }
+        pager->stats.evictions++;
+        return i;
+    }
+
+    printf("Buffer pool exhausted: all %u frames are pinned.\n",
+           pager->num_frames);
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * Make the frame hold the given page, pinned once. The caller fills in
+ * the contents and holds the pager lock.
+ */
+void
+pager_install_frame(Pager *pager, int32_t frame_num, uint32_t page_num)
+{
+    Frame        *frame = &pager->frames[frame_num];
+    PagerStripe  *stripe = pager_stripe(pager, page_num);
+
+    pthread_mutex_lock(&stripe->lock);
+    __atomic_store_n(&frame->page_num, page_num, __ATOMIC_RELAXED);
+    frame->pin_count = 1;
+    frame->in_use = true;
+    frame->dirty = false;
+    frame->referenced = true;
+    frame->hash_next = pager->buckets[pager_bucket(pager, page_num)];
+    __atomic_store_n(&pager->buckets[pager_bucket(pager, page_num)],
+                     frame_num, __ATOMIC_RELEASE);
+    frame_end_change(frame);
+    pthread_mutex_unlock(&stripe->lock);
+
+    if (page_num >= pager->num_pages) {
+        pager->num_pages = page_num + 1;
+    }
+}
+
+/*
+ * Number of pages that have been written to the file so far. Pages past
+ * the end exist only in the buffer pool and start out zeroed.
+ */
+uint32_t
+pager_file_pages(Pager *pager)
+{
+    uint32_t num_pages = pager->file_length / PAGE_SIZE;
+
+    /* We might save a partial page at the end of the file. */
+    if (pager->file_length % PAGE_SIZE) {
+        num_pages += 1;
+    }
+
+    return num_pages;
+}
+
+/*
+ * Find where the current image of a page lives: in the log if it was
+ * written since the last checkpoint, otherwise in the database file.
+ * Returns false for a page that was never written, which reads as zeros.
+ */
+bool
+pager_page_location(Pager *pager, uint32_t page_num, int *fd, off_t *offset)
+{
+    uint32_t wal_frame = wal_lookup(pager, page_num);
+
+    if (wal_frame != 0) {
+        *fd = pager->wal_fd;
+        *offset = WAL_HEADER_SIZE + (off_t) (wal_frame - 1) * WAL_FRAME_SIZE +
+                  WAL_FRAME_HEADER_SIZE;
+        return true;
+    }
+    if (page_num < pager_file_pages(pager)) {
+        *fd = pager->file_descriptor;
+        *offset = (off_t) page_num * PAGE_SIZE;
+        return true;
+    }
+
+    return false;
+}
+
+/*
+ * Read one page with pread(). Positional I/O leaves the file offset
+ * alone, so readers do not have to serialize on it.
+ */
+void
+pager_read_page(Pager *pager, uint32_t page_num, void *buffer)
+{
+    size_t  done = 0;
+    int     fd;
+    off_t   offset;
+
+    memset(buffer, 0, PAGE_SIZE);
+    if (!pager_page_location(pager, page_num, &fd, &offset)) {
+        return;
+    }
+
+    while (done < PAGE_SIZE) {
+        ssize_t bytes_read = pread(fd, (char *) buffer + done,
+                                   PAGE_SIZE - done, offset + done);
+        pager->stats.read_syscalls++;
+        if (bytes_read == -1) {
+            printf("Error reading file: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        if (bytes_read == 0) {
+            break;  /* End of file */
+        }
+        done += bytes_read;
+    }
+}
+
+/*
+ * Read a batch of pages into their frames. With io_uring every read of
+ * a batch is submitted and reaped with a single io_uring_enter().
+ */
+void
+pager_read_batch(Pager *pager, Frame **frames, uint32_t count)
+{
+    uint32_t  start;
+    uint32_t  i;
+
+    if (pager->ring == NULL) {
+        for (i = 0; i < count; i++) {
+            pager_read_page(pager, frames[i]->page_num, frames[i]->data);
+        }
+        return;
+    }
+
+    for (start = 0; start < count; start += pager->ring->entries) {
+        uint32_t  batch = count - start;
+        uint32_t  submitted = 0;
+        int32_t   results[IO_RING_ENTRIES];
+        uint32_t  index[IO_RING_ENTRIES];
+
+        if (batch > pager->ring->entries) {
+            batch = pager->ring->entries;
+        }
+
+        for (i = 0; i < batch; i++) {
+            Frame               *frame = frames[start + i];
+            struct io_uring_sqe *sqe;
+            int                  fd;
+            off_t                offset;
+
+            memset(frame->data, 0, PAGE_SIZE);
+            if (!pager_page_location(pager, frame->page_num, &fd, &offset)) {
+                continue;
+            }
+
+            sqe = io_ring_next_sqe(pager->ring);
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd = fd;
+            sqe->addr = (uint64_t) (uintptr_t) frame->data;
+            sqe->len = PAGE_SIZE;
+            sqe->off = offset;
+            sqe->user_data = submitted;
+            index[submitted++] = start + i;
+        }
+
+        pager->stats.read_syscalls +=
+            io_ring_submit_and_wait(pager->ring, submitted, results);
+
+        for (i = 0; i < submitted; i++) {
+            Frame *frame = frames[index[i]];
+
+            if (results[i] < 0) {
+                printf("Error reading file: %d\n", -results[i]);
+                exit(EXIT_FAILURE);
+            }
+            if (results[i] < PAGE_SIZE) {
+                /* Short read; finish the page the ordinary way. */
+                pager_read_page(pager, frame->page_num, frame->data);
+            }
+        }
+    }
+}
+
+/*
+ * Write count pages starting at first_page from the given buffers.
+ */
+void
+pager_write_pages(Pager *pager, uint32_t first_page,
+                  struct iovec *iov, uint32_t count)
+{
+    uint64_t end = ((uint64_t) first_page + count) * PAGE_SIZE;
+
+    pager_pwritev(pager, pager->file_descriptor,
+                  (off_t) first_page * PAGE_SIZE, iov, count);
+
+    /* Later misses on these pages must read them back from the file. */
+    if (end > pager->file_length) {
+        pager->file_length = end;
+    }
+}
+
+/*
+ * Write all of the given buffers to fd at offset with pwritev(),
+ * retrying after short writes.
+ */
+void
+pager_pwritev(Pager *pager, int fd, off_t offset,
+              struct iovec *iov, uint32_t count)
+{
+    size_t    remaining = 0;
+    uint32_t  iov_index = 0;
+    uint32_t  i;
+
+    for (i = 0; i < count; i++) {
+        remaining += iov[i].iov_len;
+    }
+
+    while (remaining > 0) {
+        ssize_t bytes_written = pwritev(fd, iov + iov_index,
+                                        count - iov_index, offset);
+        pager->stats.write_syscalls++;
+        if (bytes_written == -1) {
+            printf("Error writing: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+
+        pager->stats.bytes_written += bytes_written;
+        offset += bytes_written;
+        remaining -= bytes_written;
+
+        /* Skip what a short write already covered. */
+        while (bytes_written > 0 &&
+               (size_t) bytes_written >= iov[iov_index].iov_len) {
+            bytes_written -= iov[iov_index].iov_len;
+            iov_index++;
+        }
+        if (bytes_written > 0) {
+            iov[iov_index].iov_base =
+                (char *) iov[iov_index].iov_base + bytes_written;
+            iov[iov_index].iov_len -= bytes_written;
+        }
+    }
+}
+
+/*
+ * Load the pages that are not cached yet into free frames in one batch,
+ * without pinning them. At most a quarter of the pool is used so that a
+ * read-ahead can never push out everything else. Returns how many of
+ * the given pages were considered.
+ */
+uint32_t
+pager_prefetch(Pager *pager, uint32_t *page_nums, uint32_t count)
+{
+    Frame     *batch[SCAN_PREFETCH_PAGES];
+    uint32_t   num_batch = 0;
+    uint32_t   i;
+
+    if (pager->read_only) {
+        return count;
+    }
+
+    pthread_mutex_lock(&pager->lock);
+    if (count > pager->num_frames / 4) {
+        count = pager->num_frames / 4;
+    }
+    if (count > SCAN_PREFETCH_PAGES) {
+        count = SCAN_PREFETCH_PAGES;
+    }
+
+    for (i = 0; i < count; i++) {
+        int32_t frame_num;
+        int     fd;
+        off_t   offset;
+
+        if (!pager_page_location(pager, page_nums[i], &fd, &offset) ||
+            pager_lookup_frame(pager, page_nums[i]) != INVALID_FRAME) {
+            continue;
+        }
+
+        /*
+         * Stay pinned until read so the next eviction skips the frame,
+         * and out of the hash so nobody finds it half read.
+         */
+        frame_num = pager_evict_frame(pager);
+        pager->frames[frame_num].page_num = page_nums[i];
+        pager->frames[frame_num].pin_count = 1;
+        pager->frames[frame_num].in_use = true;
+        batch[num_batch++] = &pager->frames[frame_num];
+    }
+
+    pager_read_batch(pager, batch, num_batch);
+
+    for (i = 0; i < num_batch; i++) {
+        PagerStripe *stripe = pager_stripe(pager, batch[i]->page_num);
+
+        pager_install_frame(pager, batch[i] - pager->frames,
+                            batch[i]->page_num);
+        pthread_mutex_lock(&stripe->lock);
+        batch[i]->pin_count--;
+        pthread_mutex_unlock(&stripe->lock);
+    }
+    pager->stats.prefetched += num_batch;
+    pthread_mutex_unlock(&pager->lock);
+
+    return count;
+}
+
+int
+compare_page_num(const void *a, const void *b)
+{
+    uint32_t page_a = *(uint32_t *) a;
+    uint32_t page_b = *(uint32_t *) b;
+
+    return (page_a > page_b) - (page_a < page_b);
+}
+
+/*
+ * Ask the kernel to start reading the given pages into the page cache
+ * without waiting for them, so that the reads which later fault them
+ * into the pool find them there. Pages are sorted and each run of
+ * adjacent pages is hinted with one call. The array is reordered.
+ *
+ * A read-only mapping is left to MADV_SEQUENTIAL: a madvise() per run
+ * made cold scans slower than letting the fault path read ahead.
+ */
+void
+pager_readahead(Pager *pager, uint32_t *page_nums, uint32_t count)
+{
+    uint32_t   file_pages = pager_file_pages(pager);
+    uint32_t   num_wanted = 0;
+    uint32_t   i;
+
+    if (pager->read_only) {
+        return;
+    }
+
+    pthread_mutex_lock(&pager->lock);
+    /*
+     * Pages past the end of the file or already cached need no I/O, and
+     * those in the log are not where the hint would point.
+     */
+    for (i = 0; i < count; i++) {
+        if (page_nums[i] < file_pages &&
+            wal_lookup(pager, page_nums[i]) == 0 &&
+            pager_lookup_frame(pager, page_nums[i]) == INVALID_FRAME) {
+            page_nums[num_wanted++] = page_nums[i];
+        }
+    }
+    qsort(page_nums, num_wanted, sizeof(uint32_t), compare_page_num);
+
+    i = 0;
+    while (i < num_wanted) {
+        uint32_t  first = page_nums[i];
+        uint32_t  run = 1;
+        uint64_t  offset = (uint64_t) first * PAGE_SIZE;
+        uint64_t  length;
+        int       ret;
+
+        while (i + run < num_wanted && page_nums[i + run] == first + run) {
+            run++;
+        }
+        length = (uint64_t) run * PAGE_SIZE;
+        if (offset + length > pager->file_length) {
+            length = pager->file_length - offset;
+        }
+
+        ret = posix_fadvise(pager->file_descriptor, offset, length,
+                            POSIX_FADV_WILLNEED);
+        if (ret != 0) {
+            printf("Error advising readahead: %d\n", ret);
+            exit(EXIT_FAILURE);
+        }
+
+        pager->stats.readahead += run;
+        i += run;
+    }
+    pthread_mutex_unlock(&pager->lock);
+}
+
+/*
+ * Return the page, loading it into the buffer pool on a miss. The page
+ * stays pinned in memory until the caller releases it with unpin_page().
+ * A hit only locks the page's stripe; misses are served one at a time.
+ */
+void *
+get_page(Pager *pager, uint32_t page_num)
+{
+    PagerStripe  *stripe = pager_stripe(pager, page_num);
+    int32_t       frame_num;
+    Frame        *frame;
+
+    if (pager->read_only) {
+        if (page_num >= pager->num_pages) {
+            printf("Tried to fetch page %d past the end of a read-only db\n",
+                   page_num);
+            exit(EXIT_FAILURE);
+        }
+        __atomic_fetch_add(&stripe->hits, 1, __ATOMIC_RELAXED);
+        return pager->map + (size_t) page_num * PAGE_SIZE;
+    }
+
+    pthread_mutex_lock(&stripe->lock);
+    frame_num = pager_lookup_frame(pager, page_num);
+    if (frame_num != INVALID_FRAME) {
+        stripe->hits++;
+        frame = &pager->frames[frame_num];
+        frame->pin_count++;
+        frame->referenced = true;
+        pthread_mutex_unlock(&stripe->lock);
+        return frame->data;
+    }
+    pthread_mutex_unlock(&stripe->lock);
+
+    /* Another miss may have loaded the page while this one waited. */
+    pthread_mutex_lock(&pager->lock);
+    pthread_mutex_lock(&stripe->lock);
+    frame_num = pager_lookup_frame(pager, page_num);
+    if (frame_num != INVALID_FRAME) {
+        stripe->hits++;
+        frame = &pager->frames[frame_num];
+        frame->pin_count++;
+        frame->referenced = true;
+        pthread_mutex_unlock(&stripe->lock);
+        pthread_mutex_unlock(&pager->lock);
+        return frame->data;
+    }
+    pthread_mutex_unlock(&stripe->lock);
+
+    /* Cache miss. Find a free frame and load from file. */
+    pager->stats.misses++;
+    frame_num = pager_evict_frame(pager);
+    frame = &pager->frames[frame_num];
+
+    pager_read_page(pager, page_num, frame->data);
+    pager_install_frame(pager, frame_num, page_num);
+    pthread_mutex_unlock(&pager->lock);
+
+    return frame->data;
+}
+
+void
+unpin_page(Pager *pager, uint32_t page_num)
+{
+    PagerStripe  *stripe;
+    int32_t       frame_num;
+
+    if (pager->read_only) {
+        /* Mapped pages are never evicted, so there is nothing to release. */
+        return;
+    }
+
+    stripe = pager_stripe(pager, page_num);
+    pthread_mutex_lock(&stripe->lock);
+    frame_num = pager_lookup_frame(pager, page_num);
+    if (frame_num == INVALID_FRAME ||
+        pager->frames[frame_num].pin_count == 0) {
+        printf("Tried to unpin page %d which is not pinned\n", page_num);
+        exit(EXIT_FAILURE);
+    }
+
+    pager->frames[frame_num].pin_count--;
+    pthread_mutex_unlock(&stripe->lock);
+}
+
+/*
+ * Record that the caller modified a page it has pinned, so the page
+ * is written back when it is evicted or the pager is flushed.
+ */
+void
+mark_page_dirty(Pager *pager, uint32_t page_num)
+{
+    PagerStripe  *stripe = pager_stripe(pager, page_num);
+    int32_t       frame_num;
+
+    pthread_mutex_lock(&stripe->lock);
+    frame_num = pager_lookup_frame(pager, page_num);
+    if (frame_num == INVALID_FRAME ||
+        pager->frames[frame_num].pin_count == 0) {
+        printf("Tried to dirty page %d which is not pinned\n", page_num);
+        exit(EXIT_FAILURE);
+    }
+
+    pager->frames[frame_num].dirty = true;
+    pthread_mutex_unlock(&stripe->lock);
+}
+
+/*
+ * The frame holding a page the caller has pinned.
+ */
+Frame *
+pager_frame(Pager *pager, void *page)
+{
+    return &pager->frames[((char *) page - (char *) pager->frame_data) /
+                          PAGE_SIZE];
+}
+
+/*
+ * Make this thread the writer. Until pager_end_write(), latch_page()
+ * latches its pages exclusively and keeps them latched, and pinned,
+ * whatever the caller unlatches, until pager_release_latches() lets go
+ * of them. The caller holds the pager's write_lock.
+ */
+void
+pager_begin_write(Pager *pager)
+{
+    writing_pager = pager;
+}
+
+void
+pager_end_write(Pager *pager)
+{
+    pager_release_latches(pager, INVALID_PAGE_NUM);
+    writing_pager = NULL;
+}
+
+bool
+pager_is_writer(Pager *pager)
+{
+    return writing_pager == pager;
+}
+
+/*
+ * Pin a page and latch it, shared for a reader and exclusively for the
+ * writer. A read-only database has no writer, and nothing to latch.
+ */
+void *
+latch_page(Pager *pager, uint32_t page_num)
+{
+    void     *page = get_page(pager, page_num);
+    uint32_t  i;
+
+    if (pager->read_only) {
+        return page;
+    }
+    if (!pager_is_writer(pager)) {
+        pthread_rwlock_rdlock(&pager_frame(pager, page)->latch);
+        return page;
+    }
+
+    for (i = 0; i < pager->num_write_latches; i++) {
+        if (pager->write_latches[i] == page_num) {
+            return page;
+        }
+    }
+    pthread_rwlock_wrlock(&pager_frame(pager, page)->latch);
+    frame_begin_change(pager_frame(pager, page));
+    /* The latch keeps a pin of its own. */
+    get_page(pager, page_num);
+
+    if (pager->num_write_latches == pager->write_latches_capacity) {
+        pager->write_latches_capacity =
+            pager->write_latches_capacity ? 2 * pager->write_latches_capacity
+                                          : 16;
+        pager->write_latches = realloc(pager->write_latches,
+                                       sizeof(uint32_t) *
+                                       pager->write_latches_capacity);
+    }
+    pager->write_latches[pager->num_write_latches++] = page_num;
+
+    return page;
+}
+
+/*
+ * Like latch_page(), but a reader gives up instead of waiting when the
+ * writer has the page. Returns NULL then.
+ */
+void *
+try_latch_page(Pager *pager, uint32_t page_num)
+{
+    void *page;
+
+    if (pager->read_only || pager_is_writer(pager)) {
+        return latch_page(pager, page_num);
+    }
+
+    page = get_page(pager, page_num);
+    if (pthread_rwlock_tryrdlock(&pager_frame(pager, page)->latch) != 0) {
+        unpin_page(pager, page_num);
+        return NULL;
+    }
+    return page;
+}
+
+/*
+ * Release a page from latch_page(). The writer's latch stays.
+ */
+void
+unlatch_page(Pager *pager, uint32_t page_num, void *page)
+{
+    if (!pager->read_only && !pager_is_writer(pager)) {
+        pthread_rwlock_unlock(&pager_frame(pager, page)->latch);
+    }
+    unpin_page(pager, page_num);
+}
+
+/*
+ * Let go of the writer's latch on a page, if it holds one.
+ */
+void
+pager_release_latch(Pager *pager, uint32_t page_num)
+{
+    uint32_t  i;
+    void     *page;
+
+    for (i = 0; i < pager->num_write_latches; i++) {
+        if (pager->write_latches[i] != page_num) {
+            continue;
+        }
+
+        page = get_page(pager, page_num);
+        frame_end_change(pager_frame(pager, page));
+        pthread_rwlock_unlock(&pager_frame(pager, page)->latch);
+        unpin_page(pager, page_num);
+        unpin_page(pager, page_num);
+
+        pager->write_latches[i] =
+            pager->write_latches[--pager->num_write_latches];
+        return;
+    }
+}
+
+/*
+ * Let go of every latch the writer holds but the one on keep_page_num,
+ * which may be INVALID_PAGE_NUM.
+ */
+void
+pager_release_latches(Pager *pager, uint32_t keep_page_num)
+{
+    uint32_t i = pager->num_write_latches;
+
+    while (i > 0) {
+        i--;
+        if (i < pager->num_write_latches &&
+            pager->write_latches[i] != keep_page_num) {
+            pager_release_latch(pager, pager->write_latches[i]);
+        }
+    }
+}
+
+int
+compare_frame_page_num(const void *a, const void *b)
+{
+    uint32_t page_a = (*(Frame **) a)->page_num;
+    uint32_t page_b = (*(Frame **) b)->page_num;
+
+    return (page_a > page_b) - (page_a < page_b);
+}
+
+/*
+ * Write pages, sorted by page number, to the database file. Each run of
+ * adjacent pages goes to the file in one vectored write. With io_uring
+ * the runs are submitted in batches, one io_uring_enter() per batch
+ * instead of one pwritev() per run.
+ */
+void
+pager_write_sorted(Pager *pager, uint32_t *page_nums, void **data,
+                   uint32_t count)
+{
+    struct iovec   *iov = malloc(sizeof(struct iovec) * count);
+    uint32_t        run_first[IO_RING_ENTRIES];
+    uint32_t        run_start[IO_RING_ENTRIES];
+    uint32_t        run_length[IO_RING_ENTRIES];
+    int32_t         results[IO_RING_ENTRIES];
+    uint32_t        num_runs = 0;
+    uint32_t        i;
+    uint32_t        start;
+
+    for (i = 0; i < count; i++) {
+        iov[i].iov_base = data[i];
+        iov[i].iov_len = PAGE_SIZE;
+    }
+
+    for (start = 0; start < count; ) {
+        uint32_t  first_page = page_nums[start];
+        uint32_t  length = 0;
+        uint32_t  r;
+
+        while (start + length < count &&
+               length < FLUSH_MAX_PAGES &&
+               page_nums[start + length] == first_page + length) {
+            length++;
+        }
+
+        if (pager->ring == NULL) {
+            pager_write_pages(pager, first_page, iov + start, length);
+        } else {
+            run_first[num_runs] = first_page;
+            run_start[num_runs] = start;
+            run_length[num_runs] = length;
+            num_runs++;
+        }
+        start += length;
+
+        if (num_runs == 0 ||
+            (num_runs < pager->ring->entries && start < count)) {
+            continue;
+        }
+
+        /* Submit the collected runs as one batch of writev requests. */
+        for (r = 0; r < num_runs; r++) {
+            struct io_uring_sqe *sqe = io_ring_next_sqe(pager->ring);
+
+            sqe->opcode = IORING_OP_WRITEV;
+            sqe->fd = pager->file_descriptor;
+            sqe->addr = (uint64_t) (uintptr_t) (iov + run_start[r]);
+            sqe->len = run_length[r];
+            sqe->off = (uint64_t) run_first[r] * PAGE_SIZE;
+            sqe->user_data = r;
+        }
+        pager->stats.write_syscalls +=
+            io_ring_submit_and_wait(pager->ring, num_runs, results);
+
+        for (r = 0; r < num_runs; r++) {
+            uint64_t  run_bytes = (uint64_t) run_length[r] * PAGE_SIZE;
+            uint64_t  run_end = (uint64_t) run_first[r] * PAGE_SIZE + run_bytes;
+
+            if (results[r] < 0) {
+                printf("Error writing: %d\n", -results[r]);
+                exit(EXIT_FAILURE);
+            }
+            if ((uint64_t) results[r] < run_bytes) {
+                /* Short write; redo the whole run synchronously. */
+                pager_write_pages(pager, run_first[r], iov + run_start[r],
+                                  run_length[r]);
+                continue;
+            }
+            pager->stats.bytes_written += results[r];
+            if (run_end > pager->file_length) {
+                pager->file_length = run_end;
+            }
+        }
+        num_runs = 0;
+    }
+
+    free(iov);
+}
+
+/*
+ * End the current transaction: append every dirty page to the log,
+ * the last one marked as the commit, and sync as the sync mode asks.
+ * Once the log has grown past WAL_CHECKPOINT_FRAMES it is folded back
+ * into the database file. Readers may go on reading the pages being
+ * logged; the writer has finished changing them.
+ */
+void
+pager_commit(Pager *pager)
+{
+    Frame    **dirty;
+    void      *meta;
+    uint32_t   num_dirty = 0;
+    uint32_t   i;
+    bool       appended;
+
+    if (pager->read_only) {
+        return;
+    }
+
+    /* Keep the page count in the meta page in step with the file. */
+    meta = get_page(pager, 0);
+    if (*meta_field(meta, META_PAGE_COUNT_OFFSET) != pager->num_pages) {
+        *meta_field(meta, META_PAGE_COUNT_OFFSET) = pager->num_pages;
+        mark_page_dirty(pager, 0);
+    }
+
+    pthread_mutex_lock(&pager->lock);
+    dirty = malloc(sizeof(Frame *) * pager->num_frames);
+    for (i = 0; i < pager->num_frames; i++) {
+        if (pager->frames[i].in_use && pager->frames[i].dirty) {
+            dirty[num_dirty++] = &pager->frames[i];
+        }
+    }
+
+    if (num_dirty == 0 && pager->wal_txn_frames > 0) {
+        /*
+         * Everything this transaction changed was evicted into the log
+         * already. Any page will do to carry the commit mark.
+         */
+        dirty[num_dirty++] = pager_frame(pager, meta);
+    }
+
+    appended = num_dirty > 0;
+    if (appended) {
+        qsort(dirty, num_dirty, sizeof(Frame *), compare_frame_page_num);
+        wal_append(pager, dirty, num_dirty, true);
+        pager->stats.wal_commits++;
+    }
+    pthread_mutex_unlock(&pager->lock);
+    free(dirty);
+    unpin_page(pager, 0);
+
+    /* Readers do not wait on the sync. */
+    if (appended && pager->sync_mode == SYNC_FULL) {
+        wal_sync(pager);
+    }
+
+    if (pager->wal_frames >= WAL_CHECKPOINT_FRAMES) {
+        pager_checkpoint(pager);
+    }
+}
+
+/*
+ * Copy the latest image of every page in the log into the database
+ * file and start the log over. The log is synced first, so a crash
+ * while the file is being overwritten can always be replayed. Must
+ * only run between transactions; readers are held off their misses
+ * meanwhile.
+ */
+void
+pager_checkpoint(Pager *pager)
+{
+    uint32_t  *page_nums;
+    void     **data;
+    char      *scratch;
+    uint32_t   batch_pages = CHECKPOINT_BATCH_BYTES / PAGE_SIZE;
+    uint32_t   count = 0;
+    uint32_t   page_num;
+
+    if (pager->read_only) {
+        return;
+    }
+
+    pthread_mutex_lock(&pager->lock);
+    if (pager->wal_frames == 0) {
+        pthread_mutex_unlock(&pager->lock);
+        return;
+    }
+
+    if (pager->sync_mode != SYNC_OFF) {
+        wal_sync(pager);
+    }
+
+    page_nums = malloc(sizeof(uint32_t) * batch_pages);
+    data = malloc(sizeof(void *) * batch_pages);
+    scratch = malloc((size_t) PAGE_SIZE * batch_pages);
+
+    for (page_num = 0; page_num < pager->wal_index_length; page_num++) {
+        int32_t frame_num;
+
+        /* Pages past the end were cut off by a vacuum. */
+        if (pager->wal_index[page_num] == 0 || page_num >= pager->num_pages) {
+            continue;
+        }
+
+        /* A cached page is clean here, so it matches its last frame. */
+        frame_num = pager_lookup_frame(pager, page_num);
+        if (frame_num != INVALID_FRAME) {
+            data[count] = pager->frames[frame_num].data;
+        } else {
+            data[count] = scratch + (size_t) count * PAGE_SIZE;
+            pager_read_page(pager, page_num, data[count]);
+        }
+        page_nums[count++] = page_num;
+
+        if (count == batch_pages) {
+            pager_write_sorted(pager, page_nums, data, count);
+            count = 0;
+        }
+    }
+    pager_write_sorted(pager, page_nums, data, count);
+
+    free(scratch);
+    free(data);
+    free(page_nums);
+
+    if (pager->sync_mode != SYNC_OFF &&
+        fdatasync(pager->file_descriptor) == -1) {
+        printf("Error syncing db file: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+
+    pager->stats.checkpoints++;
+    wal_reset(pager, pager->wal_salt + 1);
+    pthread_mutex_unlock(&pager->lock);
+}
+
+/*
+ * Shrink the database file to its first num_pages pages. Must only run
+ * right after a checkpoint, so no later image of a cut page survives in
+ * the log and every cached page is clean.
+ */
+void
+pager_truncate(Pager *pager, uint32_t num_pages)
+{
+    uint32_t i;
+
+    pthread_mutex_lock(&pager->lock);
+    for (i = 0; i < pager->num_frames; i++) {
+        Frame *frame = &pager->frames[i];
+
+        if (frame->in_use && frame->page_num >= num_pages) {
+            PagerStripe *stripe = pager_stripe(pager, frame->page_num);
+
+            pthread_mutex_lock(&stripe->lock);
+            frame_begin_change(frame);
+            pager_hash_remove(pager, i);
+            frame->in_use = false;
+            pthread_mutex_unlock(&stripe->lock);
+        }
+    }
+
+    if (ftruncate(pager->file_descriptor, (off_t) num_pages * PAGE_SIZE) ==
+        -1) {
+        printf("Error truncating db file: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    if (pager->sync_mode != SYNC_OFF &&
+        fdatasync(pager->file_descriptor) == -1) {
+        printf("Error syncing db file: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+
+    pager->file_length = (uint64_t) num_pages * PAGE_SIZE;
+    pager->num_pages = num_pages;
+    pthread_mutex_unlock(&pager->lock);
+}
+
+/*
+ * Set up an io_uring with the given number of entries. Returns false if
+ * the kernel does not provide io_uring, so the caller can fall back to
+ * plain positional I/O.
+ */
+bool
+io_ring_init(IoRing *ring, uint32_t entries)
+{
+    struct io_uring_params  params;
+    size_t                  sq_length;
+    size_t                  cq_length;
+    char                   *ptr;
+
+    memset(&params, 0, sizeof(params));
+    ring->ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->ring_fd < 0) {
+        return false;
+    }
+
+    /* One mapping covers both rings on every kernel since 5.4. */
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        close(ring->ring_fd);
+        return false;
+    }
+
+    sq_length = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_length = params.cq_off.cqes +
+        params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_length = sq_length > cq_length ? sq_length : cq_length;
+    ring->sqes_length = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->ring_ptr = mmap(NULL, ring->ring_length, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ring->ring_fd,
+                          IORING_OFF_SQ_RING);
+    if (ring->ring_ptr == MAP_FAILED) {
+        close(ring->ring_fd);
+        return false;
+    }
+
+    ring->sqes = mmap(NULL, ring->sqes_length, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->ring_fd,
+                      IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        munmap(ring->ring_ptr, ring->ring_length);
+        close(ring->ring_fd);
+        return false;
+    }
+
+    ptr = ring->ring_ptr;
+    ring->sq_head = (unsigned *) (ptr + params.sq_off.head);
+    ring->sq_tail = (unsigned *) (ptr + params.sq_off.tail);
+    ring->sq_mask = (unsigned *) (ptr + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (ptr + params.sq_off.array);
+    ring->cq_head = (unsigned *) (ptr + params.cq_off.head);
+    ring->cq_tail = (unsigned *) (ptr + params.cq_off.tail);
+    ring->cq_mask = (unsigned *) (ptr + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (ptr + params.cq_off.cqes);
+    ring->entries = params.sq_entries;
+
+    return true;
+}
+
+void
+io_ring_free(IoRing *ring)
+{
+    munmap(ring->sqes, ring->sqes_length);
+    munmap(ring->ring_ptr, ring->ring_length);
+    close(ring->ring_fd);
+}
+
+/*
+ * Return a cleared SQE at the tail of the submission ring and publish
+ * it. Callers never queue more than ring->entries requests at a time.
+ */
+struct io_uring_sqe *
+io_ring_next_sqe(IoRing *ring)
+{
+    unsigned              tail = *ring->sq_tail;
+    unsigned              index = tail & *ring->sq_mask;
+    struct io_uring_sqe  *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    return sqe;
+}
+
+/*
+ * Submit the queued requests and wait until all count of them have
+ * completed. results[user_data] receives each request's result. Returns
+ * the number of io_uring_enter() calls it took.
+ */
+uint32_t
+io_ring_submit_and_wait(IoRing *ring, uint32_t count, int32_t *results)
+{
+    uint32_t  to_submit = count;
+    uint32_t  completed = 0;
+    uint32_t  syscalls = 0;
+
+    while (completed < count) {
+        unsigned  head = *ring->cq_head;
+        unsigned  tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        int       ret;
+
+        while (head != tail) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+
+            results[cqe->user_data] = cqe->res;
+            completed++;
+            head++;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+        if (completed == count) {
+            break;
+        }
+
+        ret = syscall(__NR_io_uring_enter, ring->ring_fd, to_submit,
+                      count - completed, IORING_ENTER_GETEVENTS, NULL, 0);
+        syscalls++;
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            printf("Error submitting I/O: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        to_submit -= ret;
+    }
+
+    return syscalls;
+}
+
+/*
+ * Open the write-ahead log next to the database file and replay it if
+ * the last session did not close cleanly. A read-only pager cannot
+ * replay, so it refuses a log that may hold commits.
+ */
+void
+wal_open(Pager *pager, const char *filename)
+{
+    int fd;
+
+    pager->wal_path = malloc(strlen(filename) + sizeof(".wal"));
+    sprintf(pager->wal_path, "%s.wal", filename);
+
+    if (pager->read_only) {
+        fd = open(pager->wal_path, O_RDONLY);
+        if (fd != -1) {
+            off_t wal_length = lseek(fd, 0, SEEK_END);
+            close(fd);
+            if (wal_length > WAL_HEADER_SIZE) {
+                printf("Database has a write-ahead log. "
+                       "Open it read-write once to recover.\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        return;
+    }
+
+    fd = open(pager->wal_path, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+    if (fd == -1) {
+        printf("Unable to open write-ahead log\n");
+        exit(EXIT_FAILURE);
+    }
+
+    pager->wal_fd = fd;
+    pthread_mutex_init(&pager->group.lock, NULL);
+    pthread_cond_init(&pager->group.synced, NULL);
+    pager->group.syncing = false;
+    pager->group.appended = 0;
+    pager->group.durable = 0;
+
+    wal_recover(pager);
+}
+
+/*
+ * Index every frame up to the last commit and checkpoint them into the
+ * database file. Frames after it belong to a transaction that never
+ * committed and are dropped.
+ */
+void
+wal_recover(Pager *pager)
+{
+    WalHeader   header;
+    char       *frame;
+    uint32_t   *page_nums = NULL;
+    uint32_t    capacity = 0;
+    uint32_t    num_frames = 0;
+    uint32_t    committed = 0;
+    uint32_t    db_pages = 0;
+    uint32_t    i;
+
+    if (pread(pager->wal_fd, &header, WAL_HEADER_SIZE, 0) != WAL_HEADER_SIZE ||
+        header.magic != WAL_MAGIC || header.page_size != PAGE_SIZE ||
+        header.checksum !=
+            wal_checksum(&header, offsetof(WalHeader, checksum), 0)) {
+        wal_reset(pager, (uint32_t) time(NULL));
+        return;
+    }
+
+    frame = malloc(WAL_FRAME_SIZE);
+    while (pread(pager->wal_fd, frame, WAL_FRAME_SIZE,
+                 WAL_HEADER_SIZE + (off_t) num_frames * WAL_FRAME_SIZE) ==
+           WAL_FRAME_SIZE) {
+        WalFrameHeader *frame_header = (WalFrameHeader *) frame;
+        uint32_t        checksum;
+
+        checksum = wal_checksum(frame, offsetof(WalFrameHeader, checksum), 0);
+        checksum = wal_checksum(frame + WAL_FRAME_HEADER_SIZE, PAGE_SIZE,
+                                checksum);
+        if (frame_header->salt != header.salt ||
+            frame_header->checksum != checksum) {
+            break;
+        }
+
+        if (num_frames == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            page_nums = realloc(page_nums, sizeof(uint32_t) * capacity);
+        }
+        page_nums[num_frames++] = frame_header->page_num;
+        if (frame_header->commit != 0) {
+            committed = num_frames;
+            db_pages = frame_header->commit;
+        }
+    }
+    free(frame);
+
+    pager->wal_salt = header.salt;
+    for (i = 0; i < committed; i++) {
+        wal_index_set(pager, page_nums[i], i);
+    }
+    free(page_nums);
+
+    if (committed == 0) {
+        wal_reset(pager, header.salt + 1);
+        return;
+    }
+
+    /* The frames may never have been synced; the checkpoint will. */
+    pager->wal_frames = committed;
+    pager->group.appended = committed;
+    if (db_pages > pager->num_pages) {
+        pager->num_pages = db_pages;
+    }
+    pager_checkpoint(pager);
+}
+
+/*
+ * Start the log over under a new salt, which invalidates every frame
+ * left in it. The header is rewritten along with the next frames.
+ */
+void
+wal_reset(Pager *pager, uint32_t salt)
+{
+    pager->wal_salt = salt;
+    pager->wal_frames = 0;
+    pager->wal_txn_frames = 0;
+    if (pager->wal_index != NULL) {
+        memset(pager->wal_index, 0, sizeof(uint32_t) * pager->wal_index_length);
+    }
+}
+
+/*
+ * Append page images to the log. With commit set, the last frame marks
+ * the end of the transaction. The frames become the pages' current
+ * images, so the pool frames are clean afterwards.
+ */
+void
+wal_append(Pager *pager, Frame **frames, uint32_t count, bool commit)
+{
+    WalHeader        header;
+    WalFrameHeader  *headers = malloc(sizeof(WalFrameHeader) * count);
+    struct iovec    *iov = malloc(sizeof(struct iovec) * (2 * count + 1));
+    off_t            offset;
+    uint32_t         num_iov = 0;
+    uint32_t         start;
+    uint32_t         i;
+
+    offset = WAL_HEADER_SIZE + (off_t) pager->wal_frames * WAL_FRAME_SIZE;
+    if (pager->wal_frames == 0) {
+        header.magic = WAL_MAGIC;
+        header.page_size = PAGE_SIZE;
+        header.salt = pager->wal_salt;
+        header.checksum =
+            wal_checksum(&header, offsetof(WalHeader, checksum), 0);
+        iov[num_iov].iov_base = &header;
+        iov[num_iov].iov_len = WAL_HEADER_SIZE;
+        num_iov++;
+        offset = 0;
+    }
+
+    for (i = 0; i < count; i++) {
+        WalFrameHeader *frame_header = &headers[i];
+
+        frame_header->page_num = frames[i]->page_num;
+        frame_header->commit = 0;
+        if (commit && i == count - 1) {
+            frame_header->commit = pager->num_pages;
+        }
+        frame_header->salt = pager->wal_salt;
+        frame_header->checksum = wal_checksum(
+            frame_header, offsetof(WalFrameHeader, checksum), 0);
+        frame_header->checksum = wal_checksum(
+            frames[i]->data, PAGE_SIZE, frame_header->checksum);
+
+        iov[num_iov].iov_base = frame_header;
+        iov[num_iov].iov_len = WAL_FRAME_HEADER_SIZE;
+        num_iov++;
+        iov[num_iov].iov_base = frames[i]->data;
+        iov[num_iov].iov_len = PAGE_SIZE;
+        num_iov++;
+    }
+
+    pthread_mutex_lock(&pager->group.lock);
+    for (start = 0; start < num_iov; ) {
+        uint32_t  batch = num_iov - start;
+        size_t    length = 0;
+
+        if (batch > 2 * FLUSH_MAX_PAGES) {
+            batch = 2 * FLUSH_MAX_PAGES;
+        }
+        for (i = 0; i < batch; i++) {
+            length += iov[start + i].iov_len;
+        }
+        pager_pwritev(pager, pager->wal_fd, offset, iov + start, batch);
+        offset += length;
+        start += batch;
+    }
+    pager->group.appended += count;
+    pthread_mutex_unlock(&pager->group.lock);
+
+    for (i = 0; i < count; i++) {
+        wal_index_set(pager, frames[i]->page_num, pager->wal_frames + i);
+        frames[i]->dirty = false;
+    }
+    pager->wal_frames += count;
+    pager->wal_txn_frames = commit ? 0 : pager->wal_txn_frames + count;
+    pager->stats.wal_frames += count;
+
+    free(iov);
+    free(headers);
+}
+
+/*
+ * Make every frame appended so far durable, sharing one fdatasync()
+ * among all the committers waiting at the same time.
+ */
+void
+wal_sync(Pager *pager)
+{
+    GroupCommit *group = &pager->group;
+    uint64_t     target;
+
+    pthread_mutex_lock(&group->lock);
+    target = group->appended;
+    while (group->durable < target) {
+        uint64_t end;
+
+        if (group->syncing) {
+            pthread_cond_wait(&group->synced, &group->lock);
+            continue;
+        }
+
+        /* Lead: sync on behalf of everyone who appended before now. */
+        group->syncing = true;
+        end = group->appended;
+        pthread_mutex_unlock(&group->lock);
+
+        if (fdatasync(pager->wal_fd) == -1) {
+            printf("Error syncing write-ahead log: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+
+        pthread_mutex_lock(&group->lock);
+        group->syncing = false;
+        group->durable = end;
+        pager->stats.wal_syncs++;
+        pthread_cond_broadcast(&group->synced);
+    }
+    pthread_mutex_unlock(&group->lock);
+}
+
+/*
+ * Close and remove the log. Only called once everything in it has been
+ * checkpointed.
+ */
+void
+wal_close(Pager *pager)
+{
+    if (pager->wal_fd != -1) {
+        close(pager->wal_fd);
+        unlink(pager->wal_path);
+        pthread_mutex_destroy(&pager->group.lock);
+        pthread_cond_destroy(&pager->group.synced);
+    }
+
+    free(pager->wal_index);
+    free(pager->wal_path);
+}
+
+/*
+ * Return 1 + the frame holding the latest image of the page, or 0 if
+ * the page has not been logged since the last checkpoint.
+ */
+uint32_t
+wal_lookup(Pager *pager, uint32_t page_num)
+{
+    if (page_num >= pager->wal_index_length) {
+        return 0;
+    }
+
+    return pager->wal_index[page_num];
+}
+
+void
+wal_index_set(Pager *pager, uint32_t page_num, uint32_t frame_num)
+{
+    if (page_num >= pager->wal_index_length) {
+        uint32_t length = pager->wal_index_length;
+
+        if (length == 0) {
+            length = 1024;
+        }
+        while (length <= page_num) {
+            length *= 2;
+        }
+        pager->wal_index = realloc(pager->wal_index, sizeof(uint32_t) * length);
+        memset(pager->wal_index + pager->wal_index_length, 0,
+               sizeof(uint32_t) * (length - pager->wal_index_length));
+        pager->wal_index_length = length;
+    }
+
+    pager->wal_index[page_num] = frame_num + 1;
+}
+
+/*
+ * Fletcher-style checksum over 32-bit words, chained through seed so a
+ * frame header and its page can be summed together.
+ */
+uint32_t
+wal_checksum(const void *data, size_t length, uint32_t seed)
+{
+    const uint32_t *words = data;
+    uint32_t        s0 = seed;
+    uint32_t        s1 = 0;
+    size_t          i;
+
+    for (i = 0; i < length / sizeof(uint32_t); i++) {
+        s0 += words[i] + s1;
+        s1 += s0;
+    }
+
+    return s0 ^ (s1 << 16) ^ (s1 >> 16);
+}
+
+Cursor *
+table_start(Table *table)
+{
+    Cursor   *cursor = table_find(table, 0);
+    uint32_t  num_cells = *leaf_node_num_cells(cursor->node);
+
+    cursor->end_of_table = (num_cells == 0);
+    cursor_prefetch(cursor);
+
+    return cursor;
+}
+
+/*
+ * Return the position of the given key.
+ * If the key is not present, return the position
+ * where it should be inserted.
+ *
+ * The writer's descent latches each child before it lets go of its
+ * parent, so it never sees a node halfway through a change. It keeps
+ * the parent while the child may have to split or take a changed key
+ * from below, see node_is_safe(), and holds the whole path a change can
+ * reach until it is done.
+ *
+ * A reader first descends without latches, see table_peek_leaf(), and
+ * latches only the leaf it ends at. Should the leaf change before it is
+ * latched, or the writer keep getting in the way, the reader descends
+ * as the writer does, letting go of each parent at once.
+ *
+ * A key past the last key of the rightmost leaf goes at its end, so
+ * the writer finds increasing keys without descending from the root.
+ * The hint is checked on every use and refreshed by the next descent
+ * that reaches the right edge.
+ */
+Cursor *
+table_find(Table *table, uint32_t key)
+{
+    Pager    *pager = table->pager;
+    uint32_t  root_page_num = table->root_page_num;
+    void     *root_node;
+    Cursor   *cursor;
+
+    pager_advise(pager, MADV_RANDOM);
+
+    if (!pager_is_writer(pager) && !pager->read_only) {
+        uint32_t attempt;
+
+        for (attempt = 0; attempt < OPTIMISTIC_RETRIES; attempt++) {
+            uint64_t  version;
+            Frame    *frame = table_peek_leaf(table, key, &version);
+            uint32_t  page_num;
+            void     *leaf;
+
+            if (frame == NULL) {
+                continue;
+            }
+            page_num = __atomic_load_n(&frame->page_num, __ATOMIC_RELAXED);
+            if (!frame_validate(frame, version)) {
+                continue;
+            }
+            leaf = latch_page(pager, page_num);
+            if (leaf == frame->data && frame_validate(frame, version)) {
+                return leaf_node_find(table, page_num, leaf, key);
+            }
+            unlatch_page(pager, page_num, leaf);
+        }
+    }
+
+    if (pager_is_writer(pager) && table->rightmost_leaf != INVALID_PAGE_NUM) {
+        uint32_t  hint = table->rightmost_leaf;
+        void     *leaf = latch_page(pager, hint);
+        uint32_t  num_cells = *leaf_node_num_cells(leaf);
+        bool      append = (get_node_type(leaf) == NODE_LEAF &&
+                            *leaf_node_next_leaf(leaf) == 0 &&
+                            num_cells > 0 &&
+                            key > *leaf_node_key(leaf, num_cells - 1));
+
+        /* A leaf that must split needs its parent latched too. */
+        if (append && node_is_safe(table, leaf)) {
+            return leaf_node_find(table, hint, leaf, key);
+        }
+        unlatch_page(pager, hint, leaf);
+        pager_release_latch(pager, hint);
+    }
+
+    root_node = latch_page(pager, root_page_num);
+    if (get_node_type(root_node) == NODE_LEAF) {
+        cursor = leaf_node_find(table, root_page_num, root_node, key);
+    } else {
+        cursor = internal_node_find(table, root_page_num, root_node, key);
+    }
+
+    if (pager_is_writer(pager) && *leaf_node_next_leaf(cursor->node) == 0) {
+        table->rightmost_leaf = cursor->page_num;
+    }
+
+    return cursor;
+}
+
+/*
+ * Find the leaf for the key without latching or pinning anything. Each
+ * node's version is read before the node and checked after, and again
+ * once the version of the child it points to has been read, so the
+ * child was its child then. Returns the leaf's frame and, in *version,
+ * the version the leaf had, or NULL if a node on the way is not cached
+ * or changed while it was read.
+ */
+Frame *
+table_peek_leaf(Table *table, uint32_t key, uint64_t *version)
+{
+    Pager     *pager = table->pager;
+    Frame     *frame = pager_peek_frame(pager, table->root_page_num, version);
+    Frame     *child;
+    uint64_t   child_version;
+    uint32_t   child_num;
+    NodeType   type;
+
+    while (frame != NULL) {
+        type = get_node_type(frame->data);
+        if (!frame_validate(frame, *version)) {
+            return NULL;
+        }
+        if (type == NODE_LEAF) {
+            return frame;
+        }
+
+        child_num = internal_node_peek_child(frame->data, key);
+        if (child_num == INVALID_PAGE_NUM) {
+            return NULL;
+        }
+        child = pager_peek_frame(pager, child_num, &child_version);
+        if (child == NULL || !frame_validate(frame, *version)) {
+            return NULL;
+        }
+        frame = child;
+        *version = child_version;
+    }
+
+    return NULL;
+}
+
+/*
+ * Read the row with the key, for a point lookup, without latching or
+ * pinning anything. PEEK_FAILED if that did not work out, in which
+ * case the caller looks it up through a cursor instead.
+ */
+PeekResult
+table_peek_row(Table *table, uint32_t key, Row *row)
+{
+    uint32_t    attempt;
+    PeekResult  result;
+
+    if (table->pager->read_only) {
+        return PEEK_FAILED;
+    }
+
+    for (attempt = 0; attempt < OPTIMISTIC_RETRIES; attempt++) {
+        uint64_t  version;
+        Frame    *frame = table_peek_leaf(table, key, &version);
+
+        if (frame == NULL) {
+            continue;
+        }
+        result = leaf_node_peek_row(frame, version, key, row);
+        if (result != PEEK_FAILED) {
+            return result;
+        }
+    }
+
+    return PEEK_FAILED;
+}
+
+/*
+ * A reader moves to the next leaf only if it can latch it without
+ * waiting: the writer may be holding it while it waits for this one.
+ * Otherwise the reader lets go and looks for the next key from the
+ * root.
+ */
+void
+cursor_advance(Cursor *cursor)
+{
+    Pager    *pager = cursor->table->pager;
+    void     *node;
+    uint32_t  num_cells;
+
+    cursor->cell_num += 1;
+    while (!cursor->end_of_table) {
+        uint32_t  next_page_num;
+        void     *next;
+
+        node = cursor->node;
+        num_cells = *leaf_node_num_cells(node);
+        if (cursor->cell_num < num_cells) {
+            break;
+        }
+
+        /* Advance to next leaf node. */
+        next_page_num = *leaf_node_next_leaf(node);
+        if (next_page_num == 0) {
+            /* This was rightmost leaf. */
+            cursor->end_of_table = true;
+            break;
+        }
+
+        next = try_latch_page(pager, next_page_num);
+        if (next == NULL) {
+            cursor_seek_past(cursor, *leaf_node_key(node, num_cells - 1));
+            continue;
+        }
+        unlatch_page(pager, cursor->page_num, node);
+        cursor->node = next;
+        cursor->page_num = next_page_num;
+        cursor->cell_num = 0;
+        cursor_prefetch(cursor);
+    }
+}
+
+/*
+ * Move the cursor to the first key past the given one, descending from
+ * the root with nothing else latched.
+ */
+void
+cursor_seek_past(Cursor *cursor, uint32_t key)
+{
+    Cursor *found;
+
+    if (key == UINT32_MAX) {
+        cursor->end_of_table = true;
+        return;
+    }
+
+    unlatch_page(cursor->table->pager, cursor->page_num, cursor->node);
+    found = table_find(cursor->table, key + 1);
+    cursor->page_num = found->page_num;
+    cursor->node = found->node;
+    cursor->cell_num = found->cell_num;
+    free(found);
+}
+
+/*
+ * Deserialize the row under the cursor, gathering the part of it that
+ * lives in overflow pages.
+ */
+void
+cursor_read_row(Cursor *cursor, Row *row)
+{
+    leaf_cell_read_row(cursor->table->pager,
+                       leaf_node_cell(cursor->node, cursor->cell_num), row);
+}
+
+/*
+ * The row in a leaf cell, with the part of it in overflow pages.
+ */
+void
+leaf_cell_read_row(Pager *pager, void *cell, Row *row)
+{
+    char payload[ROW_MAX_SIZE];
+
+    leaf_cell_read(pager, cell, payload);
+    deserialize_row(payload, row);
+}
+
+/*
+ * Copy the payload of a leaf cell, with the part of it in overflow
+ * pages, and return its size.
+ */
+uint32_t
+leaf_cell_read(Pager *pager, void *cell, void *payload)
+{
+    uint32_t   payload_size = *(uint16_t *) cell;
+    uint32_t   offset;
+    uint32_t   chunk;
+    uint32_t   page_num;
+    uint32_t   next;
+    void      *page;
+
+    offset = payload_size;
+    if (offset > LEAF_NODE_MAX_LOCAL) {
+        offset = LEAF_NODE_MAX_LOCAL;
+    }
+    memcpy(payload, cell + LEAF_NODE_PAYLOAD_SIZE_SIZE, offset);
+
+    page_num = offset < payload_size ? *leaf_cell_overflow(cell) : 0;
+    for (; offset < payload_size;
+         offset += chunk) {
+        chunk = payload_size - offset;
+        if (chunk > OVERFLOW_PAGE_SPACE) {
+            chunk = OVERFLOW_PAGE_SPACE;
+        }
+        page = get_page(pager, page_num);
+        memcpy(payload + offset, page + OVERFLOW_PAGE_HEADER_SIZE, chunk);
+        next = *overflow_page_next(page);
+        unpin_page(pager, page_num);
+        page_num = next;
+    }
+
+    return payload_size;
+}
+
+void
+cursor_free(Cursor *cursor)
+{
+    unlatch_page(cursor->table->pager, cursor->page_num, cursor->node);
+    free(cursor);
+}
+
+/*
+ * Read ahead of a scan. The leaves that follow the cursor's leaf are the
+ * next children of its parent. Two windows run ahead of the cursor:
+ *
+ * - The kernel is asked to start reading the next readahead_window
+ *   leaves in the background once the cursor is halfway through the
+ *   previous hint. The window doubles each time, up to
+ *   SCAN_READAHEAD_MAX, for as long as the scan keeps going.
+ * - When the cursor reaches the last leaf loaded into the pool, up to
+ *   SCAN_PREFETCH_PAGES more are read into it in one batch. These reads
+ *   are mostly served from the page cache filled by the hints.
+ *
+ * Latching the parent from below could deadlock with the writer, so the
+ * parent is only tried. If the writer has it, or it is no longer the
+ * parent of the leaf, there is no read ahead this time.
+ */
+void
+cursor_prefetch(Cursor *cursor)
+{
+    Pager     *pager = cursor->table->pager;
+    void      *node = cursor->node;
+    void      *parent;
+    uint32_t   parent_page_num;
+    uint32_t   page_nums[SCAN_READAHEAD_MAX];
+    uint32_t   num_children;
+    uint32_t   index;
+    uint32_t   start;
+    uint32_t   count = 0;
+
+    if (is_node_root(node) || *leaf_node_num_cells(node) == 0) {
+        return;
+    }
+
+    parent_page_num = get_node_parent(node);
+    parent = try_latch_page(pager, parent_page_num);
+    if (parent == NULL) {
+        return;
+    }
+    if (get_node_type(parent) != NODE_INTERNAL) {
+        unlatch_page(pager, parent_page_num, parent);
+        return;
+    }
+    index = internal_node_find_child(parent, *leaf_node_key(node, 0));
+    if (*internal_node_child(parent, index) != cursor->page_num) {
+        unlatch_page(pager, parent_page_num, parent);
+        return;
+    }
+    num_children = *internal_node_num_keys(parent) + 1;
+
+    /* Leaves past the one holding end_key are not wanted. */
+    if (cursor->end_key != UINT32_MAX) {
+        num_children = internal_node_find_child(parent, cursor->end_key) + 1;
+    }
+
+    if (parent_page_num != cursor->prefetch_parent) {
+        cursor->prefetch_parent = parent_page_num;
+        cursor->prefetch_end = index + 1;
+        cursor->readahead_end = index + 1;
+    }
+
+    start = cursor->readahead_end;
+    if (start < num_children &&
+        start < index + 1 + cursor->readahead_window / 2) {
+        if (start < index + 1) {
+            start = index + 1;
+        }
+        while (start + count < num_children &&
+               count < cursor->readahead_window) {
+            page_nums[count] = *internal_node_child(parent, start + count);
+            count++;
+        }
+        pager_readahead(pager, page_nums, count);
+        cursor->readahead_end = start + count;
+
+        if (cursor->readahead_window < SCAN_READAHEAD_MAX) {
+            cursor->readahead_window *= 2;
+        }
+    }
+
+    if (cursor->prefetch_end <= index + 1) {
+        start = index + 1;
+        count = 0;
+        while (start + count < num_children && count < SCAN_PREFETCH_PAGES) {
+            page_nums[count] = *internal_node_child(parent, start + count);
+            count++;
+        }
+        cursor->prefetch_end = start + pager_prefetch(pager, page_nums, count);
+    }
+    unlatch_page(pager, parent_page_num, parent);
+}
+
+void
+initialize_meta_page(void *meta)
+{
+    memset(meta, 0, PAGE_SIZE);
+    *meta_field(meta, META_MAGIC_OFFSET) = META_MAGIC;
+    *meta_field(meta, META_VERSION_OFFSET) = META_VERSION;
+    *meta_field(meta, META_PAGE_SIZE_OFFSET) = PAGE_SIZE;
+}
+
+uint32_t *
+meta_field(void *meta, uint32_t offset)
+{
+    return meta + offset;
+}
+
+uint32_t *
+free_page_next(void *node)
+{
+    return node + FREE_PAGE_NEXT_OFFSET;
+}
+
+uint32_t *
+overflow_page_next(void *node)
+{
+    return node + OVERFLOW_PAGE_NEXT_OFFSET;
+}
+
+void
+initialize_leaf_node(void *node)
+{
+    set_node_type(node, NODE_LEAF);
+    set_node_root(node, false);
+    *leaf_node_num_cells(node) = 0;
+    *leaf_node_next_leaf(node) = 0; // 0 represents no sibling
+    *leaf_node_content_start(node) = PAGE_SIZE;
+    *leaf_node_fragmented(node) = 0;
+}
+
+void
+initialize_internal_node(void *node)
+{
+    set_node_type(node, NODE_INTERNAL);
+    set_node_root(node, false);
+    *internal_node_num_keys(node) = 0;
+    *((uint8_t *) (node + INTERNAL_NODE_PREFIX_LENGTH_OFFSET)) = 0;
+}
+
+uint32_t *
+leaf_node_num_cells(void *node)
+{
+    return node + LEAF_NODE_NUM_CELLS_OFFSET;
+}
+
+uint32_t *
+leaf_node_content_start(void *node)
+{
+    return node + LEAF_NODE_CONTENT_START_OFFSET;
+}
+
+uint32_t *
+leaf_node_fragmented(void *node)
+{
+    return node + LEAF_NODE_FRAGMENTED_OFFSET;
+}
+
+uint16_t *
+leaf_node_slot(void *node, uint32_t cell_num)
+{
+    return node + LEAF_NODE_HEADER_SIZE +
+           *leaf_node_num_cells(node) * LEAF_NODE_KEY_SIZE +
+           cell_num * LEAF_NODE_SLOT_SIZE;
+}
+
+void *
+leaf_node_cell(void *node, uint32_t cell_num)
+{
+    return node + *leaf_node_slot(node, cell_num);
+}
+
+uint32_t *
+leaf_node_key(void *node, uint32_t cell_num)
+{
+    return node + LEAF_NODE_HEADER_SIZE + cell_num * LEAF_NODE_KEY_SIZE;
+}
+
+/*
+ * Bytes left for new cells, their keys and their slots, counting the
+ * holes that deletes left between cells.
+ */
+uint32_t
+leaf_node_free_space(void *node)
+{
+    uint32_t slots_end = LEAF_NODE_HEADER_SIZE +
+                         *leaf_node_num_cells(node) * LEAF_NODE_ENTRY_SIZE;
+
+    return *leaf_node_content_start(node) - slots_end +
+           *leaf_node_fragmented(node);
+}
+
+uint32_t
+leaf_node_used_space(void *node)
+{
+    return LEAF_NODE_SPACE_FOR_CELLS - leaf_node_free_space(node);
+}
+
+/*
+ * Pack the cells against the end of the page again, closing the holes
+ * between them.
+ */
+void
+leaf_node_defragment(void *node)
+{
+    char      scratch[PAGE_SIZE];
+    uint32_t  num_cells = *leaf_node_num_cells(node);
+    uint32_t  content_start = PAGE_SIZE;
+    uint32_t  cell_size;
+    uint32_t  i;
+
+    memcpy(scratch, node, PAGE_SIZE);
+    for (i = 0; i < num_cells; i++) {
+        cell_size = leaf_cell_size(leaf_node_cell(scratch, i));
+        content_start -= cell_size;
+        memcpy(node + content_start, leaf_node_cell(scratch, i), cell_size);
+        *leaf_node_slot(node, i) = content_start;
+    }
+    *leaf_node_content_start(node) = content_start;
+    *leaf_node_fragmented(node) = 0;
+}
+
+/*
+ * Insert a cell before cell_num, which the caller has made sure fits.
+ * Only the keys and slots after it move, and the slots before it, which
+ * make room for one more key.
+ */
+void
+leaf_node_put_cell(void *node, uint32_t cell_num, void *cell,
+                   uint32_t cell_size)
+{
+    uint32_t  num_cells = *leaf_node_num_cells(node);
+    uint32_t  slots_end = LEAF_NODE_HEADER_SIZE +
+                          (num_cells + 1) * LEAF_NODE_ENTRY_SIZE;
+    uint16_t *slots = leaf_node_slot(node, 0);
+
+    if (*leaf_node_content_start(node) < slots_end + cell_size) {
+        leaf_node_defragment(node);
+    }
+    *leaf_node_content_start(node) -= cell_size;
+    memcpy(node + *leaf_node_content_start(node), cell, cell_size);
+
+    /* The slots move up by a key, and those after cell_num by a slot. */
+    memmove((void *) slots + LEAF_NODE_KEY_SIZE + (cell_num + 1) *
+            LEAF_NODE_SLOT_SIZE, slots + cell_num,
+            (size_t) (num_cells - cell_num) * LEAF_NODE_SLOT_SIZE);
+    memmove((void *) slots + LEAF_NODE_KEY_SIZE, slots,
+            (size_t) cell_num * LEAF_NODE_SLOT_SIZE);
+    memmove(leaf_node_key(node, cell_num + 1), leaf_node_key(node, cell_num),
+            (size_t) (num_cells - cell_num) * LEAF_NODE_KEY_SIZE);
+
+    *leaf_node_num_cells(node) = num_cells + 1;
+    *leaf_node_key(node, cell_num) = leaf_cell_key(cell);
+    *leaf_node_slot(node, cell_num) = *leaf_node_content_start(node);
+}
+
+/*
+ * Replace the cells of a leaf with count cells, in order. None of them
+ * may point into the leaf itself.
+ */
+void
+leaf_node_set_cells(void *node, void **cells, uint32_t count)
+{
+    uint32_t i;
+
+    *leaf_node_num_cells(node) = 0;
+    *leaf_node_content_start(node) = PAGE_SIZE;
+    *leaf_node_fragmented(node) = 0;
+    for (i = 0; i < count; i++) {
+        leaf_node_put_cell(node, i, cells[i], leaf_cell_size(cells[i]));
+    }
+}
+
+/*
+ * Keep only the first count cells. The cells dropped are left where they
+ * are as holes, so a caller may still copy them out, and only the slots
+ * move down to follow the shorter key array.
+ */
+void
+leaf_node_truncate(void *node, uint32_t count)
+{
+    uint32_t  num_cells = *leaf_node_num_cells(node);
+    uint16_t *slots = leaf_node_slot(node, 0);
+    uint32_t  i;
+
+    for (i = count; i < num_cells; i++) {
+        *leaf_node_fragmented(node) +=
+            leaf_cell_size(leaf_node_cell(node, i));
+    }
+    memmove((void *) slots - (num_cells - count) * LEAF_NODE_KEY_SIZE,
+            slots, (size_t) count * LEAF_NODE_SLOT_SIZE);
+    *leaf_node_num_cells(node) = count;
+}
+
+/*
+ * How many of count cells, in order, go to the left of a split so that
+ * both sides use about the same space. Each side gets at least one.
+ */
+uint32_t
+leaf_split_point(void **cells, uint32_t count)
+{
+    uint32_t  total = 0;
+    uint32_t  left = 0;
+    uint32_t  size;
+    uint32_t  i;
+
+    for (i = 0; i < count; i++) {
+        total += leaf_cell_size(cells[i]) + LEAF_NODE_ENTRY_SIZE;
+    }
+    for (i = 0; i < count - 1; i++) {
+        size = leaf_cell_size(cells[i]) + LEAF_NODE_ENTRY_SIZE;
+        if (2 * left + size > total) {
+            break;
+        }
+        left += size;
+    }
+
+    return i > 0 ? i : 1;
+}
+
+/*
+ * Bytes a cell takes in its leaf for a row of payload_size bytes, not
+ * counting its slot.
+ */
+uint32_t
+cell_size_for_payload(uint32_t payload_size)
+{
+    if (payload_size > LEAF_NODE_MAX_LOCAL) {
+        return LEAF_NODE_MAX_CELL_SIZE;
+    }
+    return LEAF_NODE_PAYLOAD_SIZE_SIZE + payload_size;
+}
+
+uint32_t
+leaf_cell_size(void *cell)
+{
+    return cell_size_for_payload(*(uint16_t *) cell);
+}
+
+uint32_t
+leaf_cell_key(void *cell)
+{
+    return *(uint32_t *) (cell + LEAF_NODE_KEY_OFFSET);
+}
+
+/*
+ * The first overflow page of a cell whose row did not fit locally.
+ */
+uint32_t *
+leaf_cell_overflow(void *cell)
+{
+    return cell + LEAF_NODE_PAYLOAD_SIZE_SIZE + LEAF_NODE_MAX_LOCAL;
+}
+
+/*
+ * Serialize a row into a cell and return the size of the cell.
+ */
+uint32_t
+leaf_cell_build(Pager *pager, Row *row, void *cell)
+{
+    char payload[ROW_MAX_SIZE];
+
+    serialize_row(row, payload);
+    return leaf_cell_write(pager, payload, serialized_row_size(row), cell);
+}
+
+/*
+ * Write a payload of at most UINT16_MAX bytes into a cell and return
+ * the size of the cell. The part of the payload past
+ * LEAF_NODE_MAX_LOCAL bytes is written to a chain of newly allocated
+ * overflow pages. Nothing reaches them but the cell, so the writer lets
+ * go of each as soon as it is written.
+ */
+uint32_t
+leaf_cell_write(Pager *pager, void *payload, uint32_t payload_size,
+                void *cell)
+{
+    uint32_t   offset;
+    uint32_t   chunk;
+    uint32_t   page_num;
+    uint32_t   prev_page_num = INVALID_PAGE_NUM;
+    void      *page;
+    void      *prev = NULL;
+
+    *(uint16_t *) cell = payload_size;
+    offset = payload_size;
+    if (offset > LEAF_NODE_MAX_LOCAL) {
+        offset = LEAF_NODE_MAX_LOCAL;
+    }
+    memcpy(cell + LEAF_NODE_PAYLOAD_SIZE_SIZE, payload, offset);
+
+    for (; offset < payload_size;
+         offset += chunk) {
+        chunk = payload_size - offset;
+        if (chunk > OVERFLOW_PAGE_SPACE) {
+            chunk = OVERFLOW_PAGE_SPACE;
+        }
+        page_num = get_unused_page_num(pager);
+        page = get_page(pager, page_num);
+        set_node_type(page, NODE_OVERFLOW);
+        set_node_root(page, false);
+        *node_parent(page) = 0;
+        *overflow_page_next(page) = 0;
+        memcpy(page + OVERFLOW_PAGE_HEADER_SIZE, payload + offset, chunk);
+
+        if (prev == NULL) {
+            *leaf_cell_overflow(cell) = page_num;
+        } else {
+            *overflow_page_next(prev) = page_num;
+            mark_page_dirty(pager, prev_page_num);
+            unpin_page(pager, prev_page_num);
+            pager_release_latch(pager, prev_page_num);
+        }
+        prev = page;
+        prev_page_num = page_num;
+    }
+    if (prev != NULL) {
+        mark_page_dirty(pager, prev_page_num);
+        unpin_page(pager, prev_page_num);
+        pager_release_latch(pager, prev_page_num);
+    }
+
+    return cell_size_for_payload(payload_size);
+}
+
+/*
+ * Free the overflow pages of a cell that is about to be deleted. Only
+ * the cell reaches them, so the writer keeps none of them latched.
+ */
+void
+leaf_cell_free_overflow(Pager *pager, void *cell)
+{
+    uint32_t  page_num;
+    uint32_t  next;
+    void     *page;
+
+    if (*(uint16_t *) cell <= LEAF_NODE_MAX_LOCAL) {
+        return;
+    }
+
+    page_num = *leaf_cell_overflow(cell);
+    while (page_num != 0) {
+        page = get_page(pager, page_num);
+        next = *overflow_page_next(page);
+        unpin_page(pager, page_num);
+        pager_free_page(pager, page_num);
+        pager_release_latch(pager, page_num);
+        page_num = next;
+    }
+}
+
+void
+leaf_node_insert(Cursor *cursor, void *payload, uint32_t payload_size)
+{
+    void     *node = cursor->node;
+    char      cell[LEAF_NODE_MAX_CELL_SIZE];
+    uint32_t  cell_size = leaf_cell_write(cursor->table->pager, payload,
+                                          payload_size, cell);
+
+    if (leaf_node_free_space(node) < cell_size + LEAF_NODE_ENTRY_SIZE) {
+        /* Node full */
+        leaf_node_split_and_insert(cursor, cell);
+        return;
+    }
+
+    leaf_node_put_cell(node, cursor->cell_num, cell, cell_size);
+    mark_page_dirty(cursor->table->pager, cursor->page_num);
+}
+
+/*
+ * The end of the run of sorted rows from start that go in the leaf:
+ * those up to its largest key, which is also its separator above, or
+ * all of them when it is the rightmost leaf. A run stops short of
+ * filling more than a leaf, so it splits each node on its path at most
+ * once and the writer holds no more pages than MIN_POOL_FRAMES allows.
+ */
+uint32_t
+leaf_node_run_end(void *node, Row *rows, uint32_t start, uint32_t num_rows)
+{
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    uint32_t max_key = UINT32_MAX;
+    uint32_t end = start + 1;
+    uint32_t used;
+
+    if (*leaf_node_next_leaf(node) != 0 && num_cells > 0) {
+        max_key = *leaf_node_key(node, num_cells - 1);
+    }
+
+    used = cell_size_for_payload(serialized_row_size(&rows[start])) +
+           LEAF_NODE_ENTRY_SIZE;
+    while (end < num_rows && rows[end].id <= max_key) {
+        used += cell_size_for_payload(serialized_row_size(&rows[end])) +
+                LEAF_NODE_ENTRY_SIZE;
+        if (used > LEAF_NODE_SPACE_FOR_CELLS) {
+            break;
+        }
+        end++;
+    }
+    return end;
+}
+
+/*
+ * Whether any of count sorted rows has a key already in the leaf, from
+ * a single merge of the rows with its keys from the cursor on.
+ */
+bool
+leaf_node_has_any(Cursor *cursor, Row *rows, uint32_t count)
+{
+    uint32_t *keys = leaf_node_key(cursor->node, 0);
+    uint32_t  num_cells = *leaf_node_num_cells(cursor->node);
+    uint32_t  i = cursor->cell_num;
+    uint32_t  j = 0;
+
+    while (i < num_cells && j < count) {
+        if (keys[i] == rows[j].id) {
+            return true;
+        }
+        if (keys[i] < rows[j].id) {
+            i++;
+        } else {
+            j++;
+        }
+    }
+
+    return false;
+}
+
+/*
+ * Merge count sorted rows, none of them in the leaf yet and all in its
+ * key range, into the leaf at the cursor, rewriting it once. Rows that
+ * do not fit split it once into as many leaves as it takes, which go
+ * into the parent in order to the right of it. Past the right edge the
+ * leaves are filled; anywhere else they share the cells evenly. The
+ * last leaf is filled to half from the one before it, as a bulk load
+ * does.
+ */
+void
+leaf_node_insert_run(Cursor *cursor, Row *rows, uint32_t count)
+{
+    Pager     *pager = cursor->table->pager;
+    void      *node = cursor->node;
+    uint32_t   num_cells = *leaf_node_num_cells(node);
+    uint32_t   total = num_cells + count;
+    void     **cells = malloc(sizeof(void *) * total);
+    uint32_t  *starts;
+    char       scratch[PAGE_SIZE];
+    char      *cell_data;
+    uint32_t   num_leaves;
+    uint32_t   used = 0;
+    uint32_t   target;
+    uint32_t   size;
+    uint32_t   offset = 0;
+    uint32_t   prev_page_num;
+    uint32_t   i, j, k;
+    bool       append;
+
+    for (j = 0; j < count; j++) {
+        offset += cell_size_for_payload(serialized_row_size(&rows[j]));
+    }
+    cell_data = malloc(offset);
+
+    /* Old and new cells in key order, the old ones copied aside. */
+    memcpy(scratch, node, PAGE_SIZE);
+    offset = 0;
+    for (i = 0, j = 0, k = 0; k < total; k++) {
+        if (j < count && (i == num_cells ||
+                          rows[j].id < *leaf_node_key(scratch, i))) {
+            cells[k] = cell_data + offset;
+            offset += leaf_cell_build(pager, &rows[j++], cells[k]);
+        } else {
+            cells[k] = leaf_node_cell(scratch, i++);
+        }
+        used += leaf_cell_size(cells[k]) + LEAF_NODE_ENTRY_SIZE;
+    }
+    mark_page_dirty(pager, cursor->page_num);
+
+    if (used <= LEAF_NODE_SPACE_FOR_CELLS) {
+        leaf_node_set_cells(node, cells, total);
+        free(cell_data);
+        free(cells);
+        return;
+    }
+
+    append = (*leaf_node_next_leaf(node) == 0 &&
+              (num_cells == 0 ||
+               rows[0].id > *leaf_node_key(scratch, num_cells - 1)));
+    num_leaves = (used + LEAF_NODE_SPACE_FOR_CELLS - 1) /
+                 LEAF_NODE_SPACE_FOR_CELLS;
+    target = append ? LEAF_NODE_SPACE_FOR_CELLS :
+                      (used + num_leaves - 1) / num_leaves;
+
+    starts = malloc(sizeof(uint32_t) * (total + 1));
+    num_leaves = 0;
+    used = 0;
+    for (k = 0; k < total; k++) {
+        size = leaf_cell_size(cells[k]) + LEAF_NODE_ENTRY_SIZE;
+        if (k == 0 || used + size > target) {
+            starts[num_leaves++] = k;
+            used = 0;
+        }
+        used += size;
+    }
+    starts[num_leaves] = total;
+    while (used < target / 2 &&
+           starts[num_leaves - 1] - starts[num_leaves - 2] > 1) {
+        starts[num_leaves - 1]--;
+        used += leaf_cell_size(cells[starts[num_leaves - 1]]) +
+                LEAF_NODE_ENTRY_SIZE;
+    }
+
+    leaf_node_set_cells(node, cells, starts[1]);
+    prev_page_num = cursor->page_num;
+    for (k = 1; k < num_leaves; k++) {
+        void     *prev = get_page(pager, prev_page_num);
+        uint32_t  page_num = get_unused_page_num(pager);
+        void     *new_node = get_page(pager, page_num);
+
+        initialize_leaf_node(new_node);
+        leaf_node_set_cells(new_node, cells + starts[k],
+                            starts[k + 1] - starts[k]);
+        *node_parent(new_node) = *node_parent(prev);
+        *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(prev);
+        *leaf_node_next_leaf(prev) = page_num;
+        mark_page_dirty(pager, prev_page_num);
+        mark_page_dirty(pager, page_num);
+
+        if (is_node_root(prev)) {
+            unpin_page(pager, prev_page_num);
+            create_new_root(cursor->table, page_num);
+        } else {
+            uint32_t parent_page_num = *node_parent(prev);
+            uint32_t prev_max_key = get_node_max_key(pager, prev);
+
+            unpin_page(pager, prev_page_num);
+            internal_node_insert(cursor->table, parent_page_num,
+                                 prev_page_num, prev_max_key, page_num);
+        }
+        unpin_page(pager, page_num);
+
+        /* Let go of finished leaves, so a long run does not fill the pool. */
+        if (prev_page_num != cursor->page_num) {
+            pager_release_latch(pager, prev_page_num);
+        }
+        prev_page_num = page_num;
+    }
+
+    free(starts);
+    free(cell_data);
+    free(cells);
+}
+
+/*
+ * A cursor on the leaf, which the caller has latched, at the key.
+ */
+Cursor *
+leaf_node_find(Table *table, uint32_t page_num, void *node, uint32_t key)
+{
+    uint32_t  num_cells = *leaf_node_num_cells(node);
+    Cursor   *cursor = (Cursor *) malloc(sizeof(Cursor));
+
+    cursor->table = table;
+    cursor->page_num = page_num;
+    cursor->node = node;
+    cursor->end_of_table = false;
+    cursor->prefetch_parent = INVALID_PAGE_NUM;
+    cursor->prefetch_end = 0;
+    cursor->readahead_end = 0;
+    cursor->readahead_window = SCAN_READAHEAD_MIN;
+    cursor->end_key = UINT32_MAX;
+    cursor->cell_num = key_search((uint8_t *) leaf_node_key(node, 0),
+                                  LEAF_NODE_KEY_SIZE, num_cells, key);
+
+    return cursor;
+}
+
+/*
+ * Copy the row with the key out of a leaf nobody has latched, then
+ * check the leaf still has the version it had when it was found. The
+ * leaf may be changing, so everything read from it is checked to stay
+ * inside the page. A row with overflow pages is left to a cursor.
+ */
+PeekResult
+leaf_node_peek_row(Frame *frame, uint64_t version, uint32_t key, Row *row)
+{
+    void      *node = frame->data;
+    uint32_t   num_cells = __atomic_load_n(leaf_node_num_cells(node),
+                                           __ATOMIC_RELAXED);
+    char       payload[ROW_MAX_SIZE];
+    uint32_t   cell_num;
+    uint32_t   offset;
+    uint32_t   payload_size;
+
+    if (num_cells > LEAF_NODE_MAX_CELLS) {
+        return PEEK_FAILED;
+    }
+    cell_num = key_search((uint8_t *) leaf_node_key(node, 0),
+                          LEAF_NODE_KEY_SIZE, num_cells, key);
+    if (cell_num == num_cells || *leaf_node_key(node, cell_num) != key) {
+        return frame_validate(frame, version) ? PEEK_NOT_FOUND : PEEK_FAILED;
+    }
+
+    offset = *(uint16_t *) (node + LEAF_NODE_HEADER_SIZE +
+                            num_cells * LEAF_NODE_KEY_SIZE +
+                            cell_num * LEAF_NODE_SLOT_SIZE);
+    if (offset + LEAF_NODE_PAYLOAD_SIZE_SIZE > PAGE_SIZE) {
+        return PEEK_FAILED;
+    }
+    payload_size = *(uint16_t *) (node + offset);
+    if (payload_size > LEAF_NODE_MAX_LOCAL ||
+        offset + LEAF_NODE_PAYLOAD_SIZE_SIZE + payload_size > PAGE_SIZE) {
+        return PEEK_FAILED;
+    }
+    memcpy(payload, node + offset + LEAF_NODE_PAYLOAD_SIZE_SIZE,
+           payload_size);
+    if (!frame_validate(frame, version)) {
+        return PEEK_FAILED;
+    }
+
+    deserialize_row(payload, row);
+    return PEEK_FOUND;
+}
+
+void
+leaf_node_split_and_insert(Cursor *cursor, void *cell)
+{
+    /*
+     * Create a new node and move the cells past the split point over.
+     * The cells before it stay where they are in the old node.
+     * Insert the new cell in one of the two nodes.
+     * Update parent or create a new parent.
+     */
+    uint32_t  i;
+    Pager    *pager = cursor->table->pager;
+    void     *old_node = cursor->node;
+    uint32_t  num_cells = *leaf_node_num_cells(old_node);
+    uint32_t  new_page_num = get_unused_page_num(pager);
+    void     *new_node = get_page(pager, new_page_num);
+    void     *cells[LEAF_NODE_MAX_CELLS + 1];
+    uint32_t  left_count;
+
+    /* The cells in key order, with the new one in its place. */
+    for (i = 0; i < num_cells; i++) {
+        cells[i < cursor->cell_num ? i : i + 1] = leaf_node_cell(old_node, i);
+    }
+    cells[cursor->cell_num] = cell;
+
+    /*
+     * Appending past the end of the rightmost leaf: keys are arriving in
+     * increasing order, so leave the old leaf full and start the new one
+     * with just the new key rather than leaving two half-empty leaves.
+     */
+    if (*leaf_node_next_leaf(old_node) == 0 && cursor->cell_num == num_cells) {
+        left_count = num_cells;
+    } else {
+        left_count = leaf_split_point(cells, num_cells + 1);
+    }
+
+    initialize_leaf_node(new_node);
+
+    *node_parent(new_node) = *node_parent(old_node);
+    *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
+    *leaf_node_next_leaf(old_node) = new_page_num;
+
+    /* The new leaf copies its cells out before the old one may pack. */
+    leaf_node_set_cells(new_node, cells + left_count,
+                        num_cells + 1 - left_count);
+    if (cursor->cell_num < left_count) {
+        leaf_node_truncate(old_node, left_count - 1);
+        leaf_node_put_cell(old_node, cursor->cell_num, cell,
+                           leaf_cell_size(cell));
+    } else {
+        leaf_node_truncate(old_node, left_count);
+    }
+
+    mark_page_dirty(pager, cursor->page_num);
+    mark_page_dirty(pager, new_page_num);
+    unpin_page(pager, new_page_num);
+
+    if (is_node_root(old_node)) {
+        create_new_root(cursor->table, new_page_num);
+    } else {
+        internal_node_insert(cursor->table, *node_parent(old_node),
+                             cursor->page_num,
+                             get_node_max_key(pager, old_node), new_page_num);
+    }
+}
+
+/*
+ * Remove count cells starting at the cursor, with their overflow pages.
+ * Their space becomes a hole until the leaf is defragmented. When that
+ * takes away the largest key, the separator for the leaf is brought
+ * down to the new largest key. The leaf may be left underfull; see
+ * table_rebalance().
+ */
+void
+leaf_node_delete(Cursor *cursor, uint32_t count)
+{
+    Pager    *pager = cursor->table->pager;
+    void     *node = cursor->node;
+    uint32_t  num_cells = *leaf_node_num_cells(node);
+    uint32_t  end = cursor->cell_num + count;
+    uint16_t *slots = leaf_node_slot(node, 0);
+    void     *new_slots;
+    uint32_t  i;
+
+    for (i = cursor->cell_num; i < end; i++) {
+        void *cell = leaf_node_cell(node, i);
+
+        leaf_cell_free_overflow(pager, cell);
+        *leaf_node_fragmented(node) += leaf_cell_size(cell);
+    }
+
+    /* The keys close up, then the slots follow them down. */
+    memmove(leaf_node_key(node, cursor->cell_num), leaf_node_key(node, end),
+            (size_t) (num_cells - end) * LEAF_NODE_KEY_SIZE);
+    new_slots = (void *) slots - count * LEAF_NODE_KEY_SIZE;
+    memmove(new_slots, slots, (size_t) cursor->cell_num * LEAF_NODE_SLOT_SIZE);
+    memmove(new_slots + cursor->cell_num * LEAF_NODE_SLOT_SIZE, slots + end,
+            (size_t) (num_cells - end) * LEAF_NODE_SLOT_SIZE);
+    *leaf_node_num_cells(node) = num_cells - count;
+    mark_page_dirty(pager, cursor->page_num);
+
+    if (end == num_cells && cursor->cell_num > 0) {
+        update_node_max_key(cursor->table, cursor->page_num,
+                            *leaf_node_key(node, cursor->cell_num - 1));
+    }
+}
+
+/*
+ * Share the cells of the leaves at index and index + 1 of the parent
+ * so that both use about the same space, and set the separator between
+ * them.
+ */
+void
+leaf_node_redistribute(Table *table, uint32_t parent_page_num, uint32_t index)
+{
+    Pager     *pager = table->pager;
+    void      *parent = get_page(pager, parent_page_num);
+    uint32_t   left_page_num = *internal_node_child(parent, index);
+    uint32_t   right_page_num = *internal_node_child(parent, index + 1);
+    void      *left = latch_page(pager, left_page_num);
+    void      *right = latch_page(pager, right_page_num);
+    uint32_t   left_cells = *leaf_node_num_cells(left);
+    uint32_t   right_cells = *leaf_node_num_cells(right);
+    uint32_t   num_cells = left_cells + right_cells;
+    uint32_t   new_left_cells;
+    uint32_t   left_max;
+    uint32_t   right_max;
+    uint32_t   i;
+    char       left_copy[PAGE_SIZE];
+    char       right_copy[PAGE_SIZE];
+    void      *cells[2 * LEAF_NODE_MAX_CELLS];
+
+    memcpy(left_copy, left, PAGE_SIZE);
+    memcpy(right_copy, right, PAGE_SIZE);
+    for (i = 0; i < left_cells; i++) {
+        cells[i] = leaf_node_cell(left_copy, i);
+    }
+    for (i = 0; i < right_cells; i++) {
+        cells[left_cells + i] = leaf_node_cell(right_copy, i);
+    }
+
+    new_left_cells = leaf_split_point(cells, num_cells);
+    leaf_node_set_cells(left, cells, new_left_cells);
+    leaf_node_set_cells(right, cells + new_left_cells,
+                        num_cells - new_left_cells);
+    left_max = *leaf_node_key(left, new_left_cells - 1);
+
+    mark_page_dirty(pager, left_page_num);
+    mark_page_dirty(pager, right_page_num);
+    unlatch_page(pager, left_page_num, left);
+    unpin_page(pager, parent_page_num);
+
+    right_max = *leaf_node_key(right, *leaf_node_num_cells(right) - 1);
+    unlatch_page(pager, right_page_num, right);
+
+    internal_node_set_key(table, parent_page_num, index, left_max);
+
+    /* An emptied leaf's separator still names the key deleted last. */
+    if (right_cells == 0) {
+        update_node_max_key(table, right_page_num, right_max);
+    }
+}
+
+/*
+ * Move every cell of the leaf at index + 1 of the parent into the leaf
+ * at index, unlink the emptied leaf and free its page.
+ */
+void
+leaf_node_merge(Table *table, uint32_t parent_page_num, uint32_t index)
+{
+    Pager     *pager = table->pager;
+    void      *parent = latch_page(pager, parent_page_num);
+    uint32_t   left_page_num = *internal_node_child(parent, index);
+    uint32_t   right_page_num = *internal_node_child(parent, index + 1);
+    void      *left = latch_page(pager, left_page_num);
+    void      *right = latch_page(pager, right_page_num);
+    uint32_t   left_cells = *leaf_node_num_cells(left);
+    uint32_t   right_cells = *leaf_node_num_cells(right);
+    uint32_t   new_max;
+    uint32_t   i;
+
+    for (i = 0; i < right_cells; i++) {
+        void *cell = leaf_node_cell(right, i);
+
+        leaf_node_put_cell(left, left_cells + i, cell, leaf_cell_size(cell));
+    }
+    *leaf_node_next_leaf(left) = *leaf_node_next_leaf(right);
+    new_max = *leaf_node_key(left, left_cells + right_cells - 1);
+
+    internal_node_remove_right(parent, index);
+
+    mark_page_dirty(pager, parent_page_num);
+    mark_page_dirty(pager, left_page_num);
+    unlatch_page(pager, right_page_num, right);
+    unlatch_page(pager, left_page_num, left);
+    unlatch_page(pager, parent_page_num, parent);
+
+    pager_free_page(pager, right_page_num);
+    update_node_max_key(table, left_page_num, new_max);
+}
+
+uint32_t *
+leaf_node_next_leaf(void *node)
+{
+    return node + LEAF_NODE_NEXT_LEAF_OFFSET;
+}
+
+NodeType
+get_node_type(void *node)
+{
+    uint8_t value = *((uint8_t *)(node + NODE_TYPE_OFFSET));
+    return (NodeType) value;
+}
+
+void
+set_node_type(void *node, NodeType type)
+{
+    uint8_t value = type;
+    *((uint8_t *)(node + NODE_TYPE_OFFSET)) = value;
+}
+
+/*
+ * Allocate a page, zeroed. Pages freed earlier are reused first, most
+ * recently freed first; only when the freelist is empty does the file
+ * grow by a page.
+ */
+uint32_t
+get_unused_page_num(Pager *pager)
+{
+    void      *meta = get_page(pager, 0);
+    uint32_t   page_num = *meta_field(meta, META_FREELIST_HEAD_OFFSET);
+    void      *node;
+
+    if (page_num == 0) {
+        unpin_page(pager, 0);
+        /* Claim it now, so the next call returns another page. */
+        pthread_mutex_lock(&pager->lock);
+        page_num = pager->num_pages++;
+        pthread_mutex_unlock(&pager->lock);
+
+        /* The writer keeps its new pages latched, see latch_page(). */
+        node = latch_page(pager, page_num);
+        unlatch_page(pager, page_num, node);
+        return page_num;
+    }
+
+    node = latch_page(pager, page_num);
+    *meta_field(meta, META_FREELIST_HEAD_OFFSET) = *free_page_next(node);
+    *meta_field(meta, META_FREELIST_COUNT_OFFSET) -= 1;
+    memset(node, 0, PAGE_SIZE);
+
+    mark_page_dirty(pager, page_num);
+    unlatch_page(pager, page_num, node);
+    mark_page_dirty(pager, 0);
+    unpin_page(pager, 0);
+
+    return page_num;
+}
+
+/*
+ * Put a page no longer referenced by the tree on the freelist.
+ */
+void
+pager_free_page(Pager *pager, uint32_t page_num)
+{
+    void *meta = get_page(pager, 0);
+    void *node = latch_page(pager, page_num);
+
+    memset(node, 0, PAGE_SIZE);
+    set_node_type(node, NODE_FREE);
+    *free_page_next(node) = *meta_field(meta, META_FREELIST_HEAD_OFFSET);
+    *meta_field(meta, META_FREELIST_HEAD_OFFSET) = page_num;
+    *meta_field(meta, META_FREELIST_COUNT_OFFSET) += 1;
+
+    mark_page_dirty(pager, page_num);
+    unlatch_page(pager, page_num, node);
+    mark_page_dirty(pager, 0);
+    unpin_page(pager, 0);
+}
+
+/*
+ * Return the largest key stored under the node. For an internal node
+ * that is the maximum of its rightmost subtree, so walk down the right
+ * edge until reaching a leaf.
+ */
+uint32_t
+get_node_max_key(Pager *pager, void *node)
+{
+    uint32_t  page_num;
+    uint32_t  max_key;
+
+    if (get_node_type(node) == NODE_LEAF) {
+        return *leaf_node_key(node, *leaf_node_num_cells(node) - 1);
+    }
+
+    page_num = *internal_node_right_child(node);
+    node = get_page(pager, page_num);
+    max_key = get_node_max_key(pager, node);
+    unpin_page(pager, page_num);
+
+    return max_key;
+}
+
+bool
+is_node_root(void *node)
+{
+    uint8_t value = *((uint8_t *) (node + IS_ROOT_OFFSET));
+    return (bool) value;
+}
+
+void
+set_node_root(void *node, bool is_root)
+{
+    uint8_t value = is_root;
+    *((uint8_t *) (node + IS_ROOT_OFFSET)) = value;
+}
+
+void
+create_new_root(Table *table, uint32_t right_child_page_num)
+{
+    /*
+     * Handle splitting the root.
+     * Old root copied to new page, becomes left child.
+     * Address of right child passed in.
+     * Re-initialize root page to contain the new root node.
+     * New root node points to two children.
+     */
+    uint32_t       i;
+    void          *root = latch_page(table->pager, table->root_page_num);
+    void          *right_child = get_page(table->pager, right_child_page_num);
+    uint32_t       left_child_page_num = get_unused_page_num(table->pager);
+    void          *left_child = get_page(table->pager, left_child_page_num);
+    InternalCells  cells;
+
+    /* Left child has data copied from old root. */
+    memcpy(left_child, root, PAGE_SIZE);
+    set_node_root(left_child, false);
+
+    /* An internal left child takes its children along with it. */
+    if (get_node_type(left_child) == NODE_INTERNAL) {
+        for (i = 0; i <= *internal_node_num_keys(left_child); i++) {
+            uint32_t  child_page_num = *internal_node_child(left_child, i);
+            void     *child = get_page(table->pager, child_page_num);
+
+            set_node_parent(child, left_child_page_num);
+            mark_page_dirty(table->pager, child_page_num);
+            unpin_page(table->pager, child_page_num);
+        }
+    }
+
+    /* Root node is a new internal node with one key and two children. */
+    cells.num_keys = 1;
+    cells.keys[0] = get_node_max_key(table->pager, left_child);
+    cells.children[0] = left_child_page_num;
+    cells.children[1] = right_child_page_num;
+    initialize_internal_node(root);
+    set_node_root(root, true);
+    internal_node_write(root, &cells);
+    *node_parent(left_child) = table->root_page_num;
+    *node_parent(right_child) = table->root_page_num;
+
+    mark_page_dirty(table->pager, table->root_page_num);
+    mark_page_dirty(table->pager, left_child_page_num);
+    mark_page_dirty(table->pager, right_child_page_num);
+    unpin_page(table->pager, left_child_page_num);
+    unpin_page(table->pager, right_child_page_num);
+    unlatch_page(table->pager, table->root_page_num, root);
+}
+
+uint32_t *
+node_parent(void *node)
+{
+    return node + PARENT_POINTER_OFFSET;
+}
+
+/*
+ * The parent pointer is only a hint to readers, who check it against
+ * the parent, so the writer updates it in children it has not latched.
+ * These read and write it whole.
+ */
+uint32_t
+get_node_parent(void *node)
+{
+    return __atomic_load_n(node_parent(node), __ATOMIC_RELAXED);
+}
+
+void
+set_node_parent(void *node, uint32_t parent_page_num)
+{
+    __atomic_store_n(node_parent(node), parent_page_num, __ATOMIC_RELAXED);
+}
+
+uint32_t *
+internal_node_num_keys(void *node)
+{
+    return node + INTERNAL_NODE_NUM_KEYS_OFFSET;
+}
+
+uint32_t *
+internal_node_right_child(void *node)
+{
+    return node + INTERNAL_NODE_RIGHT_CHILD_OFFSET;
+}
+
+uint32_t
+internal_node_prefix_length(void *node)
+{
+    return *((uint8_t *) (node + INTERNAL_NODE_PREFIX_LENGTH_OFFSET));
+}
+
+/*
+ * The high-order bytes every key of the node starts with, as a number.
+ */
+uint32_t
+internal_node_prefix(void *node)
+{
+    return read_key_bytes(node + INTERNAL_NODE_HEADER_SIZE,
+                          internal_node_prefix_length(node));
+}
+
+uint32_t
+internal_node_suffix_size(void *node)
+{
+    return INTERNAL_NODE_KEY_SIZE - internal_node_prefix_length(node);
+}
+
+/*
+ * The first byte of the keys' suffixes, which are stored back to back.
+ */
+uint8_t *
+internal_node_suffixes(void *node)
+{
+    return node + INTERNAL_NODE_HEADER_SIZE + internal_node_prefix_length(node);
+}
+
+uint32_t *
+internal_node_child(void *node, uint32_t child_num)
+{
+    uint32_t num_keys = *internal_node_num_keys(node);
+    if (child_num > num_keys) {
+        printf("Tried to access child_num %d > num_keys %d\n", child_num, num_keys);
+        exit(EXIT_FAILURE);
+    } else if (child_num == num_keys) {
+        return internal_node_right_child(node);
     }
 
-    return EXECUTE_UNKNOWN_STMT;
+    return (void *) internal_node_suffixes(node) +
+           num_keys * internal_node_suffix_size(node) +
+           child_num * INTERNAL_NODE_CHILD_SIZE;
 }
 
-Table *
-db_open(const char *filename)
+uint32_t
+internal_node_key(void *node, uint32_t key_num)
 {
-    Pager    *pager = pager_open(filename);
-    Table    *table = (Table *)malloc(sizeof(Table));
+    uint32_t  prefix_length = internal_node_prefix_length(node);
+    uint32_t  suffix_size = INTERNAL_NODE_KEY_SIZE - prefix_length;
+    uint32_t  key = read_key_bytes(internal_node_suffixes(node) +
+                                   key_num * suffix_size, suffix_size);
 
-    table->pager = pager;
-    table->root_page_num = 0;
-
-    if (pager->num_pages == 0) {
-        /* New database file. Initialize page 0 as leaf node. */
-        void *root_node = get_page(pager, 0);
-        initialize_leaf_node(root_node);
-        set_node_root(root_node, true);
+    if (prefix_length > 0) {
+        key |= internal_node_prefix(node) << (8 * suffix_size);
     }
+    return key;
+}
 
-    return table;
+uint32_t
+internal_node_find_child(void *node, uint32_t key)
+{
+    /*
+     * Return the index of the child which should contain
+     * the given key.
+     */
+    return internal_node_search(node, *internal_node_num_keys(node),
+                                internal_node_prefix_length(node), key);
 }
 
-void
-db_close(Table *table)
+/*
+ * internal_node_find_child() with the node's header fields passed in.
+ */
+uint32_t
+internal_node_search(void *node, uint32_t num_keys, uint32_t prefix_length,
+                     uint32_t key)
 {
-    Pager     *pager = table->pager;
-    uint32_t   i;
-    int        result;
+    uint32_t suffix_size = INTERNAL_NODE_KEY_SIZE - prefix_length;
 
-    for (i = 0; i < pager->num_pages; i++) {
-        if (pager->pages[i] == NULL) {
-            continue;
-        }
+    /*
+     * A key outside the prefix sorts before or after every key of the
+     * node. Otherwise only the suffixes need comparing.
+     */
+    if (prefix_length > 0) {
+        uint32_t prefix = read_key_bytes(node + INTERNAL_NODE_HEADER_SIZE,
+                                         prefix_length);
 
-        pager_flush(pager, i);
-        free(pager->pages[i]);
-        pager->pages[i] = NULL;
+        if (key >> (8 * suffix_size) < prefix) {
+            return 0;
+        }
+        if (key >> (8 * suffix_size) > prefix) {
+            return num_keys;
+        }
+        key &= (1u << (8 * suffix_size)) - 1;
     }
 
-    result = close(pager->file_descriptor);
-    if (result == -1) {
-        printf("Error closing db file.\n");
-        exit(EXIT_FAILURE);
+    /* The first key at or past it; there is one more child than key. */
+    return key_search(node + INTERNAL_NODE_HEADER_SIZE + prefix_length,
+                      suffix_size, num_keys, key);
+}
+
+/*
+ * The child of a node nobody has latched that should contain the key.
+ * The node may be changing, so its header is read once and checked to
+ * keep the search inside the page; INVALID_PAGE_NUM if it makes no
+ * sense. The caller validates the node's version before trusting the
+ * child.
+ */
+uint32_t
+internal_node_peek_child(void *node, uint32_t key)
+{
+    uint32_t  num_keys = __atomic_load_n(internal_node_num_keys(node),
+                                         __ATOMIC_RELAXED);
+    uint32_t  prefix_length = __atomic_load_n(
+        (uint8_t *) (node + INTERNAL_NODE_PREFIX_LENGTH_OFFSET),
+        __ATOMIC_RELAXED);
+    uint32_t  index;
+    void     *children;
+
+    if (get_node_type(node) != NODE_INTERNAL ||
+        prefix_length >= INTERNAL_NODE_KEY_SIZE ||
+        num_keys + 1 > internal_node_capacity(prefix_length)) {
+        return INVALID_PAGE_NUM;
     }
 
-    for (i = 0; i < TABLE_MAX_PAGES; i++) {
-        void *page = pager->pages[i];
-        if (page) {
-            free(page);
-            pager->pages[i] = NULL;
-        }
+    index = internal_node_search(node, num_keys, prefix_length, key);
+    if (index == num_keys) {
+        return *internal_node_right_child(node);
     }
-    free(pager);
-    free(table);
+    children = node + INTERNAL_NODE_HEADER_SIZE + prefix_length +
+               num_keys * (INTERNAL_NODE_KEY_SIZE - prefix_length);
+    return *(uint32_t *) (children + index * INTERNAL_NODE_CHILD_SIZE);
 }
 
-void
-serialize_row(Row *source, void *destination)
+/*
+ * Descend from an internal node the caller has latched, latching the
+ * child before letting go of the node. See table_find().
+ */
+Cursor *
+internal_node_find(Table *table, uint32_t page_num, void *node, uint32_t key)
 {
-    char *dest = (char *) destination;
-    memcpy(dest + ID_OFFSET, &(source->id), ID_SIZE);
-    strncpy(dest + USERNAME_OFFSET, source->username, USERNAME_SIZE);
-    strncpy(dest + EMAIL_OFFSET, source->email, EMAIL_SIZE);
+    Pager    *pager = table->pager;
+    uint32_t  child_index = internal_node_find_child(node, key);
+    uint32_t  child_num = *internal_node_child(node, child_index);
+    void     *child = latch_page(pager, child_num);
+
+    if (pager_is_writer(pager) && node_is_safe(table, child)) {
+        pager_release_latches(pager, child_num);
+    }
+    unlatch_page(pager, page_num, node);
+
+    if (get_node_type(child) == NODE_LEAF) {
+        return leaf_node_find(table, child_num, child, key);
+    }
+    return internal_node_find(table, child_num, child, key);
 }
 
-void
-deserialize_row(void *source, Row *destination)
+/*
+ * Whether the writer's change below the node cannot reach it: a leaf
+ * has room for table->write_space more bytes, and an internal node can
+ * take the separator of a split child whatever its prefix becomes.
+ */
+bool
+node_is_safe(Table *table, void *node)
 {
-    char *src = (char *) source;
-    memcpy(&(destination->id), src + ID_OFFSET, ID_SIZE);
-    memcpy(&(destination->username), src + USERNAME_OFFSET, USERNAME_SIZE);
-    memcpy(&(destination->email), src + EMAIL_OFFSET, EMAIL_SIZE);
+    if (get_node_type(node) == NODE_LEAF) {
+        return leaf_node_free_space(node) >= table->write_space;
+    }
+    return table->write_space <= LEAF_NODE_SPACE_FOR_CELLS &&
+           *internal_node_num_keys(node) + 2 <= internal_node_capacity(0);
 }
 
-Pager *
-pager_open(const char *filename)
+/*
+ * The low size bytes of a key, stored low byte first.
+ */
+uint32_t
+read_key_bytes(const uint8_t *src, uint32_t size)
 {
-    int        fd;
-    off_t      file_length;
-    uint32_t   i;
-    Pager     *pager;
-
-    fd = open(filename,
-              O_RDWR |      /* Read/Write mode */
-              O_CREAT,      /* Create file if it does not exist */
-              S_IWUSR |     /* User write permission */
-              S_IRUSR);     /* User Read permission */
+    uint32_t value = 0;
+    uint32_t i;
 
-    if (fd == -1) {
-        printf("Unable to open file\n");
-        exit(EXIT_FAILURE);
+    for (i = 0; i < size; i++) {
+        value |= (uint32_t) src[i] << (8 * i);
     }
+    return value;
+}
 
-    file_length = lseek(fd, 0, SEEK_END);
-
-    pager = malloc(sizeof(Pager));
-    pager->file_descriptor = fd;
-    pager->file_length = file_length;
-    pager->num_pages = (file_length / PAGE_SIZE);
-
-    if (file_length % PAGE_SIZE != 0) {
-        printf("Db file is not a whole number of pages. Corrupt file.\n");
-        exit(EXIT_FAILURE);
-    }
+void
+write_key_bytes(uint8_t *dest, uint32_t value, uint32_t size)
+{
+    uint32_t i;
 
-    for (i = 0; i < TABLE_MAX_PAGES; i++) {
-        pager->pages[i] = NULL;
+    for (i = 0; i < size; i++) {
+        dest[i] = value >> (8 * i);
     }
-
-    return pager;
 }
 
-void *
-get_page(Pager *pager, uint32_t page_num)
+/*
+ * How many of count sorted keys, each width bytes stored low byte
+ * first, are below key, one key at a time. Each comparison adds to the
+ * count instead of branching.
+ */
+uint32_t
+key_count_below_scalar(const uint8_t *keys, uint32_t width, uint32_t count,
+                       uint32_t key)
 {
-    if (page_num > TABLE_MAX_PAGES) {
-        printf("Tried to fetch page number out of bounds. %d > %d\n",
-               page_num, TABLE_MAX_PAGES);
-        exit(EXIT_FAILURE);
-    }
+    uint32_t below = 0;
+    uint32_t i;
 
-    if (pager->pages[page_num] == NULL) {
-        /* Cache miss. Allocate memory and load from file. */
-        void      *page = malloc(PAGE_SIZE);
-        uint32_t   num_pages = pager->file_length / PAGE_SIZE;
+    for (i = 0; i < count; i++) {
+        below += read_key_bytes(keys + i * width, width) < key;
+    }
+    return below;
+}
 
-        /* We might save a partial page at the end of the file. */
-        if (pager->file_length % PAGE_SIZE) {
-            num_pages += 1;
+#if defined(__x86_64__) || defined(__i386__)
+/*
+ * The vector kernels compare a register of keys at a time and count
+ * the lanes below the key. The comparisons are signed, so both sides
+ * have their top bit flipped first to order them as unsigned. Keys of
+ * three bytes are spread into 32-bit lanes. Keys left over, too few to
+ * load a whole register without reading past the last one, are counted
+ * by the scalar kernel.
+ */
+__attribute__((target("sse4.1,popcnt")))
+uint32_t
+key_count_below_sse4(const uint8_t *keys, uint32_t width, uint32_t count,
+                     uint32_t key)
+{
+    const __m128i  spread = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1,
+                                          6, 7, 8, -1, 9, 10, 11, -1);
+    __m128i        bias;
+    __m128i        target;
+    __m128i        block;
+    uint32_t       below = 0;
+    uint32_t       i = 0;
+
+    switch (width) {
+    case 1:
+        bias = _mm_set1_epi8((char) 0x80);
+        target = _mm_xor_si128(_mm_set1_epi8((char) key), bias);
+        for (; i + 16 <= count; i += 16) {
+            block = _mm_loadu_si128((const __m128i *) (keys + i));
+            block = _mm_cmpgt_epi8(target, _mm_xor_si128(block, bias));
+            below += __builtin_popcount(_mm_movemask_epi8(block));
         }
-
-        if (page_num < num_pages) {
-            ssize_t bytes_read;
-            lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
-            bytes_read = read(pager->file_descriptor, page, PAGE_SIZE);
-            if (bytes_read == -1) {
-                printf("Error reading file: %d\n", errno);
-                exit(EXIT_FAILURE);
+        break;
+    case 2:
+        bias = _mm_set1_epi16((short) 0x8000);
+        target = _mm_xor_si128(_mm_set1_epi16((short) key), bias);
+        for (; i + 8 <= count; i += 8) {
+            block = _mm_loadu_si128((const __m128i *) (keys + 2 * i));
+            block = _mm_cmpgt_epi16(target, _mm_xor_si128(block, bias));
+            below += __builtin_popcount(_mm_movemask_epi8(block)) / 2;
+        }
+        break;
+    case 3:
+    case 4:
+        bias = _mm_set1_epi32(INT32_MIN);
+        target = _mm_xor_si128(_mm_set1_epi32((int) key), bias);
+        /* A load takes 16 bytes, so three-byte keys stop 6 short. */
+        for (; i + (width == 3 ? 6 : 4) <= count; i += 4) {
+            block = _mm_loadu_si128((const __m128i *) (keys + width * i));
+            if (width == 3) {
+                block = _mm_shuffle_epi8(block, spread);
             }
+            block = _mm_cmpgt_epi32(target, _mm_xor_si128(block, bias));
+            below += __builtin_popcount(
+                         _mm_movemask_ps(_mm_castsi128_ps(block)));
         }
+        break;
+    }
 
-        pager->pages[page_num] = page;
+    return below + key_count_below_scalar(keys + i * width, width,
+                                          count - i, key);
+}
 
-        if (page_num >= pager->num_pages) {
-            pager->num_pages = page_num + 1;
+__attribute__((target("avx2,popcnt")))
+uint32_t
+key_count_below_avx2(const uint8_t *keys, uint32_t width, uint32_t count,
+                     uint32_t key)
+{
+    const __m256i  spread = _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1,
+                                             6, 7, 8, -1, 9, 10, 11, -1,
+                                             0, 1, 2, -1, 3, 4, 5, -1,
+                                             6, 7, 8, -1, 9, 10, 11, -1);
+    __m256i        bias;
+    __m256i        target;
+    __m256i        block;
+    uint32_t       below = 0;
+    uint32_t       i = 0;
+
+    switch (width) {
+    case 1:
+        bias = _mm256_set1_epi8((char) 0x80);
+        target = _mm256_xor_si256(_mm256_set1_epi8((char) key), bias);
+        for (; i + 32 <= count; i += 32) {
+            block = _mm256_loadu_si256((const __m256i *) (keys + i));
+            block = _mm256_cmpgt_epi8(target, _mm256_xor_si256(block, bias));
+            below += __builtin_popcount(_mm256_movemask_epi8(block));
+        }
+        break;
+    case 2:
+        bias = _mm256_set1_epi16((short) 0x8000);
+        target = _mm256_xor_si256(_mm256_set1_epi16((short) key), bias);
+        for (; i + 16 <= count; i += 16) {
+            block = _mm256_loadu_si256((const __m256i *) (keys + 2 * i));
+            block = _mm256_cmpgt_epi16(target, _mm256_xor_si256(block, bias));
+            below += __builtin_popcount(_mm256_movemask_epi8(block)) / 2;
+        }
+        break;
+    case 3:
+        bias = _mm256_set1_epi32(INT32_MIN);
+        target = _mm256_xor_si256(_mm256_set1_epi32((int) key), bias);
+        /* Two loads of 16 bytes, 12 apart, so stop 10 keys short. */
+        for (; i + 10 <= count; i += 8) {
+            block = _mm256_inserti128_si256(
+                        _mm256_castsi128_si256(_mm_loadu_si128(
+                            (const __m128i *) (keys + 3 * i))),
+                        _mm_loadu_si128((const __m128i *) (keys + 3 * i + 12)),
+                        1);
+            block = _mm256_shuffle_epi8(block, spread);
+            block = _mm256_cmpgt_epi32(target, _mm256_xor_si256(block, bias));
+            below += __builtin_popcount(
+                         _mm256_movemask_ps(_mm256_castsi256_ps(block)));
+        }
+        break;
+    case 4:
+        bias = _mm256_set1_epi32(INT32_MIN);
+        target = _mm256_xor_si256(_mm256_set1_epi32((int) key), bias);
+        for (; i + 8 <= count; i += 8) {
+            block = _mm256_loadu_si256((const __m256i *) (keys + 4 * i));
+            block = _mm256_cmpgt_epi32(target, _mm256_xor_si256(block, bias));
+            below += __builtin_popcount(
+                         _mm256_movemask_ps(_mm256_castsi256_ps(block)));
         }
+        break;
     }
 
-    return pager->pages[page_num];
+    return below + key_count_below_scalar(keys + i * width, width,
+                                          count - i, key);
 }
+#endif
 
+/*
+ * Use the search kernel asked for, or with KEY_SEARCH_AUTO the widest
+ * one the CPU supports. A vector kernel counts a wider window faster
+ * than the binary search would narrow it.
+ */
 void
-pager_flush(Pager* pager, uint32_t page_num)
+key_search_init(KeySearchKernel kernel)
 {
-    off_t	offset;
-    ssize_t  bytes_written;
-    if (pager->pages[page_num] == NULL) {
-        printf("Tried to flush null page\n");
-        exit(EXIT_FAILURE);
+    bool sse4 = false;
+    bool avx2 = false;
+
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    sse4 = __builtin_cpu_supports("sse4.1") &&
+           __builtin_cpu_supports("popcnt");
+    avx2 = __builtin_cpu_supports("avx2") &&
+           __builtin_cpu_supports("popcnt");
+#endif
+
+    if (kernel == KEY_SEARCH_AUTO) {
+        kernel = avx2 ? KEY_SEARCH_AVX2 :
+                 sse4 ? KEY_SEARCH_SSE4 : KEY_SEARCH_SCALAR;
     }
-
-    offset = lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
-
-    if (offset == -1) {
-        printf("Error seeking: %d\n", errno);
-        exit(EXIT_FAILURE);
+    if ((kernel == KEY_SEARCH_AVX2 && !avx2) ||
+        (kernel == KEY_SEARCH_SSE4 && !sse4)) {
+        fprintf(stderr, "Search kernel unsupported, using scalar.\n");
+        kernel = KEY_SEARCH_SCALAR;
     }
 
-    bytes_written =
-        write(pager->file_descriptor, pager->pages[page_num], PAGE_SIZE);
-
-    if (bytes_written == -1) {
-        printf("Error writing: %d\n", errno);
-        exit(EXIT_FAILURE);
+    key_count_below = key_count_below_scalar;
+    key_search_window = SCALAR_SEARCH_WINDOW;
+#if defined(__x86_64__) || defined(__i386__)
+    if (kernel == KEY_SEARCH_SSE4) {
+        key_count_below = key_count_below_sse4;
+        key_search_window = VECTOR_SEARCH_WINDOW;
+    } else if (kernel == KEY_SEARCH_AVX2) {
+        key_count_below = key_count_below_avx2;
+        key_search_window = VECTOR_SEARCH_WINDOW;
     }
+#endif
 }
 
-Cursor *
-table_start(Table *table)
+/*
+ * The position of the first of count sorted keys, each width bytes
+ * stored low byte first, that is not below key. A binary search narrows
+ * the keys down to a window small enough for the kernel to count in a
+ * pass, which takes no branches on the keys.
+ */
+uint32_t
+key_search(const uint8_t *keys, uint32_t width, uint32_t count, uint32_t key)
 {
-    Cursor   *cursor = table_find(table, 0);
-    void     *node = get_page(table->pager, cursor->page_num);
-    uint32_t  num_cells = *leaf_node_num_cells(node);
+    uint32_t min_index = 0;
+    uint32_t max_index = count;
 
-    cursor->end_of_table = (num_cells == 0);
+    while (max_index - min_index > key_search_window) {
+        uint32_t index = (min_index + max_index) / 2;
 
-    return cursor;
+        if (read_key_bytes(keys + index * width, width) >= key) {
+            max_index = index;
+        } else {
+            min_index = index + 1;
+        }
+    }
+
+    return min_index + key_count_below(keys + min_index * width, width,
+                                       max_index - min_index, key);
 }
 
 /*
- * Return the position of the given key.
- * If the key is not present, return the position
- * where it should be inserted.
+ * How many high-order bytes every key from first_key to last_key has
+ * in common. One byte is always left to tell the keys apart.
  */
-Cursor *
-table_find(Table *table, uint32_t key)
+uint32_t
+internal_prefix_length(uint32_t first_key, uint32_t last_key)
 {
-    uint32_t  root_page_num = table->root_page_num;
-    void     *root_node = get_page(table->pager, root_page_num);
+    uint32_t diff = first_key ^ last_key;
+    uint32_t length = 0;
 
-    if (get_node_type(root_node) == NODE_LEAF) {
-        return leaf_node_find(table, root_page_num, key);
-    } else {
-        return internal_node_find(table, root_page_num, key);
+    while (length < INTERNAL_NODE_MAX_PREFIX &&
+           (diff >> (8 * (INTERNAL_NODE_KEY_SIZE - 1 - length))) == 0) {
+        length++;
     }
+    return length;
 }
 
-void
-cursor_advance(Cursor *cursor)
+/*
+ * Children that fit in an internal node whose keys share a prefix of
+ * the given length.
+ */
+uint32_t
+internal_node_capacity(uint32_t prefix_length)
 {
-    uint32_t  page_num = cursor->page_num;
-    void     *node = get_page(cursor->table->pager, page_num);
-
-    cursor->cell_num += 1;
-    if (cursor->cell_num >= (*leaf_node_num_cells(node))) {
-        /* Advance to next leaf node. */
-        uint32_t next_page_num = *leaf_node_next_leaf(node);
-        if (next_page_num == 0) {
-            /* This was rightmost leaf. */
-            cursor->end_of_table = true;
-        } else {
-            cursor->page_num = next_page_num;
-            cursor->cell_num = 0;
-        }
-    }
+    return (INTERNAL_NODE_SPACE_FOR_CELLS - prefix_length) /
+           (INTERNAL_NODE_CELL_SIZE - prefix_length);
 }
 
-void *
-cursor_value(Cursor *cursor)
+bool
+internal_keys_fit(uint32_t *keys, uint32_t num_keys)
 {
-    uint32_t   page_num = cursor->page_num;
-    void      *page = get_page(cursor->table->pager, page_num);
-
-    return leaf_node_value(page, cursor->cell_num);
+    if (num_keys == 0) {
+        return true;
+    }
+    return num_keys + 1 <= internal_node_capacity(
+               internal_prefix_length(keys[0], keys[num_keys - 1]));
 }
 
 void
-initialize_leaf_node(void *node)
+internal_node_read(void *node, InternalCells *cells)
 {
-    set_node_type(node, NODE_LEAF);
-    set_node_root(node, false);
-    *leaf_node_num_cells(node) = 0;
-    *leaf_node_next_leaf(node) = 0; // 0 represents no sibling
-}
+    uint32_t num_keys = *internal_node_num_keys(node);
+    uint32_t i;
 
-void
-initialize_internal_node(void *node)
-{
-    set_node_type(node, NODE_INTERNAL);
-    set_node_root(node, false);
-    *internal_node_num_keys(node) = 0;
+    cells->num_keys = num_keys;
+    for (i = 0; i < num_keys; i++) {
+        cells->keys[i] = internal_node_key(node, i);
+        cells->children[i] = *internal_node_child(node, i);
+    }
+    cells->children[num_keys] = *internal_node_right_child(node);
 }
 
-uint32_t *
-leaf_node_num_cells(void *node)
+/*
+ * Lay out the cells in the node with the longest prefix their keys
+ * share. The caller makes sure they fit; see internal_keys_fit().
+ */
+void
+internal_node_write(void *node, InternalCells *cells)
 {
-    return node + LEAF_NODE_NUM_CELLS_OFFSET;
-}
+    uint32_t  num_keys = cells->num_keys;
+    uint32_t  prefix_length = 0;
+    uint32_t  suffix_size;
+    uint32_t  i;
 
-void *
-leaf_node_cell(void *node, uint32_t cell_num)
-{
-    return node + LEAF_NODE_HEADER_SIZE + cell_num * LEAF_NODE_CELL_SIZE;
-}
+    if (num_keys > 0) {
+        prefix_length = internal_prefix_length(cells->keys[0],
+                                               cells->keys[num_keys - 1]);
+    }
+    suffix_size = INTERNAL_NODE_KEY_SIZE - prefix_length;
 
-uint32_t *
-leaf_node_key(void *node, uint32_t cell_num)
-{
-    return leaf_node_cell(node, cell_num);
+    *internal_node_num_keys(node) = num_keys;
+    *((uint8_t *) (node + INTERNAL_NODE_PREFIX_LENGTH_OFFSET)) = prefix_length;
+    if (prefix_length > 0) {
+        write_key_bytes(node + INTERNAL_NODE_HEADER_SIZE,
+                        cells->keys[0] >> (8 * suffix_size), prefix_length);
+    }
+    for (i = 0; i < num_keys; i++) {
+        write_key_bytes(internal_node_suffixes(node) + i * suffix_size,
+                        cells->keys[i], suffix_size);
+        *internal_node_child(node, i) = cells->children[i];
+    }
+    *internal_node_right_child(node) = cells->children[num_keys];
 }
 
-void *
-leaf_node_value(void *node, uint32_t cell_num)
+/*
+ * Rewrite an internal node written by an older version, whose cells
+ * each held a child and then its key. Before version 3 there was no
+ * prefix and the keys were whole. Either way the keys still fit.
+ */
+void
+internal_node_upgrade(void *node, uint32_t version)
 {
-    return leaf_node_cell(node, cell_num) + LEAF_NODE_KEY_SIZE;
+    uint32_t        old_header_size =
+        INTERNAL_NODE_RIGHT_CHILD_OFFSET + INTERNAL_NODE_RIGHT_CHILD_SIZE;
+    uint32_t        prefix_length = 0;
+    uint32_t        prefix = 0;
+    uint32_t        suffix_size;
+    uint8_t        *old_cell;
+    InternalCells   cells;
+    uint32_t        i;
+
+    if (version >= 3) {
+        old_header_size = INTERNAL_NODE_HEADER_SIZE;
+        prefix_length = internal_node_prefix_length(node);
+        prefix = internal_node_prefix(node);
+    }
+    suffix_size = INTERNAL_NODE_KEY_SIZE - prefix_length;
+
+    cells.num_keys = *internal_node_num_keys(node);
+    for (i = 0; i < cells.num_keys; i++) {
+        old_cell = node + old_header_size + prefix_length +
+                   i * (INTERNAL_NODE_CHILD_SIZE + suffix_size);
+        cells.children[i] = *(uint32_t *) old_cell;
+        cells.keys[i] = read_key_bytes(old_cell + INTERNAL_NODE_CHILD_SIZE,
+                                       suffix_size);
+        if (prefix_length > 0) {
+            cells.keys[i] |= prefix << (8 * suffix_size);
+        }
+    }
+    cells.children[cells.num_keys] = *internal_node_right_child(node);
+    internal_node_write(node, &cells);
 }
 
+/*
+ * Write the cells into an internal node, splitting it when they do not
+ * fit. The right part moves to a new node that is linked into the
+ * parent, which may split in turn. When the cells grew at the right end,
+ * as appends make them, the old node is kept full instead of halved.
+ */
 void
-leaf_node_insert(Cursor *cursor, uint32_t key, Row *value)
+internal_node_store(Table *table, uint32_t page_num, InternalCells *cells,
+                    bool append)
 {
-    void *node = get_page(cursor->table->pager, cursor->page_num);
-
-    uint32_t num_cells = *leaf_node_num_cells(node);
-    if (num_cells >= LEAF_NODE_MAX_CELLS) {
-        /* Node full */
-        leaf_node_split_and_insert(cursor, key, value);
+    Pager         *pager = table->pager;
+    void          *node = latch_page(pager, page_num);
+    uint32_t       num_children = cells->num_keys + 1;
+    uint32_t       left_count;
+    uint32_t       new_page_num;
+    void          *new_node;
+    uint32_t       separator;
+    uint32_t       i;
+    InternalCells  right;
+
+    if (internal_keys_fit(cells->keys, cells->num_keys)) {
+        internal_node_write(node, cells);
+        mark_page_dirty(pager, page_num);
+        unlatch_page(pager, page_num, node);
         return;
     }
 
-    if (cursor->cell_num < num_cells) {
-        /* Make room for new cell */
-        uint32_t i;
-        for (i = num_cells; i > cursor->cell_num; i--) {
-            memcpy(leaf_node_cell(node, i), leaf_node_cell(node, i - 1),
-                   LEAF_NODE_CELL_SIZE);
+    left_count = append ? num_children - 1 : num_children - num_children / 2;
+    right.num_keys = num_children - left_count - 1;
+    memcpy(right.keys, cells->keys + left_count,
+           (size_t) right.num_keys * INTERNAL_NODE_KEY_SIZE);
+    memcpy(right.children, cells->children + left_count,
+           (size_t) (right.num_keys + 1) * INTERNAL_NODE_CHILD_SIZE);
+    separator = cells->keys[left_count - 1];
+    cells->num_keys = left_count - 1;
+
+    new_page_num = get_unused_page_num(pager);
+    new_node = get_page(pager, new_page_num);
+    initialize_internal_node(new_node);
+    *node_parent(new_node) = *node_parent(node);
+    internal_node_write(node, cells);
+    internal_node_write(new_node, &right);
+
+    /* Children that moved, and a new child, point at their new parent. */
+    for (i = 0; i < num_children; i++) {
+        uint32_t  parent = i < left_count ? page_num : new_page_num;
+        void     *child = get_page(pager, cells->children[i]);
+
+        if (get_node_parent(child) != parent) {
+            set_node_parent(child, parent);
+            mark_page_dirty(pager, cells->children[i]);
         }
+        unpin_page(pager, cells->children[i]);
     }
 
-    *(leaf_node_num_cells(node)) += 1;
-    *(leaf_node_key(node, cursor->cell_num)) = key;
-    serialize_row(value, leaf_node_value(node, cursor->cell_num));
-}
-
-Cursor *
-leaf_node_find(Table *table, uint32_t page_num, uint32_t key)
-{
-    uint32_t  min_index = 0;
-    uint32_t  one_past_max_index;
-    void     *node = get_page(table->pager, page_num);
-    uint32_t  num_cells = *leaf_node_num_cells(node);
-    Cursor   *cursor = (Cursor *) malloc(sizeof(Cursor));
-
-    cursor->table = table;
-    cursor->page_num = page_num;
-
-    /* Binary search */
-    one_past_max_index = num_cells;
+    mark_page_dirty(pager, page_num);
+    mark_page_dirty(pager, new_page_num);
+    unpin_page(pager, new_page_num);
 
-    while (one_past_max_index != min_index) {
-        uint32_t index = (min_index + one_past_max_index) / 2;
-        uint32_t key_at_index = *leaf_node_key(node, index);
-        if (key == key_at_index) {
-            cursor->cell_num = index;
-            return cursor;
-        }
+    if (is_node_root(node)) {
+        unlatch_page(pager, page_num, node);
+        create_new_root(table, new_page_num);
+    } else {
+        uint32_t parent_page_num = *node_parent(node);
 
-        if (key < key_at_index) {
-            one_past_max_index = index;
-        } else {
-            min_index = index + 1;
-        }
+        unlatch_page(pager, page_num, node);
+        internal_node_insert(table, parent_page_num, page_num, separator,
+                             new_page_num);
     }
-
-    cursor->cell_num = min_index;
-    return cursor;
 }
 
+/*
+ * Set the key at index in an internal node. A key with the node's
+ * prefix is written in place. Any other key changes the prefix, so the
+ * node is written again, which may split it.
+ */
 void
-leaf_node_split_and_insert(Cursor *cursor, uint32_t key, Row *value)
+internal_node_set_key(Table *table, uint32_t page_num, uint32_t index,
+                      uint32_t key)
 {
-    /*
-     * Create a new node and move half the cells over.
-     * Insert the new value in one of the two nodes.
-     * Update parent or create a new parent.
-     */
-    int32_t   i;
-    void     *old_node = get_page(cursor->table->pager, cursor->page_num);
-    uint32_t  old_max = get_node_max_key(old_node);
-    uint32_t  new_page_num = get_unused_page_num(cursor->table->pager);
-    void     *new_node = get_page(cursor->table->pager, new_page_num);
-
-    initialize_leaf_node(new_node);
-
-    *node_parent(new_node) = *node_parent(old_node);
-    *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
-    *leaf_node_next_leaf(old_node) = new_page_num;
+    Pager         *pager = table->pager;
+    void          *node = latch_page(pager, page_num);
+    uint32_t       prefix_length = internal_node_prefix_length(node);
+    uint32_t       suffix_size = INTERNAL_NODE_KEY_SIZE - prefix_length;
+    InternalCells  cells;
+
+    if (prefix_length == 0 ||
+        key >> (8 * suffix_size) == internal_node_prefix(node)) {
+        write_key_bytes(internal_node_suffixes(node) + index * suffix_size,
+                        key, suffix_size);
+        mark_page_dirty(pager, page_num);
+        unlatch_page(pager, page_num, node);
+        return;
+    }
 
-    /*
-     * All existing keys plus new key should be divided
-     * evenly between old (left) and new (right) nodes.
-     * Starting from the right, move each key to correct position.
-     */
-    for (i = LEAF_NODE_CELL_SIZE; i >= 0; i--) {
-        uint32_t  index_within_node;
-        void     *destination;
-        void     *destination_node;
+    internal_node_read(node, &cells);
+    unlatch_page(pager, page_num, node);
+    cells.keys[index] = key;
+    internal_node_store(table, page_num, &cells, false);
+}
 
-        if (i >= LEAF_NODE_LEFT_SPLIT_COUNT) {
-            destination_node = new_node;
-        } else {
-            destination_node = old_node;
-        }
+/*
+ * A child of the parent split: child_page_num now holds the keys up to
+ * child_max_key and new_child_page_num, its new right neighbour, the
+ * rest. Add the new child and its separator to the parent.
+ */
+void
+internal_node_insert(Table *table, uint32_t parent_page_num,
+                     uint32_t child_page_num, uint32_t child_max_key,
+                     uint32_t new_child_page_num)
+{
+    void          *parent = latch_page(table->pager, parent_page_num);
+    uint32_t       index = internal_node_child_index(parent, child_page_num);
+    uint32_t       num_keys = *internal_node_num_keys(parent);
+    InternalCells  cells;
+
+    internal_node_read(parent, &cells);
+    unlatch_page(table->pager, parent_page_num, parent);
+
+    memmove(cells.keys + index + 1, cells.keys + index,
+            (size_t) (num_keys - index) * INTERNAL_NODE_KEY_SIZE);
+    memmove(cells.children + index + 2, cells.children + index + 1,
+            (size_t) (num_keys - index) * INTERNAL_NODE_CHILD_SIZE);
+    cells.keys[index] = child_max_key;
+    cells.children[index + 1] = new_child_page_num;
+    cells.num_keys = num_keys + 1;
+
+    internal_node_store(table, parent_page_num, &cells, index == num_keys);
+}
 
-        index_within_node = i % LEAF_NODE_LEFT_SPLIT_COUNT;
-        destination = leaf_node_cell(destination_node, index_within_node);
+/*
+ * Position of a child among the children of an internal node.
+ */
+uint32_t
+internal_node_child_index(void *node, uint32_t child_page_num)
+{
+    uint32_t num_keys = *internal_node_num_keys(node);
+    uint32_t i;
 
-        if ((uint32_t) i == cursor->cell_num) {
-            serialize_row(value,
-                          leaf_node_value(destination_node, index_within_node));
-            *leaf_node_key(destination_node, index_within_node) = key;
-        } else if ((uint32_t) i > cursor->cell_num) {
-            memcpy(destination, leaf_node_cell(old_node, i - 1), LEAF_NODE_CELL_SIZE);
-        } else {
-            memcpy(destination, leaf_node_cell(old_node, i), LEAF_NODE_CELL_SIZE);
+    for (i = 0; i < num_keys; i++) {
+        if (*internal_node_child(node, i) == child_page_num) {
+            return i;
         }
     }
-
-    /* Update cell count on both leaf nodes. */
-    *(leaf_node_num_cells(old_node)) = LEAF_NODE_LEFT_SPLIT_COUNT;
-    *(leaf_node_num_cells(new_node)) = LEAF_NODE_RIGHT_SPLIT_COUNT;
-
-    if (is_node_root(old_node)) {
-        return create_new_root(cursor->table, new_page_num);
-    } else {
-        uint32_t   parent_page_num = *node_parent(old_node);
-        uint32_t   new_max = get_node_max_key(old_node);
-        void      *parent = get_page(cursor->table->pager, parent_page_num);
-
-        update_internal_node_key(parent, old_max, new_max);
-        internal_node_insert(cursor->table, parent_page_num, new_page_num);
+    if (*internal_node_right_child(node) != child_page_num) {
+        printf("Page %d is not a child of its parent\n", child_page_num);
+        exit(EXIT_FAILURE);
     }
-}
 
-uint32_t *
-leaf_node_next_leaf(void *node)
-{
-    return node + LEAF_NODE_NEXT_LEAF_OFFSET;
+    return num_keys;
 }
 
-NodeType
-get_node_type(void *node)
+/*
+ * Drop the child at index + 1 after its entries moved into the child at
+ * index. The merged child takes the dropped one's place, keeping its
+ * separator, which is still the largest key under the pair. The keys
+ * left span no more than before, so they still fit.
+ */
+void
+internal_node_remove_right(void *node, uint32_t index)
 {
-    uint8_t value = *((uint8_t *)(node + NODE_TYPE_OFFSET));
-    return (NodeType) value;
+    uint32_t       num_keys = *internal_node_num_keys(node);
+    InternalCells  cells;
+
+    internal_node_read(node, &cells);
+    cells.children[index + 1] = cells.children[index];
+    memmove(cells.keys + index, cells.keys + index + 1,
+            (size_t) (num_keys - index - 1) * INTERNAL_NODE_KEY_SIZE);
+    memmove(cells.children + index, cells.children + index + 1,
+            (size_t) (num_keys - index) * INTERNAL_NODE_CHILD_SIZE);
+    cells.num_keys = num_keys - 1;
+    internal_node_write(node, &cells);
 }
 
+/*
+ * Even out the children of the internal nodes at index and index + 1 of
+ * the parent. Their keys, with the separator between them, are cut as
+ * near the middle as lets both halves fit, and the key at the cut moves
+ * up as the new separator. The old cut fits, so one is always found
+ * between the middle and it.
+ */
 void
-set_node_type(void *node, NodeType type)
+internal_node_redistribute(Table *table, uint32_t parent_page_num,
+                           uint32_t index)
 {
-    uint8_t value = type;
-    *((uint8_t *)(node + NODE_TYPE_OFFSET)) = value;
+    Pager         *pager = table->pager;
+    void          *parent = get_page(pager, parent_page_num);
+    uint32_t       left_page_num = *internal_node_child(parent, index);
+    uint32_t       right_page_num = *internal_node_child(parent, index + 1);
+    void          *left = latch_page(pager, left_page_num);
+    void          *right = latch_page(pager, right_page_num);
+    uint32_t       left_keys = *internal_node_num_keys(left);
+    uint32_t       num_children;
+    uint32_t       left_count;
+    uint32_t       separator;
+    uint32_t       first;
+    uint32_t       end;
+    uint32_t       i;
+    InternalCells  cells;
+    InternalCells  right_cells;
+
+    internal_node_read(left, &cells);
+    internal_node_read(right, &right_cells);
+    cells.keys[left_keys] = internal_node_key(parent, index);
+    memcpy(cells.keys + left_keys + 1, right_cells.keys,
+           (size_t) right_cells.num_keys * INTERNAL_NODE_KEY_SIZE);
+    memcpy(cells.children + left_keys + 1, right_cells.children,
+           (size_t) (right_cells.num_keys + 1) * INTERNAL_NODE_CHILD_SIZE);
+    cells.num_keys = left_keys + 1 + right_cells.num_keys;
+    num_children = cells.num_keys + 1;
+    unpin_page(pager, parent_page_num);
+
+    left_count = num_children / 2;
+    while (!internal_keys_fit(cells.keys, left_count - 1)) {
+        left_count--;
+    }
+    while (!internal_keys_fit(cells.keys + left_count,
+                              num_children - left_count - 1)) {
+        left_count++;
+    }
+
+    right_cells.num_keys = num_children - left_count - 1;
+    memcpy(right_cells.keys, cells.keys + left_count,
+           (size_t) right_cells.num_keys * INTERNAL_NODE_KEY_SIZE);
+    memcpy(right_cells.children, cells.children + left_count,
+           (size_t) (right_cells.num_keys + 1) * INTERNAL_NODE_CHILD_SIZE);
+    separator = cells.keys[left_count - 1];
+    cells.num_keys = left_count - 1;
+    internal_node_write(left, &cells);
+    internal_node_write(right, &right_cells);
+
+    /* The children between the old cut and the new one changed sides. */
+    first = left_count < left_keys + 1 ? left_count : left_keys + 1;
+    end = left_count < left_keys + 1 ? left_keys + 1 : left_count;
+    for (i = first; i < end; i++) {
+        void *child = get_page(pager, cells.children[i]);
+
+        set_node_parent(child, i < left_count ? left_page_num : right_page_num);
+        mark_page_dirty(pager, cells.children[i]);
+        unpin_page(pager, cells.children[i]);
+    }
+
+    mark_page_dirty(pager, left_page_num);
+    mark_page_dirty(pager, right_page_num);
+    unlatch_page(pager, right_page_num, right);
+    unlatch_page(pager, left_page_num, left);
+
+    internal_node_set_key(table, parent_page_num, index, separator);
 }
 
 /*
- * Until we start recycling free pages, new pages will always
- * go onto the end of the database file.
+ * Move every child of the internal node at index + 1 of the parent into
+ * the one at index, with the separator between them, and free the
+ * emptied node's page. The caller checked that they fit together.
  */
-uint32_t
-get_unused_page_num(Pager *pager)
+void
+internal_node_merge(Table *table, uint32_t parent_page_num, uint32_t index)
 {
-    return pager->num_pages;
+    Pager         *pager = table->pager;
+    void          *parent = latch_page(pager, parent_page_num);
+    uint32_t       left_page_num = *internal_node_child(parent, index);
+    uint32_t       right_page_num = *internal_node_child(parent, index + 1);
+    void          *left = latch_page(pager, left_page_num);
+    void          *right = latch_page(pager, right_page_num);
+    uint32_t       left_keys = *internal_node_num_keys(left);
+    uint32_t       i;
+    InternalCells  cells;
+    InternalCells  right_cells;
+
+    internal_node_read(left, &cells);
+    internal_node_read(right, &right_cells);
+    cells.keys[left_keys] = internal_node_key(parent, index);
+    memcpy(cells.keys + left_keys + 1, right_cells.keys,
+           (size_t) right_cells.num_keys * INTERNAL_NODE_KEY_SIZE);
+    memcpy(cells.children + left_keys + 1, right_cells.children,
+           (size_t) (right_cells.num_keys + 1) * INTERNAL_NODE_CHILD_SIZE);
+    cells.num_keys = left_keys + 1 + right_cells.num_keys;
+    internal_node_write(left, &cells);
+
+    internal_node_remove_right(parent, index);
+
+    mark_page_dirty(pager, parent_page_num);
+    mark_page_dirty(pager, left_page_num);
+    unlatch_page(pager, right_page_num, right);
+    unlatch_page(pager, parent_page_num, parent);
+
+    for (i = left_keys + 1; i <= cells.num_keys; i++) {
+        void *child = get_page(pager, cells.children[i]);
+
+        set_node_parent(child, left_page_num);
+        mark_page_dirty(pager, cells.children[i]);
+        unpin_page(pager, cells.children[i]);
+    }
+    unlatch_page(pager, left_page_num, left);
+
+    pager_free_page(pager, right_page_num);
 }
 
-uint32_t
-get_node_max_key(void *node)
+/*
+ * Set the largest key under a node, kept by the parent as the node's
+ * separator, or by a further ancestor when the node is a right child.
+ */
+void
+update_node_max_key(Table *table, uint32_t page_num, uint32_t new_max)
 {
-    switch (get_node_type(node)) {
-    case NODE_INTERNAL:
-        return *internal_node_key(node, *internal_node_num_keys(node) - 1);
-    case NODE_LEAF:
-        return *leaf_node_key(node, *leaf_node_num_cells(node) - 1);
+    Pager     *pager = table->pager;
+    void      *node = get_page(pager, page_num);
+    uint32_t   parent_page_num;
+    void      *parent;
+    uint32_t   index;
+
+    while (!is_node_root(node)) {
+        parent_page_num = *node_parent(node);
+        parent = get_page(pager, parent_page_num);
+        unpin_page(pager, page_num);
+
+        index = internal_node_child_index(parent, page_num);
+        if (index < *internal_node_num_keys(parent)) {
+            unpin_page(pager, parent_page_num);
+            internal_node_set_key(table, parent_page_num, index, new_max);
+            return;
+        }
+
+        page_num = parent_page_num;
+        node = parent;
     }
+
+    unpin_page(pager, page_num);
 }
 
-bool
-is_node_root(void *node)
+/*
+ * Listen on a Unix domain socket at the path, or on the TCP port of the
+ * loopback address when there is no path.
+ */
+int
+server_listen(const char *socket_path, uint32_t port)
 {
-    uint8_t value = *((uint8_t *) (node + IS_ROOT_OFFSET));
-    return (bool) value;
+    struct sockaddr_un  unix_address;
+    struct sockaddr_in  tcp_address;
+    struct sockaddr    *address;
+    socklen_t           address_length;
+    int                 fd;
+    int                 on = 1;
+
+    if (socket_path != NULL) {
+        if (strlen(socket_path) >= sizeof(unix_address.sun_path)) {
+            printf("Socket path is too long.\n");
+            exit(EXIT_FAILURE);
+        }
+        memset(&unix_address, 0, sizeof(unix_address));
+        unix_address.sun_family = AF_UNIX;
+        strcpy(unix_address.sun_path, socket_path);
+        unlink(socket_path);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        address = (struct sockaddr *) &unix_address;
+        address_length = sizeof(unix_address);
+    } else {
+        memset(&tcp_address, 0, sizeof(tcp_address));
+        tcp_address.sin_family = AF_INET;
+        tcp_address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        tcp_address.sin_port = htons(port);
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        address = (struct sockaddr *) &tcp_address;
+        address_length = sizeof(tcp_address);
+    }
+
+    if (fd == -1 || bind(fd, address, address_length) == -1 ||
+        listen(fd, SOMAXCONN) == -1) {
+        printf("Unable to listen: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    return fd;
 }
 
+volatile sig_atomic_t server_stopping = 0;
+
 void
-set_node_root(void *node, bool is_root)
+server_stop(int signal_number)
 {
-    uint8_t value = is_root;
-    *((uint8_t *) (node + IS_ROOT_OFFSET)) = value;
+    unused(signal_number);
+    server_stopping = 1;
 }
 
+/*
+ * Serve the default table until SIGINT or SIGTERM. One thread waits on
+ * every connection with epoll and answers whatever requests have
+ * arrived, see server_handle_requests().
+ */
 void
-create_new_root(Table *table, uint32_t right_child_page_num)
+server_run(Database *db, int listen_fd)
 {
-    /*
-     * Handle splitting the root.
-     * Old root copied to new page, becomes left child.
-     * Address of right child passed in.
-     * Re-initialize root page to contain the new root node.
-     * New root node points to two children.
-     */
-    uint32_t  left_child_max_key;
-    void     *root = get_page(table->pager, table->root_page_num);
-    void     *right_child = get_page(table->pager, right_child_page_num);
-    uint32_t  left_child_page_num = get_unused_page_num(table->pager);
-    void     *left_child = get_page(table->pager, left_child_page_num);
+    Table              *table = db_table(db, DEFAULT_TABLE_NAME);
+    struct epoll_event  events[SERVER_MAX_EVENTS];
+    struct epoll_event  event;
+    struct sigaction    action;
+    int                 epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    int                 num_events;
+    int                 i;
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = server_stop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    action.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &action, NULL);
+
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event);
+
+    while (!server_stopping) {
+        num_events = epoll_wait(epoll_fd, events, SERVER_MAX_EVENTS, -1);
+        if (num_events == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            printf("Error waiting for connections: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
 
-    /* Left child has data copied from old root. */
-    memcpy(left_child, root, PAGE_SIZE);
-    set_node_root(left_child, false);
+        for (i = 0; i < num_events; i++) {
+            Connection *connection = events[i].data.ptr;
 
-    /* Root node is a new internal node with one key and two children. */
-    initialize_internal_node(root);
-    set_node_root(root, true);
-    *internal_node_num_keys(root) = 1;
-    *internal_node_child(root, 0) = left_child_page_num;
-    left_child_max_key = get_node_max_key(left_child);
-    *internal_node_key(root, 0) = left_child_max_key;
-    *internal_node_right_child(root) = right_child_page_num;
-    *node_parent(left_child) = table->root_page_num;
-    *node_parent(right_child) = table->root_page_num;
-}
+            if (connection == NULL) {
+                server_accept(epoll_fd, listen_fd);
+                continue;
+            }
+            if (((events[i].events & EPOLLIN) && !server_read(connection)) ||
+                (events[i].events & EPOLLERR) ||
+                !server_service(table, epoll_fd, connection) ||
+                connection->events == 0) {
+                server_close(connection);
+            }
+        }
+    }
 
-uint32_t *
-node_parent(void *node)
-{
-    return node + PARENT_POINTER_OFFSET;
+    close(epoll_fd);
+    close(listen_fd);
 }
 
-uint32_t *
-internal_node_num_keys(void *node)
+void
+server_accept(int epoll_fd, int listen_fd)
 {
-    return node + INTERNAL_NODE_NUM_KEYS_OFFSET;
+    struct epoll_event  event;
+    Connection         *connection;
+    int                 fd;
+    int                 on = 1;
+
+    while ((fd = accept4(listen_fd, NULL, NULL,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+        /* Replies are small; send each burst of them at once. */
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+        connection = calloc(1, sizeof(Connection));
+        connection->fd = fd;
+        connection->events = EPOLLIN;
+        event.events = connection->events;
+        event.data.ptr = connection;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+    }
 }
 
-uint32_t *
-internal_node_right_child(void *node)
+/*
+ * Read what has arrived on the connection. Returns false if it failed.
+ */
+bool
+server_read(Connection *connection)
 {
-    return node + INTERNAL_NODE_RIGHT_CHILD_OFFSET;
-}
+    ssize_t bytes_read;
 
-uint32_t *
-internal_node_cell(void *node, uint32_t cell_num)
-{
-    return node + INTERNAL_NODE_HEADER_SIZE + cell_num * INTERNAL_NODE_CELL_SIZE;
+    while (true) {
+        row_buffer_reserve(&connection->in, SERVER_READ_SIZE);
+        bytes_read = read(connection->fd,
+                          connection->in.data + connection->in.length,
+                          connection->in.capacity - connection->in.length);
+        if (bytes_read > 0) {
+            connection->in.length += bytes_read;
+            if (connection->in.length >= SERVER_BUFFER_LIMIT) {
+                return true;
+            }
+        } else if (bytes_read == 0) {
+            connection->closed = true;
+            return true;
+        } else {
+            return errno == EAGAIN || errno == EINTR;
+        }
+    }
 }
 
-uint32_t *
-internal_node_child(void *node, uint32_t child_num)
+/*
+ * Answer the requests read so far and write out the replies, as much
+ * as the socket takes. A connection with many replies left to write
+ * stops reading until they are written. Returns false if the
+ * connection failed; one that is left waiting for nothing is done.
+ */
+bool
+server_service(Table *table, int epoll_fd, Connection *connection)
 {
-    uint32_t num_keys = *internal_node_num_keys(node);
-    if (child_num > num_keys) {
-        printf("Tried to access child_num %d > num_keys %d\n", child_num, num_keys);
-        exit(EXIT_FAILURE);
-    } else if (child_num == num_keys) {
-        return internal_node_right_child(node);
+    struct epoll_event  event;
+    ssize_t             bytes_written;
+    uint32_t            events;
+
+    while (true) {
+        if (connection->out.length - connection->sent < SERVER_BUFFER_LIMIT &&
+            !server_handle_requests(table, connection)) {
+            return false;
+        }
+        if (connection->sent == connection->out.length) {
+            break;
+        }
+        bytes_written = send(connection->fd,
+                             connection->out.data + connection->sent,
+                             connection->out.length - connection->sent,
+                             MSG_NOSIGNAL);
+        if (bytes_written == -1) {
+            if (errno != EAGAIN && errno != EINTR) {
+                return false;
+            }
+            break;
+        }
+        connection->sent += bytes_written;
+        if (connection->sent == connection->out.length) {
+            connection->sent = 0;
+            connection->out.length = 0;
+        }
     }
 
-    return internal_node_cell(node, child_num);
+    events = !connection->closed &&
+             connection->out.length - connection->sent < SERVER_BUFFER_LIMIT ?
+             EPOLLIN : 0;
+    if (connection->sent < connection->out.length) {
+        events |= EPOLLOUT;
+    }
+    if (events != connection->events) {
+        connection->events = events;
+        event.events = events;
+        event.data.ptr = connection;
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, connection->fd, &event);
+    }
+    return true;
 }
 
-uint32_t *
-internal_node_key(void *node, uint32_t key_num)
+/*
+ * Answer every whole request read so far, in order. The writes among
+ * them are committed together, once, before any of their replies is
+ * sent, so a client that sends many inserts without waiting pays for
+ * one commit rather than one each. Returns false if a frame is too
+ * long to be a request.
+ */
+bool
+server_handle_requests(Table *table, Connection *connection)
 {
-    return (void *)internal_node_cell(node, key_num) + INTERNAL_NODE_CHILD_SIZE;
+    RowBuffer  *in = &connection->in;
+    size_t      done = 0;
+    uint32_t    length;
+    bool        writing = false;
+    bool        valid = true;
+
+    while (in->length - done >= sizeof(uint32_t) &&
+           connection->out.length - connection->sent < SERVER_BUFFER_LIMIT) {
+        memcpy(&length, in->data + done, sizeof(uint32_t));
+        if (length == 0 || length > WIRE_MAX_FRAME) {
+            valid = false;
+            break;
+        }
+        if (in->length - done - sizeof(uint32_t) < length) {
+            break;
+        }
+        server_request(table, connection, in->data + done + sizeof(uint32_t),
+                       length, &writing);
+        done += sizeof(uint32_t) + length;
+    }
+
+    if (writing) {
+        pager_commit(table->pager);
+        pthread_mutex_unlock(&table->pager->write_lock);
+    }
+    memmove(in->data, in->data + done, in->length - done);
+    in->length -= done;
+    return valid;
 }
 
-uint32_t
-internal_node_find_child(void *node, uint32_t key)
+/*
+ * Answer one request and queue its reply. The first write takes
+ * write_lock and sets writing; the caller commits and lets go of it.
+ */
+void
+server_request(Table *table, Connection *connection, char *frame,
+               uint32_t length, bool *writing)
 {
-    /*
-     * Return the index of the child which should contain
-     * the given key.
-     */
-    uint32_t num_keys = *internal_node_num_keys(node);
-
-    /* Binary search. */
-    uint32_t min_index = 0;
-    uint32_t max_index = num_keys; /* there is one more child than key */
-
-    while (min_index != max_index) {
-        uint32_t index = (min_index + max_index) / 2;
-        uint32_t key_to_right = *internal_node_key(node, index);
-        if (key_to_right >= key) {
-            max_index = index;
+    RowBuffer     *out = &connection->out;
+    size_t         start = wire_begin_reply(out);
+    char          *body = frame + 1;
+    size_t         size = length - 1;
+    WireStatus     status = WIRE_OK;
+    ExecuteResult  result;
+    Cursor        *cursor;
+    Row            row;
+    Row           *rows;
+    uint32_t       num_rows = 1;
+    uint32_t       first_id;
+    uint32_t       last_id;
+    uint32_t       key;
+    uint32_t       count = 0;
+    uint32_t       i;
+    size_t         used;
+
+    switch (frame[0]) {
+    case WIRE_INSERT:
+    case WIRE_BATCH:
+        if (frame[0] == WIRE_BATCH) {
+            if (size < sizeof(uint32_t)) {
+                status = WIRE_BAD_REQUEST;
+                break;
+            }
+            memcpy(&num_rows, body, sizeof(uint32_t));
+            body += sizeof(uint32_t);
+            size -= sizeof(uint32_t);
+            /* Each row takes at least ROW_MIN_SIZE bytes. */
+            if (num_rows == 0 || num_rows > size / ROW_MIN_SIZE) {
+                status = WIRE_BAD_REQUEST;
+                break;
+            }
+        }
+        rows = malloc(sizeof(Row) * num_rows);
+        for (i = 0; i < num_rows; i++) {
+            used = wire_read_row(body, size, &rows[i]);
+            if (used == 0) {
+                break;
+            }
+            body += used;
+            size -= used;
+        }
+        if (i < num_rows || size != 0) {
+            status = WIRE_BAD_REQUEST;
+        } else if (table->pager->read_only) {
+            status = WIRE_READ_ONLY;
         } else {
-            min_index = index + 1;
+            if (!*writing) {
+                pthread_mutex_lock(&table->pager->write_lock);
+                *writing = true;
+            }
+            if (num_rows == 1) {
+                result = table_insert(table, rows);
+            } else {
+                result = table_insert_batch(table, rows, num_rows);
+            }
+            if (result == EXECUTE_SUCCESS) {
+                table_index_rows(table, rows, num_rows);
+            }
+            status = result == EXECUTE_SUCCESS ? WIRE_OK :
+                     result == EXECUTE_DUPLICATE_KEY ? WIRE_DUPLICATE_KEY :
+                     WIRE_TABLE_FULL;
+        }
+        free(rows);
+        break;
+    case WIRE_GET:
+        if (size != sizeof(uint32_t)) {
+            status = WIRE_BAD_REQUEST;
+            break;
+        }
+        memcpy(&first_id, body, sizeof(uint32_t));
+        if (table_get_row(table, first_id, &row)) {
+            wire_write_row(out, &row);
+        } else {
+            status = WIRE_NOT_FOUND;
+        }
+        break;
+    case WIRE_RANGE:
+        if (size != 2 * sizeof(uint32_t)) {
+            status = WIRE_BAD_REQUEST;
+            break;
+        }
+        memcpy(&first_id, body, sizeof(uint32_t));
+        memcpy(&last_id, body + sizeof(uint32_t), sizeof(uint32_t));
+        if (last_id < first_id) {
+            status = WIRE_BAD_REQUEST;
+            break;
         }
+        row_buffer_reserve(out, sizeof(uint32_t));
+        out->length += sizeof(uint32_t);
+
+        /* As table_scan(), but a reply holds at most about a buffer. */
+        cursor = table_find(table, first_id);
+        cursor->end_key = last_id;
+        cursor->end_of_table =
+            cursor->cell_num >= *leaf_node_num_cells(cursor->node);
+        cursor_prefetch(cursor);
+        while (!cursor->end_of_table) {
+            key = *leaf_node_key(cursor->node, cursor->cell_num);
+            if (key > last_id) {
+                break;
+            }
+            if (out->length - start >= SERVER_BUFFER_LIMIT) {
+                status = WIRE_MORE;
+                break;
+            }
+            cursor_read_row(cursor, &row);
+            wire_write_row(out, &row);
+            count++;
+            if (key == last_id) {
+                break;
+            }
+            cursor_advance(cursor);
+        }
+        cursor_free(cursor);
+        memcpy(out->data + start + sizeof(uint32_t) + 1, &count,
+               sizeof(uint32_t));
+        break;
+    default:
+        status = WIRE_BAD_REQUEST;
+        break;
     }
 
-    return min_index;
+    if (status != WIRE_OK && status != WIRE_MORE) {
+        out->length = start + sizeof(uint32_t) + 1;
+    }
+    wire_end_reply(out, start, status);
 }
 
-Cursor *
-internal_node_find(Table *table, uint32_t page_num, uint32_t key)
+void
+server_close(Connection *connection)
 {
-    void     *node = get_page(table->pager, page_num);
-    uint32_t  child_index = internal_node_find_child(node, key);
-    uint32_t  child_num = *internal_node_child(node, child_index);
-    void     *child = get_page(table->pager, child_num);
-    switch (get_node_type(child)) {
-    case NODE_LEAF:
-        return leaf_node_find(table, child_num, key);
-    case NODE_INTERNAL:
-        return internal_node_find(table, child_num, key);
+    close(connection->fd);
+    free(connection->in.data);
+    free(connection->out.data);
+    free(connection);
+}
+
+/*
+ * Read a row as serialize_row() writes it from at most size bytes.
+ * Returns the bytes it took, or 0 if they do not hold a valid row.
+ */
+size_t
+wire_read_row(char *source, size_t size, Row *row)
+{
+    uint32_t  id;
+    uint16_t  username_length;
+    uint16_t  email_length;
+
+    if (size < ROW_MIN_SIZE) {
+        return 0;
+    }
+    /* The prompt prints and parses ids as ints. */
+    memcpy(&id, source, ID_SIZE);
+    if (id > INT_MAX) {
+        return 0;
     }
+    memcpy(&username_length, source + ID_SIZE, LENGTH_SIZE);
+    if (username_length > COLUMN_USERNAME_SIZE ||
+        size < ROW_MIN_SIZE + username_length) {
+        return 0;
+    }
+    memcpy(&email_length, source + ID_SIZE + LENGTH_SIZE + username_length,
+           LENGTH_SIZE);
+    if (email_length > COLUMN_EMAIL_SIZE ||
+        size < ROW_MIN_SIZE + username_length + email_length) {
+        return 0;
+    }
+
+    deserialize_row(source, row);
+    return ROW_MIN_SIZE + username_length + email_length;
 }
 
 void
-internal_node_insert(Table *table, uint32_t parent_page_num,
-                     uint32_t child_page_num)
+wire_write_row(RowBuffer *out, Row *row)
 {
-    /*
-     * Add a new child/key pair to parent that corresponds to child.
-     */
-    void     *right_child;
-    void     *parent = get_page(table->pager, parent_page_num);
-    void     *child = get_page(table->pager, child_page_num);
-    uint32_t  right_child_page_num;
-    uint32_t  child_max_key = get_node_max_key(child);
-    uint32_t  index = internal_node_find_child(parent, child_max_key);
-    uint32_t  original_num_keys = *internal_node_num_keys(parent);
-
-    *internal_node_num_keys(parent) = original_num_keys + 1;
-
-    if (original_num_keys >= INTERNAL_NODE_MAX_CELLS) {
-        printf("Need to implement splitting internal node\n");
-        exit(EXIT_FAILURE);
-    }
+    uint32_t size = serialized_row_size(row);
 
-    right_child_page_num = *internal_node_right_child(parent);
-    right_child = get_page(table->pager, right_child_page_num);
+    row_buffer_reserve(out, size);
+    serialize_row(row, out->data + out->length);
+    out->length += size;
+}
 
-    if (child_max_key > get_node_max_key(right_child)) {
-        /* Replace right child. */
-        *internal_node_child(parent, original_num_keys) = right_child_page_num;
-        *internal_node_key(parent, original_num_keys) =
-            get_node_max_key(right_child);
-        *internal_node_right_child(parent) = child_page_num;
-    } else {
-        /* Make root for the new cell. */
-        uint32_t i;
-        for (i = original_num_keys; i > index; i--) {
-            void *destination = internal_node_cell(parent, i);
-            void *source = internal_node_cell(parent, i - 1);
-            memcpy(destination, source, INTERNAL_NODE_CELL_SIZE);
-        }
-        *internal_node_child(parent, index) = child_page_num;
-        *internal_node_key(parent, index) = child_max_key;
-    }
+/*
+ * Leave room for the length and status of a reply, which
+ * wire_end_reply() fills in once the body is written after them.
+ * Returns where the reply starts.
+ */
+size_t
+wire_begin_reply(RowBuffer *out)
+{
+    size_t start = out->length;
+
+    row_buffer_reserve(out, sizeof(uint32_t) + 1);
+    out->length += sizeof(uint32_t) + 1;
+    return start;
 }
 
 void
-update_internal_node_key(void *node, uint32_t old_key, uint32_t new_key)
+wire_end_reply(RowBuffer *out, size_t start, WireStatus status)
 {
-    uint32_t old_child_index = internal_node_find_child(node, old_key);
-    *internal_node_key(node, old_child_index) = new_key;
+    uint32_t length = out->length - start - sizeof(uint32_t);
+
+    memcpy(out->data + start, &length, sizeof(uint32_t));
+    out->data[start + sizeof(uint32_t)] = status;
 }
 
 int
 main(int argc, char *argv[])
 {
     char           *filename;
-    Table          *table;
+    Database       *db;
     InputBuffer    *input_buffer;
+    DbOptions       options;
+    char           *socket_path = NULL;
+    uint32_t        port = 0;
+    int             opt;
+
+    options.pool_frames = DEFAULT_POOL_FRAMES;
+    options.read_only = false;
+    options.io_backend = IO_BACKEND_SYNC;
+    options.sync_mode = SYNC_NORMAL;
+    options.page_size = DEFAULT_PAGE_SIZE;
+    options.search_kernel = KEY_SEARCH_AUTO;
+    options.scan_threads = 1;
+
+    while ((opt = getopt(argc, argv, "p:ri:s:P:k:t:l:L:")) != -1) {
+        switch (opt) {
+        case 'p':
+            options.pool_frames = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            options.read_only = true;
+            break;
+        case 'i':
+            if (strcmp(optarg, "uring") == 0) {
+                options.io_backend = IO_BACKEND_URING;
+            } else if (strcmp(optarg, "sync") == 0) {
+                options.io_backend = IO_BACKEND_SYNC;
+            } else {
+                printf("Unknown I/O backend '%s'\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 's':
+            if (strcmp(optarg, "off") == 0) {
+                options.sync_mode = SYNC_OFF;
+            } else if (strcmp(optarg, "normal") == 0) {
+                options.sync_mode = SYNC_NORMAL;
+            } else if (strcmp(optarg, "full") == 0) {
+                options.sync_mode = SYNC_FULL;
+            } else {
+                printf("Unknown sync mode '%s'\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'P':
+            options.page_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'k':
+            if (strcmp(optarg, "auto") == 0) {
+                options.search_kernel = KEY_SEARCH_AUTO;
+            } else if (strcmp(optarg, "scalar") == 0) {
+                options.search_kernel = KEY_SEARCH_SCALAR;
+            } else if (strcmp(optarg, "sse4") == 0) {
+                options.search_kernel = KEY_SEARCH_SSE4;
+            } else if (strcmp(optarg, "avx2") == 0) {
+                options.search_kernel = KEY_SEARCH_AVX2;
+            } else {
+                printf("Unknown search kernel '%s'\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 't':
+            options.scan_threads = strtoul(optarg, NULL, 10);
+            break;
+        case 'l':
+            socket_path = optarg;
+            break;
+        case 'L':
+            port = strtoul(optarg, NULL, 10);
+            if (port == 0 || port > UINT16_MAX) {
+                printf("Port must be between 1 and %d.\n", UINT16_MAX);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        default:
+            printf("Usage: %s [-r] [-p pool_frames] [-i sync|uring] "
+                   "[-s off|normal|full] [-P page_size] "
+                   "[-k auto|scalar|sse4|avx2] [-t scan_threads] "
+                   "[-l socket_path | -L port] filename\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
 
-    if (argc < 2) {
+    if (optind >= argc) {
         printf("Must supply a database filename.\n");
         exit(EXIT_FAILURE);
     }
 
-    filename = argv[1];
-    table = db_open(filename);
+    filename = argv[optind];
+    db = db_open(filename, &options);
+    if (socket_path != NULL || port != 0) {
+        server_run(db, server_listen(socket_path, port));
+        db_close(db);
+        if (socket_path != NULL) {
+            unlink(socket_path);
+        }
+        return 0;
+    }
     input_buffer = new_input_buffer();
 
     while (true) {
@@ -1097,7 +8749,7 @@ main(int argc, char *argv[])
         read_input(input_buffer);
 
         if (input_buffer->buffer[0] == '.') {
-            switch (do_meta_command(input_buffer, table)) {
+            switch (do_meta_command(input_buffer, db)) {
             case META_COMMAND_SUCCESS:
                 continue;
             case META_COMMAND_UNRECOGNIZED_COMMAND:
@@ -1125,7 +8777,7 @@ main(int argc, char *argv[])
             continue;
         }
 
-        switch (execute_statement(&statement, table)) {
+        switch (execute_statement(&statement, db)) {
         case EXECUTE_SUCCESS:
             printf("Executed.\n");
             break;
@@ -1135,6 +8787,21 @@ main(int argc, char *argv[])
         case EXECUTE_TABLE_FULL:
             printf("Error: Table full.\n");
             break;
+        case EXECUTE_READ_ONLY:
+            printf("Error: Database is read-only.\n");
+            break;
+        case EXECUTE_INDEX_EXISTS:
+            printf("Error: Index already exists.\n");
+            break;
+        case EXECUTE_TABLE_EXISTS:
+            printf("Error: Table already exists.\n");
+            break;
+        case EXECUTE_CATALOG_FULL:
+            printf("Error: Too many tables.\n");
+            break;
+        case EXECUTE_NO_TABLE:
+            printf("Error: No such table.\n");
+            break;
         case EXECUTE_UNKNOWN_STMT:
             printf("Error: Unknown statement.\n");
             break;
@@ -1,27 +1,61 @@
+require "socket"
+
 describe 'database' do
   before do
-    `rm -rf test.db`
+    `rm -rf test.db test.db.wal`
   end
 
-  def run_script(commands)
+  def run_script(commands, options = "")
     raw_output = nil
-    IO.popen("./db test.db", "r+") do |pipe|
-      commands.each do |command|
-        begin
-          pipe.puts command
-        rescue Errno::EPIPE
-          break
+    IO.popen("./db #{options} test.db", "r+") do |pipe|
+      # Write from another thread so a long script cannot fill the
+      # output pipe and block both ends.
+      writer = Thread.new do
+        commands.each do |command|
+          begin
+            pipe.puts command
+          rescue Errno::EPIPE
+            break
+          end
         end
-      end
 
-      pipe.close_write
+        pipe.close_write
+      end
 
       # Read entire output
       raw_output = pipe.gets(nil)
+      writer.join
     end
     raw_output.split("\n")
   end
 
+  # Parse the output of .btree into the leaf keys and the depth of each
+  # leaf.
+  def parse_tree(lines)
+    keys = []
+    leaf_depths = []
+    lines.each do |line|
+      if line =~ /^( *)- leaf/
+        leaf_depths << $1.length / 2
+      elsif line =~ /^ *- (\d+)$/
+        keys << $1.to_i
+      end
+    end
+    [keys, leaf_depths.uniq]
+  end
+
+  # A username and email as long as they may be. Thirteen rows of them
+  # fill a leaf.
+  def long_strings(i)
+    suffix = "@example.com"
+    ["user#{i}".ljust(32, "_"),
+     "person#{i}".ljust(255 - suffix.length, "_") + suffix]
+  end
+
+  def long_insert(i)
+    "insert #{i} #{long_strings(i).join(" ")}"
+  end
+
   it 'inserts and retreives a row' do
        result = run_script([
          "insert 1 user1 person1@example.com",
@@ -57,15 +91,17 @@ describe 'database' do
     ])
   end
 
-  it 'prints error message when table is full' do
+  it 'keeps inserting once internal nodes have to split' do
     script = (1..1401).map do |i|
       "insert #{i} user#{i} person#{i}@example.com"
     end
+    script << "select"
     script << ".exit"
     result = run_script(script)
+    expect(result.count { |line| line.end_with?("@example.com)") }).to eq(1401)
     expect(result.last(2)).to match_array([
-      "db > Executed.",
-      "db > Need to implement splitting internal node",
+      "Executed.",
+      "db > ",
     ])
   end
 
@@ -125,16 +161,39 @@ describe 'database' do
 
     expect(result).to match_array([
       "db > Constants:",
-      "ROW_SIZE: 293",
+      "PAGE_SIZE: 4096",
+      "ROW_MAX_SIZE: 295",
       "COMMON_NODE_HEADER_SIZE: 6",
-      "LEAF_NODE_HEADER_SIZE: 14",
-      "LEAF_NODE_CELL_SIZE: 297",
-      "LEAF_NODE_SPACE_FOR_CELLS: 4082",
-      "LEAF_NODE_MAX_CELLS: 13",
+      "LEAF_NODE_HEADER_SIZE: 22",
+      "LEAF_NODE_SLOT_SIZE: 2",
+      "LEAF_NODE_SPACE_FOR_CELLS: 4074",
+      "LEAF_NODE_MAX_LOCAL: 1006",
       "db > ",
     ])
   end
 
+  it 'keeps the page size a database was created with' do
+    script = (1..50).map { |i| long_insert(i) }
+    script << ".exit"
+    run_script(script, "-P 16384")
+    expect(File.size("test.db") % 16384).to eq(0)
+
+    result = run_script([".constants", ".btree", "select", ".exit"])
+    expect(result).to include("PAGE_SIZE: 16384")
+    expect(result).to include("LEAF_NODE_SPACE_FOR_CELLS: 16362")
+    expect(result).to include("db > Tree:", "- leaf (size 50)")
+    expect(result.count { |line| line =~ /^(db > )?\(\d+, / }).to eq(50)
+  end
+
+  it 'rejects a page size that is not a power of two from 4K to 64K' do
+    ["2048", "12288", "131072"].each do |size|
+      result = run_script([".exit"], "-P #{size}")
+      expect(result).to eq([
+        "Page size must be a power of two from 4096 to 65536.",
+      ])
+    end
+  end
+
   it 'allows printing out the structure of a one-node btree' do
     script = [3, 1, 2].map do |i|
       "insert #{i} user#{i} person#{i}@example.com"
@@ -174,18 +233,16 @@ describe 'database' do
   end
 
   it 'allows printing out the structure of a 3-leaf-node btree' do
-    script = (1..14).map do |i|
-      "insert #{i} user#{i} person#{i}@example.com"
-    end
+    script = (1..14).map { |i| long_insert(i) }
     script << ".btree"
-    script << "insert 15 user15 person15@example.com"
+    script << long_insert(15)
     script << ".exit"
     result = run_script(script)
 
     expect(result[14...(result.length)]).to match_array([
       "db > Tree:",
       "- internal (size 1)",
-      "  - leaf (size 7)",
+      "  - leaf (size 13)",
       "    - 1",
       "    - 2",
       "    - 3",
@@ -193,20 +250,34 @@ describe 'database' do
       "    - 5",
       "    - 6",
       "    - 7",
-      "  - key 7",
-      "  - leaf (size 7)",
       "    - 8",
       "    - 9",
       "    - 10",
       "    - 11",
       "    - 12",
       "    - 13",
+      "  - key 13",
+      "  - leaf (size 1)",
       "    - 14",
       "db > Executed.",
       "db > ",
     ])
   end
 
+  it 'keeps leaves full when keys arrive in increasing order' do
+    script = (1..1000).map { |i| long_insert(i) }
+    script << ".btree"
+    script << ".exit"
+    result = run_script(script)
+
+    sizes = result.grep(/- leaf \(size/).map { |line| line[/\d+/].to_i }
+    expect(sizes.size).to eq(77)
+    expect(sizes[0...-1].uniq).to eq([13])
+    tree_keys, leaf_depths = parse_tree(result)
+    expect(tree_keys).to eq((1..1000).to_a)
+    expect(leaf_depths).to eq([1])
+  end
+
   it 'prints all rows in a multi-level tree' do
     script = []
     (1..15).each do |i|
@@ -238,36 +309,36 @@ describe 'database' do
 
   it 'allows printing out the structure of a 4-leaf-node btree' do
     script = [
-      "insert 18 user18 person18@example.com",
-      "insert 7 user7 person7@example.com",
-      "insert 10 user10 person10@example.com",
-      "insert 29 user29 person29@example.com",
-      "insert 23 user23 person23@example.com",
-      "insert 4 user4 person4@example.com",
-      "insert 14 user14 person14@example.com",
-      "insert 30 user30 person30@example.com",
-      "insert 15 user15 person15@example.com",
-      "insert 26 user26 person26@example.com",
-      "insert 22 user22 person22@example.com",
-      "insert 19 user19 person19@example.com",
-      "insert 2 user2 person2@example.com",
-      "insert 1 user1 person1@example.com",
-      "insert 21 user21 person21@example.com",
-      "insert 11 user11 person11@example.com",
-      "insert 6 user6 person6@example.com",
-      "insert 20 user20 person20@example.com",
-      "insert 5 user5 person5@example.com",
-      "insert 8 user8 person8@example.com",
-      "insert 9 user9 person9@example.com",
-      "insert 3 user3 person3@example.com",
-      "insert 12 user12 person12@example.com",
-      "insert 27 user27 person27@example.com",
-      "insert 17 user17 person17@example.com",
-      "insert 16 user16 person16@example.com",
-      "insert 13 user13 person13@example.com",
-      "insert 24 user24 person24@example.com",
-      "insert 25 user25 person25@example.com",
-      "insert 28 user28 person28@example.com",
+      long_insert(18),
+      long_insert(7),
+      long_insert(10),
+      long_insert(29),
+      long_insert(23),
+      long_insert(4),
+      long_insert(14),
+      long_insert(30),
+      long_insert(15),
+      long_insert(26),
+      long_insert(22),
+      long_insert(19),
+      long_insert(2),
+      long_insert(1),
+      long_insert(21),
+      long_insert(11),
+      long_insert(6),
+      long_insert(20),
+      long_insert(5),
+      long_insert(8),
+      long_insert(9),
+      long_insert(3),
+      long_insert(12),
+      long_insert(27),
+      long_insert(17),
+      long_insert(16),
+      long_insert(13),
+      long_insert(24),
+      long_insert(25),
+      long_insert(28),
       ".btree",
       ".exit",
     ]
@@ -317,4 +388,686 @@ describe 'database' do
     ])
   end
 
+  it 'packs rows by their length and reuses the space of deleted ones' do
+    script = (1..300).map { |i| "insert #{i} u#{i} e#{i}" }
+    script << "delete 1 100"
+    script += (1..6).map { |i| long_insert(i) }
+    script << ".btree"
+    script << "select"
+    script << ".exit"
+    result = run_script(script)
+
+    tree = result.grep(/^(db > )?(Tree:|- internal| *- leaf| *- key)/)
+    expect(tree).to eq([
+      "db > Tree:",
+      "- internal (size 2)",
+      "  - leaf (size 18)",
+      "  - key 112",
+      "  - leaf (size 88)",
+      "  - key 200",
+      "  - leaf (size 100)",
+    ])
+    rows = result.select { |line| line =~ /^(db > )?\(\d+, / }
+    expect(rows[0]).to eq("db > (1, #{long_strings(1).join(", ")})")
+    expect(rows[6]).to eq("(101, u101, e101)")
+    expect(rows.size).to eq(206)
+  end
+
+  it 'evicts pages from a small buffer pool without losing rows' do
+    expect(run_script([".exit"], "-p 11")).to eq([
+      "Buffer pool needs at least 12 frames.",
+    ])
+
+    script = (1..300).step(2).map { |i| long_insert(i) }
+    script += (2..300).step(2).each_slice(75).map do |ids|
+      "insert " + ids.map { |i| "#{i} #{long_strings(i).join(" ")}" }.join(" ")
+    end
+    script << "delete 61 240"
+    script << ".exit"
+    run_script(script, "-p 12")
+
+    result = run_script(["select", ".stats", ".exit"], "-p 12")
+    ids = (1..60).to_a + (241..300).to_a
+    rows = ids.map { |i| "(#{i}, #{long_strings(i).join(", ")})" }
+    rows[0] = "db > #{rows[0]}"
+    expect(result[0...120]).to eq(rows)
+    expect(result[120...122]).to eq([
+      "Executed.",
+      "db > Stats:",
+    ])
+    expect(result[122]).to eq("pool_frames: 12")
+    expect(result[125].sub(/\d+$/, "N")).to eq("pool_evictions: N")
+    expect(result[125].split(": ").last.to_i > 0).to eq(true)
+  end
+
+  it 'does not rewrite the file when only reading' do
+    script = (1..28).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".exit"
+    run_script(script)
+    mtime = File.mtime("test.db")
+
+    result = run_script(["select", ".stats", ".exit"], "-p 12")
+    expect(result).to include("bytes_written: 0")
+    expect(File.mtime("test.db")).to eq(mtime)
+  end
+
+  it 'grows the tree past two levels with random inserts' do
+    keys = (1..8000).to_a.shuffle(random: Random.new(42))
+    script = keys.map { |i| long_insert(i) }
+    script << ".btree"
+    script << ".exit"
+    result = run_script(script)
+
+    expect(result.count("db > Executed.")).to eq(8000)
+    expect(result[8000...8002]).to match_array([
+      "db > Tree:",
+      "- internal (size 1)",
+    ])
+    tree_keys, leaf_depths = parse_tree(result)
+    expect(tree_keys).to eq((1..8000).to_a)
+    expect(leaf_depths).to eq([2])
+  end
+
+  it 'fits more keys in an internal node when they share a prefix' do
+    script = (1..7000).map { |i| long_insert(i) }
+    script << ".btree"
+    script << ".exit"
+    result = run_script(script)
+
+    # 539 leaves under one root, where 510 uncompressed keys would fit.
+    expect(result[7000...7002]).to match_array([
+      "db > Tree:",
+      "- internal (size 538)",
+    ])
+    tree_keys, leaf_depths = parse_tree(result)
+    expect(tree_keys).to eq((1..7000).to_a)
+    expect(leaf_depths).to eq([1])
+  end
+
+  it 'serves a read-only database without modifying it' do
+    script = (1..30).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".exit"
+    run_script(script)
+    mtime = File.mtime("test.db")
+
+    result = run_script([
+      "insert 31 user31 person31@example.com",
+      "select",
+      ".exit",
+    ], "-r")
+    expect(result[0]).to eq("db > Error: Database is read-only.")
+    expect(result.count { |line| line.end_with?("@example.com)") }).to eq(30)
+    expect(File.mtime("test.db")).to eq(mtime)
+  end
+
+  it 'batches reads with the io_uring backend' do
+    keys = (1..2000).to_a.shuffle(random: Random.new(7))
+    script = keys.map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".exit"
+    run_script(script)
+
+    read_syscalls = {}
+    %w[sync uring].each do |backend|
+      result = run_script(["select", ".stats", ".exit"], "-p 16 -i #{backend}")
+      rows = result.select { |line| line.end_with?("@example.com)") }
+      expect(rows.size).to eq(2000)
+      stat = result.find { |line| line.start_with?("read_syscalls: ") }
+      read_syscalls[backend] = stat.split(": ").last.to_i
+    end
+    expect(read_syscalls["uring"] < read_syscalls["sync"]).to eq(true)
+  end
+
+  it 'reads ahead of a full scan' do
+    keys = (1..2000).to_a.shuffle(random: Random.new(7))
+    script = keys.map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".exit"
+    run_script(script)
+
+    result = run_script(["select", ".stats", ".exit"], "-p 16")
+    rows = result.select { |line| line.end_with?("@example.com)") }
+    expect(rows.map { |line| line[/\d+/].to_i }).to eq((1..2000).to_a)
+    stat = result.find { |line| line.start_with?("readahead_pages: ") }
+    expect(stat.split(": ").last.to_i > 0).to eq(true)
+  end
+
+  it 'recovers committed rows from the log after a crash' do
+    IO.popen("./db -p 12 test.db", "r+") do |pipe|
+      pipe.sync = true
+      (1..300).each do |i|
+        pipe.puts "insert #{i} user#{i} person#{i}@example.com"
+      end
+      executed = 0
+      executed += 1 while executed < 300 && pipe.gets("Executed.")
+      Process.kill("KILL", pipe.pid)
+    end
+    expect(File.size("test.db.wal") > 0).to eq(true)
+
+    # A torn frame at the end of the log must be ignored.
+    File.open("test.db.wal", "ab") { |f| f.write("\xff" * 3000) }
+
+    result = run_script(["select", ".exit"])
+    rows = result.select { |line| line.end_with?("@example.com)") }
+    expect(rows.map { |line| line[/\d+/].to_i }).to eq((1..300).to_a)
+    expect(File.exist?("test.db.wal")).to eq(false)
+  end
+
+  it 'syncs the log on every commit in full sync mode' do
+    script = (1..10).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".stats"
+    script << ".exit"
+    result = run_script(script, "-s full")
+
+    commits = result.find { |line| line.start_with?("wal_commits: ") }
+    syncs = result.find { |line| line.start_with?("wal_syncs: ") }
+    expect(commits).to eq("wal_commits: 11")
+    expect(syncs).to eq("wal_syncs: 11")
+  end
+
+  it 'bulk loads rows into full leaves' do
+    keys = (1..1000).to_a.shuffle(random: Random.new(3))
+    lines = keys.map { |i| "#{i} #{long_strings(i).join(" ")}\n" }
+    File.write("test_rows.txt", lines.join)
+
+    result = run_script([".load test_rows.txt", ".btree", "select", ".exit"])
+    File.delete("test_rows.txt")
+
+    expect(result[0]).to eq("db > Loaded 1000 rows.")
+    expect(result[1...3]).to match_array([
+      "db > Tree:",
+      "- internal (size 76)",
+    ])
+    tree_keys, leaf_depths = parse_tree(result)
+    expect(tree_keys).to eq((1..1000).to_a)
+    expect(leaf_depths).to eq([1])
+    sizes = result.grep(/- leaf \(size/).map { |line| line[/\d+/].to_i }
+    expect(sizes.min >= 12).to eq(true)
+    rows = result.select { |line| line.end_with?("@example.com)") }
+    expect(rows.size).to eq(1000)
+  end
+
+  it 'inserts many rows from one statement as a batch' do
+    keys = (1..2000).to_a.shuffle(random: Random.new(5))
+    script = keys.select(&:even?).map { |i| long_insert(i) }
+    batch = keys.select(&:odd?).map { |i| "#{i} #{long_strings(i).join(" ")}" }
+    script << "insert #{batch.join(" ")}"
+    script << "insert 2001 a a@example.com 7 b b@example.com"
+    script << ".btree"
+    script << ".exit"
+    result = run_script(script)
+
+    expect(result.count("db > Executed.")).to eq(1001)
+    expect(result[1001]).to eq("db > Error: Duplicate key.")
+    tree_keys, leaf_depths = parse_tree(result)
+    expect(tree_keys).to eq((1..2000).to_a)
+    expect(leaf_depths).to eq([1])
+  end
+
+  it 'upgrades a database written before the meta page' do
+    # A root leaf on page 0 holding one row, as files used to start.
+    header = [1, 1, 0, 1, 0].pack("CCVVV")
+    row = [1].pack("V") + "user1".ljust(33, "\0") +
+          "person1@example.com".ljust(256, "\0")
+    page = header + [1].pack("V") + row
+    File.binwrite("test.db", page.ljust(4096, "\0"))
+
+    result = run_script([
+      "insert 2 user2 person2@example.com",
+      "select",
+      ".exit",
+    ])
+    expect(result).to match_array([
+      "db > Executed.",
+      "db > (1, user1, person1@example.com)",
+      "(2, user2, person2@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+    expect(File.size("test.db")).to eq(2 * 4096)
+  end
+
+  it 'vacuums without moving anything when no page is free' do
+    script = (1..100).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".vacuum"
+    script << ".exit"
+    result = run_script(script)
+    expect(result[-2]).to eq("db > Reclaimed 0 pages.")
+    size = File.size("test.db")
+
+    result = run_script(["select", ".vacuum", ".exit"])
+    expect(result.count { |line| line.end_with?("@example.com)") }).to eq(100)
+    expect(result[-2]).to eq("db > Reclaimed 0 pages.")
+    expect(File.size("test.db")).to eq(size)
+  end
+
+  it 'deletes rows and frees the leaves it empties' do
+    script = (1..100).map { |i| long_insert(i) }
+    script << "delete 1 60"
+    script << "delete 75"
+    script << "delete 200"
+    script << ".btree"
+    script << ".stats"
+    script << ".vacuum"
+    script << ".exit"
+    result = run_script(script)
+
+    tree = result.grep(/^(db > )?(Tree:|- internal| *- leaf| *- key)/)
+    expect(tree).to eq([
+      "db > Tree:",
+      "- internal (size 3)",
+      "  - leaf (size 9)",
+      "  - key 69",
+      "  - leaf (size 8)",
+      "  - key 78",
+      "  - leaf (size 13)",
+      "  - key 91",
+      "  - leaf (size 9)",
+    ])
+    expect(result).to include("free_pages: 4")
+    expect(result).to include("db > Reclaimed 4 pages.")
+    expect(File.size("test.db")).to eq(6 * 4096)
+
+    result = run_script(["select", ".exit"])
+    rows = result.select { |line| line.end_with?("@example.com)") }
+    expect(rows.map { |line| line[/\d+/].to_i }).to eq((61..100).to_a - [75])
+  end
+
+  it 'keeps a valid tree while deleting random keys' do
+    keys = (1..2000).to_a.shuffle(random: Random.new(5))
+    script = keys.map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    deleted = keys.shuffle(random: Random.new(6)).first(1700)
+    script += deleted.map { |i| "delete #{i}" }
+    script << ".btree"
+    script << ".exit"
+    result = run_script(script)
+
+    tree_keys, leaf_depths = parse_tree(result)
+    expect(tree_keys).to eq((1..2000).to_a - deleted)
+    expect(leaf_depths.uniq.size).to eq(1)
+    sizes = result.grep(/- leaf \(size/).map { |line| line[/\d+/].to_i }
+    expect(sizes.min >= 6).to eq(true)
+  end
+
+  it 'selects a range of ids without scanning the table' do
+    keys = (1..2000).to_a.shuffle(random: Random.new(9))
+    script = keys.map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".exit"
+    run_script(script)
+
+    result = run_script([
+      "select where id between 995 and 1004",
+      "select where id between 1990 and 3000",
+      "select where id = 2001",
+      "select where id between 7 and 3",
+      ".exit",
+    ])
+    rows = result.select { |line| line.end_with?("@example.com)") }
+    expect(rows.map { |line| line[/\d+/].to_i }).to eq(
+      (995..1004).to_a + (1990..2000).to_a)
+    expect(result).to include("db > Syntax error. Could not parse statement.")
+
+    # The meta page, the root and one leaf.
+    result = run_script(["select where id = 1234", ".stats", ".exit"])
+    expect(result[0]).to eq("db > (1234, user1234, person1234@example.com)")
+    expect(result).to include("pool_misses: 3")
+  end
+
+  it 'prints the same rows in order from a parallel scan' do
+    keys = (1..2000).to_a.shuffle(random: Random.new(13))
+    script = keys.map { |i| long_insert(i) }
+    script << ".exit"
+    run_script(script)
+
+    script = ["select", "select where id between 500 and 1500", ".exit"]
+    serial = run_script(script)
+    parallel = run_script(script, "-t 4")
+
+    rows = serial.select { |line| line.end_with?("@example.com)") }
+    expect(rows.map { |line| line[/\d+/].to_i }).to eq(
+      (1..2000).to_a + (500..1500).to_a)
+    expect(parallel).to eq(serial)
+  end
+
+  it 'computes aggregates of the ids without printing the rows' do
+    keys = (1..2000).to_a.shuffle(random: Random.new(17))
+    script = keys.map { |i| long_insert(i) }
+    script << "delete 1000 1100"
+    script << ".exit"
+    run_script(script)
+
+    result = run_script([
+      "select count(*)",
+      "select sum(id)",
+      "select min(id)",
+      "select max(id)",
+      "select count(*) where id between 990 and 1200",
+      "select min(id) where id between 990 and 1200",
+      "select max(id) where id between 1 and 1050",
+      "select count(*) where id between 1000 and 1100",
+      "select max(id) where id between 1000 and 1100",
+      "select sum(id) where id = 1500",
+      "select avg(id)",
+      ".exit",
+    ])
+    expect(result.reject { |line| line == "Executed." }).to eq([
+      "db > (1899)",
+      "db > (1894950)",
+      "db > (1)",
+      "db > (2000)",
+      "db > (110)",
+      "db > (990)",
+      "db > (999)",
+      "db > (0)",
+      "db > (NULL)",
+      "db > (1500)",
+      "db > Syntax error. Could not parse statement.",
+      "db > ",
+    ])
+
+    # Ranges that end in the gap before a leaf's first key, whose answer
+    # is the largest key of the leaf before.
+    `rm -rf test.db test.db.wal`
+    script = (1..2000).map { |i| long_insert(3 * i) }
+    script << ".btree"
+    script << ".exit"
+    result = run_script(script)
+    starts = result.each_index.select { |i| result[i] =~ /- leaf/ }
+                   .map { |i| result[i + 1][/\d+/].to_i }
+    starts.delete(3)
+    expect(starts.size > 10).to eq(true)
+    result = run_script(starts.map { |k| "select max(id) where id between 1 and #{k - 1}" } +
+                        ["select max(id) where id between 4 and 5", ".exit"])
+    expect(result.reject { |line| line == "Executed." }).to eq(
+      starts.map { |k| "db > (#{k - 3})" } + ["db > (NULL)", "db > "])
+  end
+
+  it 'finds rows by email through an index kept up to date' do
+    keys = (1..2000).to_a.shuffle(random: Random.new(19))
+    script = keys.map do |i|
+      "insert #{i} user#{i} person#{i % 500}@example.com"
+    end
+    script << ".exit"
+    run_script(script)
+
+    query = "select where email = person7@example.com"
+    scanned = run_script([query, ".exit"])
+    expect(scanned.length).to eq(6)
+
+    result = run_script([
+      "create index on users(email)",
+      "create index on users(email)",
+      query,
+      "insert 2001 user2001 person7@example.com",
+      "delete 507",
+      "delete 1000 1500",
+      ".exit",
+    ])
+    expect(result[0]).to eq("db > Executed.")
+    expect(result[1]).to eq("db > Error: Index already exists.")
+    expect(result[2..6]).to eq(scanned[0..4])
+
+    # The meta page, the root and a leaf of the index, then the root of
+    # the table and a leaf for each row.
+    result = run_script([query, ".stats", ".exit"])
+    expect(result[0..3]).to eq([
+      "db > (7, user7, person7@example.com)",
+      "(1507, user1507, person7@example.com)",
+      "(2001, user2001, person7@example.com)",
+      "Executed.",
+    ])
+    expect(result).to include("pool_misses: 7")
+  end
+
+  it 'indexes a username shared by many rows in one entry' do
+    script = ["create index on users(username)"]
+    script += (1..3000).each_slice(300).map do |ids|
+      "insert " + ids.map { |i| "#{i} user#{i % 2} person#{i}@example.com" }.join(" ")
+    end
+    script += (3001..3200).map { |i| "insert #{i} user0 person#{i}@example.com" }
+    script << "delete 11 2990"
+    script << "select where username = user0"
+    script << ".exit"
+    result = run_script(script)
+
+    expected = ((1..10).to_a + (2991..3000).to_a).select(&:even?) +
+               (3001..3200).to_a
+    expect(result[-2 - expected.size..-3]).to eq(
+      ["db > " + "(#{expected[0]}, user0, person#{expected[0]}@example.com)"] +
+      expected[1..].map { |i| "(#{i}, user0, person#{i}@example.com)" })
+
+    result = run_script(["select where username = user1", ".exit"])
+    rows = result.select { |line| line.end_with?("@example.com)") }
+    expect(rows.map { |line| line[/\d+/].to_i }).to eq(
+      ((1..10).to_a + (2991..3000).to_a).select(&:odd?))
+  end
+
+  it 'keeps tables apart in one file' do
+    script = [
+      "create table orders",
+      "create table orders",
+      "create table bad-name",
+      "insert 1 user1 person1@example.com",
+    ]
+    script += (1..300).map do |i|
+      "insert into orders #{i} item#{i} buyer#{i % 3}@example.com"
+    end
+    script << ".exit"
+    result = run_script(script)
+    expect(result[0..2]).to eq([
+      "db > Executed.",
+      "db > Error: Table already exists.",
+      "db > Syntax error. Could not parse statement.",
+    ])
+
+    result = run_script([
+      ".tables",
+      "create index on orders(email)",
+      "delete from orders 10 300",
+      "select count(*)",
+      "select count(*) from orders",
+      "select from orders where email = buyer1@example.com",
+      "select from customers",
+      ".vacuum",
+      ".exit",
+    ])
+    expect(result).to eq([
+      "db > users",
+      "orders",
+      "db > Executed.",
+      "db > Executed.",
+      "db > (1)",
+      "Executed.",
+      "db > (9)",
+      "Executed.",
+      "db > (1, item1, buyer1@example.com)",
+      "(4, item4, buyer1@example.com)",
+      "(7, item7, buyer1@example.com)",
+      "Executed.",
+      "db > Error: No such table.",
+      "db > Reclaimed 3 pages.",
+      "db > ",
+    ])
+
+    result = run_script(["select", "select from orders where id = 9", ".exit"])
+    expect(result).to eq([
+      "db > (1, user1, person1@example.com)",
+      "Executed.",
+      "db > (9, item9, buyer0@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'answers pipelined requests over the binary protocol' do
+    row = lambda do |id, username, email|
+      [id, username.size].pack("Vv") + username + [email.size].pack("v") +
+        email
+    end
+    frame = ->(op, body) { [body.size + 1, op].pack("VC") + body }
+
+    `rm -f test.sock`
+    pid = spawn("./db -l test.sock test.db")
+    begin
+      sleep 0.01 until File.exist?("test.sock")
+      socket = UNIXSocket.new("test.sock")
+      socket.write([
+        frame.(1, row.(2, "user2", "person2@example.com")),
+        frame.(2, [3].pack("V") + row.(5, "user5", "person5@example.com") +
+                  row.(1, "user1", "person1@example.com") +
+                  row.(4, "user4", "person4@example.com")),
+        frame.(1, row.(4, "user4", "person4@example.com")),
+        frame.(3, [4].pack("V")),
+        frame.(3, [3].pack("V")),
+        frame.(4, [2, 4].pack("VV")),
+        frame.(2, [2].pack("V") + row.(6, "user6", "person6@example.com")),
+        frame.(1, row.(3_000_000_000, "big", "big@example.com")),
+        frame.(2, [2].pack("V") + row.(7, "user7", "person7@example.com") +
+                  row.(2_147_483_648, "big", "big@example.com")),
+      ].join)
+      socket.close_write
+      replies = []
+      while (header = socket.read(4))
+        replies << socket.read(header.unpack1("V"))
+      end
+      socket.close
+    ensure
+      Process.kill("TERM", pid)
+      Process.wait(pid)
+    end
+
+    expect(replies).to eq([
+      "\x00",
+      "\x00",
+      "\x02",
+      "\x00" + row.(4, "user4", "person4@example.com"),
+      "\x01",
+      "\x00" + [2].pack("V") + row.(2, "user2", "person2@example.com") +
+        row.(4, "user4", "person4@example.com"),
+      "\x05",
+      "\x05",
+      "\x05",
+    ].map { |reply| reply.force_encoding("BINARY") })
+    expect(File.exist?("test.sock")).to eq(false)
+
+    result = run_script(["select count(*)", ".exit"])
+    expect(result[0]).to eq("db > (4)")
+  end
+
+  it 'splits a range reply that would outgrow the buffer' do
+    row = lambda do |id, username, email|
+      [id, username.size].pack("Vv") + username + [email.size].pack("v") +
+        email
+    end
+    frame = ->(op, body) { [body.size + 1, op].pack("VC") + body }
+    rows = (1..20_000).map { |i| row.(i, "user#{i}", "a" * 255) }
+
+    `rm -f test.sock`
+    pid = spawn("./db -l test.sock test.db")
+    begin
+      sleep 0.01 until File.exist?("test.sock")
+      socket = UNIXSocket.new("test.sock")
+      read_reply = lambda do
+        socket.read(socket.read(4).unpack1("V")).force_encoding("BINARY")
+      end
+      socket.write(frame.(2, [rows.size].pack("V") + rows.join))
+      expect(read_reply.()).to eq("\x00")
+
+      socket.write(frame.(4, [1, 0xffffffff].pack("VV")))
+      first = read_reply.()
+      count = first[1, 4].unpack1("V")
+      expect(first[0]).to eq("\x06")
+      expect(count.between?(1, rows.size - 1)).to eq(true)
+      expect(first[5..]).to eq(rows[0, count].join.force_encoding("BINARY"))
+
+      socket.write(frame.(4, [count + 1, 0xffffffff].pack("VV")))
+      rest = read_reply.()
+      expect(rest[0]).to eq("\x00")
+      expect(rest[1, 4].unpack1("V")).to eq(rows.size - count)
+      expect(rest[5..]).to eq(rows[count..].join.force_encoding("BINARY"))
+      socket.close
+    ensure
+      Process.kill("TERM", pid)
+      Process.wait(pid)
+    end
+  end
+
+  it 'finds the same rows with every key search kernel' do
+    keys = (1..4000).to_a.shuffle(random: Random.new(11)).map { |i| i * 97 }
+    script = keys.map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".exit"
+    run_script(script, "-k scalar")
+
+    lookups = [1, 97, 98, 194, 5000, 96_999, 97_000, 193_903, 388_000, 388_001]
+    script = lookups.map { |i| "select where id = #{i}" }
+    script << "select where id between 20000 and 21000"
+    script << "delete 1000 300000"
+    script << ".exit"
+    results = ["scalar", "sse4", "avx2"].map do |kernel|
+      `cp test.db kernel.db`
+      result = run_script(script, "-k #{kernel}")
+      `cp kernel.db test.db && rm -f kernel.db`
+      result
+    end
+
+    rows = results[0].select { |line| line.end_with?("@example.com)") }
+    expect(rows.map { |line| line[/\d+/].to_i }).to eq(
+      [97, 194, 97_000, 193_903, 388_000] + (207..216).map { |i| i * 97 })
+    expect(results[1]).to eq(results[0])
+    expect(results[2]).to eq(results[0])
+  end
+
+  it 'keeps a valid tree after inserting 10M random keys' do
+    skip "set STRESS=1 to run" unless ENV["STRESS"]
+
+    count = Integer(ENV.fetch("STRESS_ROWS", "10000000"))
+    keys = (1..count).to_a.shuffle(random: Random.new(42))
+    executed = 0
+    tree_keys = []
+    leaf_depths = []
+
+    IO.popen("./db test.db", "r+") do |pipe|
+      writer = Thread.new do
+        keys.each { |i| pipe.puts "insert #{i} user#{i} person#{i}@example.com" }
+        pipe.puts ".btree"
+        pipe.puts ".exit"
+        pipe.close_write
+      end
+
+      # Stream the output instead of holding it all in memory.
+      pipe.each_line do |line|
+        line.chomp!
+        if line == "db > Executed."
+          executed += 1
+        elsif line =~ /^( *)- leaf/
+          leaf_depths << $1.length / 2 unless leaf_depths.include?($1.length / 2)
+        elsif line =~ /^ *- (\d+)$/
+          tree_keys << $1.to_i
+        end
+      end
+      writer.join
+    end
+
+    expect(executed).to eq(count)
+    expect(tree_keys.length).to eq(count)
+    expect(tree_keys.each_cons(2).all? { |a, b| a < b }).to eq(true)
+    expect(leaf_depths.length).to eq(1)
+  end
+
 end